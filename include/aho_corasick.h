@@ -0,0 +1,52 @@
+#pragma once
+
+#include "hits.h"
+#include "options.h"
+#include "patterns.h"
+
+/* Exact multi-pattern engine (Aho-Corasick), used instead of one scan per
+ * pattern when approximation_factor is 0: a single pass over the database
+ * finds every pattern, whatever their number.
+ *
+ * The automaton is a full DFA over byte classes: each byte found in the
+ * patterns has its own class, every other byte shares class 0 (which always
+ * leads back to the root). With DNA this gives ~5 columns per state, so the
+ * table stays small and a step is one load: delta[row + class[c]].
+ *
+ * Entries of delta are row offsets (state * nb_classes), flagged with
+ * AC_OUTPUT when a pattern ends in the target state.
+ */
+
+// Below this number of patterns, the drivers keep one scan per pattern
+#define AC_MIN_PATTERNS 4
+
+#define AC_OUTPUT 0x80000000u
+
+struct ac_automaton {
+    int nb_patterns;
+    int nb_states;
+    int nb_classes;
+    int max_length;
+    unsigned char classes[256];
+    unsigned int *delta;  // nb_states * nb_classes
+    int *first;           // per state: first pattern ending there, or -1
+    int *dict;  // per state: closest suffix state where a pattern ends, or -1
+    int *next_same;  // per pattern: next identical pattern, or -1
+    char **pattern;
+    int *length;
+    int *slot;  // result slot of each pattern (hits)
+};
+
+int use_multi_pattern_engine(int approx_factor, int nb_patterns,
+                             struct apm_options *opts);
+
+int ac_build(struct ac_automaton *ac, char **pattern, int *length, int *slot,
+             int nb_patterns);
+void ac_free(struct ac_automaton *ac);
+
+void ac_scan(struct ac_automaton *ac, char *buf, int n_bytes, int start,
+             int end, int *counts, struct hit_buffer *hits);
+
+int ac_search(struct pattern_set *set, int *mine, int nb_mine, int nb_strands,
+              char *buf, int n_bytes, int start, int end, int *counts,
+              struct hit_buffer *hits);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "hits.h"
+
+/* libapm: the search engine of apm as a library, without MPI
+ * (make lib builds libapm.a and libapm.so).
+ *
+ * The database is loaded once. A search context owns the DP buffers and
+ * the per-thread results of its threads, so that batches of patterns are
+ * searched in-process one after the other without reallocating anything:
+ *
+ *   struct apm_database *db = apm_open_database("dna/small_chrY.fa");
+ *   struct apm_search_options o;
+ *   struct apm_results r;
+ *
+ *   apm_default_options(&o);
+ *   o.approx_factor = 2;
+ *   struct apm_context *ctx = apm_create_context(db, &o);
+ *   apm_search(ctx, patterns, nb_patterns, &r);  // r.counts[i], ...
+ *   apm_free_results(&r);
+ *   ...
+ *   apm_destroy_context(ctx);
+ *   apm_close_database(db);
+ *
+ * Results use the slots of the command line tools: with nb_strands == 2,
+ * slot 2i is pattern i and slot 2i + 1 its reverse complement.
+ * Functions returning int return 0 on success, the others NULL on error.
+ */
+
+struct apm_database {
+    char *buf;
+    int n_bytes;
+};
+
+struct apm_search_options {
+    int approx_factor;
+    int nb_strands;    // 2 to also search the reverse complements (-r)
+    int hamming;       // count substitutions only (-s)
+    int histogram;     // count the matches at each distance (-H)
+    int collect_hits;  // return the position of every match (-o)
+    int nb_threads;    // 0 for the OpenMP default
+};
+
+struct apm_results {
+    int nb_results;          // nb_patterns * nb_strands
+    int *counts;             // nb_results
+    int *histograms;         // nb_results * (approx_factor + 1), or NULL
+    struct hit_buffer hits;  // empty unless collect_hits
+};
+
+struct apm_context;
+
+struct apm_database *apm_open_database(char *filename);
+struct apm_database *apm_database_from_buffer(const char *buf, int n_bytes);
+void apm_close_database(struct apm_database *db);
+
+void apm_default_options(struct apm_search_options *opts);
+
+struct apm_context *apm_create_context(struct apm_database *db,
+                                       const struct apm_search_options *opts);
+void apm_destroy_context(struct apm_context *ctx);
+
+int apm_search(struct apm_context *ctx, char **pattern, int nb_patterns,
+               struct apm_results *results);
+void apm_free_results(struct apm_results *results);
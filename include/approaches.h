@@ -1,7 +1,48 @@
+#include "apm.h"
+#include "options.h"
+#include "patterns.h"
 
+// Tags of the messages carrying the results of a worker to rank 0
+#define TAG_COUNTS 0
+#define TAG_HISTOGRAMS 1
+#define TAG_HITS 2
+#define TAG_TOPN 3
 
-// The hybrid approaches implemented:
+// Periodic progress of a worker, while it searches (progress.h)
+#define TAG_PROGRESS 4
+
+/* The accelerator of a worker, next to its OpenMP threads: thread 0 feeds it
+ * the chunks it pulls from the queue of the scan (chunk_queue.h), the other
+ * threads search the rest. It only counts matches (plain edit distance, no
+ * cpu_only_options()). */
+enum accelerator {
+    ACCEL_NONE,
+    ACCEL_CUDA,
+    // Thread 0 with the generic kernels, slower than the others: a second
+    // CPU backend in the place of the GPU, to test the split without one
+    ACCEL_SCALAR
+};
+
+// The hybrid approaches implemented (db: the resident database of the server
+// mode, NULL to read argv[2]):
 int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
-                               int cuda_device_exists);  // Lino
+                               int accelerator,
+                               struct apm_options *opts,
+                               struct pattern_set *patterns,
+                               struct apm_database *db);  // Lino
 int database_over_ranks(int argc, char **argv, int myRank,
-                        int numberProcesses, int cuda_device_exists);  // Paolo
\ No newline at end of file
+                        int numberProcesses, int accelerator,
+                        struct apm_options *opts,
+                        struct pattern_set *patterns,
+                        struct apm_database *db);  // Paolo
+
+int bcast_database(char *filename, int rank, struct apm_database *db);
+
+// One search, with the arguments of the command line (src/main.c).
+// accelerator: the one of the backend of the rank (enum accelerator).
+int run_query(int argc, char **argv, struct apm_options *opts, int rank,
+              int world_size, int accelerator, struct apm_database *db);
+
+// Server mode (-S, -b, -w; src/server.c)
+int serve(struct apm_options *opts, char *filename, int rank, int world_size,
+          int accelerator);
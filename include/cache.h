@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apm.h"
+#include "options.h"
+#include "patterns.h"
+
+/* Result cache (-C cache_dir, apm_parallel): rank 0 answers the patterns
+ * already searched in the same database, with the same approximation factor
+ * and mode (-r, -s), and only sends the others to the ranks.
+ *
+ * The database is identified by a hash of its content, so results never
+ * outlive a change of the file. Its hash is remembered in
+ * cache_dir/databases with the size, mtime and inode of the file, and is
+ * only computed again when one of them changes.
+ *
+ * The results of a database are appended to cache_dir/<hash>.results, one
+ * line per pattern, and loaded in a LRU of CACHE_CAPACITY entries when the
+ * cache is opened. In server mode the cache stays open between queries. The
+ * file is rewritten with the entries of the LRU only when it holds other
+ * lines at load time, or twice CACHE_CAPACITY lines in a server.
+ *
+ * Only counts and histograms are cached: queries with -o or -n bypass it.
+ */
+
+#define CACHE_CAPACITY (1 << 16)
+
+struct result_cache;
+
+// What rank 0 knows before dispatching a query
+struct cache_query {
+    struct pattern_set novel;  // the patterns the ranks must search
+    int nb_cached;
+    char *from_cache;  // per pattern: 1 when answered by the cache
+    int *counts;       // per result slot of the query
+    int *histograms;   // per result slot, approx_factor + 1 each
+};
+
+int cacheable_options(struct apm_options *opts);
+
+// The hash identifying a database or a pattern set (also in checkpoints)
+uint64_t content_hash(const char *data, size_t size);
+
+struct result_cache *cache_open(char *dir, char *filename,
+                                struct apm_database *db);
+
+int cache_prepare(struct result_cache *c, struct pattern_set *patterns,
+                  struct apm_options *opts, int approx_factor,
+                  struct cache_query *q);
+void cache_complete(struct result_cache *c, struct pattern_set *patterns,
+                    struct apm_options *opts, int approx_factor,
+                    struct cache_query *q, struct apm_results *searched);
+void cache_print(struct pattern_set *patterns, struct apm_options *opts,
+                 int approx_factor, struct cache_query *q);
+void cache_query_free(struct cache_query *q);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "apm.h"
+#include "options.h"
+#include "patterns.h"
+
+/* Checkpoints of a long search (-c file, apm_parallel): the patterns are
+ * searched in batches, one after the other, on the database loaded once.
+ * After each batch rank 0 appends the counts (and histograms) of its
+ * patterns to the file and syncs it, so a run killed by a node failure or a
+ * walltime limit only loses the batch in progress. The batches are sized
+ * from the speed of the previous one, to search about -i seconds each, in
+ * multiples of the number of workers.
+ *
+ * Run again with the same file, the search resumes: the patterns already in
+ * the file are not searched again. Its first line identifies the search
+ * (hashes of the database and of the patterns, approximation factor, -r, -s,
+ * -H); a file of another search is an error, and is left as is.
+ *
+ * Lines: pattern value... (its counts, then its histograms), pattern being
+ * its index in the search. A line cut by a crash is ignored.
+ */
+
+struct checkpoint {
+    char *path;
+    FILE *file;
+    int nb_patterns;
+    int nb_strands;
+    int hist_size;    // per pattern, 0 without -H
+    char *done;       // per pattern
+    int *counts;      // per result slot
+    int *histograms;  // per result slot, approx_factor + 1 each
+    int nb_done;
+    int next;  // first pattern neither searched nor in a batch
+
+    // Size of the batches
+    double interval;
+    int multiple;
+    int batch_size;  // the last one, 0 before the first one
+    double seconds;  // it took
+};
+
+/* Rank 0: opens the checkpoint of this search (created if it does not
+ * exist) and loads the results it holds */
+int checkpoint_open(struct checkpoint *c, char *path, struct apm_database *db,
+                    struct pattern_set *patterns, struct apm_options *opts,
+                    int approx_factor, int nb_workers);
+
+/* Rank 0: the patterns of the next batch in batch (nb_patterns at most),
+ * returns their number, 0 when all of them are searched */
+int checkpoint_next_batch(struct checkpoint *c, int *batch);
+
+/* Rank 0: the results of a batch (in its order), searched in seconds */
+int checkpoint_save(struct checkpoint *c, int *batch, int nb,
+                    struct apm_results *results, double seconds);
+
+// Prints the results of all the patterns, as the approaches do
+void checkpoint_print(struct checkpoint *c, struct pattern_set *patterns,
+                      int approx_factor);
+
+void checkpoint_close(struct checkpoint *c);
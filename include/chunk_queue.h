@@ -0,0 +1,57 @@
+#pragma once
+
+/* The work of a scan, shared by the compute backends of a rank: its OpenMP
+ * threads and, in thread 0, an accelerator (enum accelerator, approaches.h).
+ *
+ * The items (the windows of a pattern, or the patterns of a piece) are
+ * handed out in chunks: each consumer pulls its next chunk when it is done
+ * with the previous one, so that a faster backend takes more and the split
+ * between the accelerator and the threads follows their speeds on this
+ * hardware and these patterns, instead of a fixed ratio.
+ *
+ * A consumer first gets a probe of min_size items (at most an even split of
+ * a small scan). Then it gets half of its share of what is left, its share
+ * being its speed (items per second over its last chunks) over the speed of
+ * all the consumers: the chunks shrink as the queue empties, and a slow
+ * consumer never takes more than it can finish while the others empty the
+ * rest. The speeds are kept from a scan to the next one (the next pattern is
+ * usually as costly).
+ *
+ * Without an accelerator, the queue is static: one contiguous slice per
+ * thread, like schedule(static) (the threads first touched the pages of
+ * their slices, see alloc_database()).
+ */
+
+struct chunk_consumer;
+
+struct chunk_queue {
+    long long next;  // first item not handed out (atomic)
+    long long start;
+    long long end;
+    int dynamic;  // 0: one slice per consumer
+    int nb_consumers;
+    struct chunk_consumer *consumers;
+};
+
+/* Once for all the scans of nb_consumers (the threads of a region) */
+int chunk_queue_init(struct chunk_queue *q, int nb_consumers);
+void chunk_queue_free(struct chunk_queue *q);
+
+/* Before a scan of the items [start, end), by one thread */
+void chunk_queue_reset(struct chunk_queue *q, long long start, long long end,
+                       int dynamic);
+
+/* The next chunk of consumer c (dynamic: between min_size and max_size
+ * items): its first item in *first, returns its number of items, 0 when the
+ * queue is empty. */
+long long chunk_queue_pull(struct chunk_queue *q, int c, long long min_size,
+                           long long max_size, long long *first);
+
+/* Consumer c has processed the nb_items of its last chunk in seconds */
+void chunk_queue_done(struct chunk_queue *q, int c, long long nb_items,
+                      double seconds);
+
+/* On stderr, the share of the items and chunks of consumer 0 (named) and
+ * of the others (the threads) since chunk_queue_init() */
+void chunk_queue_report(struct chunk_queue *q, int rank, const char *name,
+                        const char *items);
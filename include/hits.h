@@ -0,0 +1,54 @@
+#pragma once
+
+/* Match positions, collected when apm runs with -o hits_file.
+ *
+ * Every thread appends to its own hit_buffer; buffers are merged per rank and
+ * gathered on rank 0, which writes them with write_hits() in the format:
+ *
+ *   "APMHITS1"                                  8 bytes magic
+ *   varint nb_patterns (result slots: 2 per pattern with -r, see utils.h)
+ *   for each pattern (in command line order):
+ *       varint n_hits
+ *       n_hits x (varint offset delta, varint distance)
+ *
+ * varints are unsigned LEB128. Offsets are global (from the beginning of the
+ * database file), sorted, and delta-encoded: the first delta is the offset
+ * itself. A typical hit thus costs 2-3 bytes.
+ */
+
+struct hit {
+    int pattern;
+    int offset;
+    int distance;
+};
+
+struct hit_buffer {
+    struct hit *hits;
+    int count;
+    int capacity;
+    int dropped;  // hits lost because the buffer could not grow
+};
+
+void hit_buffer_init(struct hit_buffer *b);
+void hit_buffer_free(struct hit_buffer *b);
+int hit_buffer_reserve(struct hit_buffer *b, int capacity);
+int hit_buffer_append(struct hit_buffer *dst, struct hit_buffer *src);
+
+static inline void hit_buffer_add(struct hit_buffer *b, int pattern, int offset,
+                                  int distance) {
+    if (b->count == b->capacity &&
+        hit_buffer_reserve(b, b->capacity ? 2 * b->capacity : 1024)) {
+        b->dropped++;
+        return;
+    }
+    b->hits[b->count].pattern = pattern;
+    b->hits[b->count].offset = offset;
+    b->hits[b->count].distance = distance;
+    b->count++;
+}
+
+int write_hits(char *filename, struct hit_buffer *b, int nb_patterns);
+
+// apm_parallel only (src/results_mpi.c)
+int send_hits(struct hit_buffer *b, int dest, int tag);
+int recv_hits(struct hit_buffer *b, int source, int tag);
@@ -0,0 +1,116 @@
+/* The Levenshtein kernels of one pattern length class (see utils.c).
+ *
+ * Included once per class, with:
+ *   LEV_LENGTH   the longest pattern of the class
+ *   LEV_CELL     the type of the cells, large enough for LEV_LENGTH + 1
+ *   LEV_NAME(f)  the name of kernel f in this class
+ *
+ * Same results as levenshtein(), levenshtein_bounded() and
+ * levenshtein_strands(), but the columns are local arrays of LEV_LENGTH + 1
+ * narrow cells: they cannot alias the pattern or the window, so the compiler
+ * keeps the cells it reuses in registers instead of reloading them after
+ * every store. The column argument is not used.
+ */
+
+static int LEV_NAME(levenshtein)(char *s1, char *s2, int len, int *unused) {
+    LEV_CELL column[LEV_LENGTH + 1];
+    unsigned int x, y, lastdiag, olddiag;
+
+    for (y = 1; y <= len; y++) {
+        column[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        char c = s2[x - 1];
+
+        column[0] = x;
+        lastdiag = x - 1;
+#pragma GCC unroll 8
+        for (y = 1; y <= len; y++) {
+            olddiag = column[y];
+            column[y] = MIN3(olddiag + 1, column[y - 1] + 1u,
+                             lastdiag + (s1[y - 1] != c));
+            lastdiag = olddiag;
+        }
+    }
+    return column[len];
+}
+
+static int LEV_NAME(levenshtein_bounded)(char *s1, char *s2, int len,
+                                         int *unused, int max) {
+    LEV_CELL column[LEV_LENGTH + 1];
+    unsigned int x, y, lastdiag, olddiag, column_min;
+
+    for (y = 1; y <= len; y++) {
+        column[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        char c = s2[x - 1];
+
+        column[0] = x;
+        column_min = x;
+        lastdiag = x - 1;
+#pragma GCC unroll 8
+        for (y = 1; y <= len; y++) {
+            olddiag = column[y];
+            column[y] = MIN3(olddiag + 1, column[y - 1] + 1u,
+                             lastdiag + (s1[y - 1] != c));
+            lastdiag = olddiag;
+            if (column[y] < column_min) {
+                column_min = column[y];
+            }
+        }
+        if (column_min > max) {
+            return max + 1;
+        }
+    }
+    return column[len];
+}
+
+static void LEV_NAME(levenshtein_strands)(char *s1, char *s1_rc, char *s2,
+                                          int len, int *unused, int max,
+                                          int *distances) {
+    LEV_CELL column[LEV_LENGTH + 1];
+    LEV_CELL column_rc[LEV_LENGTH + 1];
+    unsigned int x, y, lastdiag, olddiag, lastdiag_rc, olddiag_rc;
+    unsigned int column_min, column_min_rc;
+
+    for (y = 1; y <= len; y++) {
+        column[y] = y;
+        column_rc[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        char c = s2[x - 1];
+
+        column[0] = x;
+        column_rc[0] = x;
+        column_min = x;
+        column_min_rc = x;
+        lastdiag = x - 1;
+        lastdiag_rc = x - 1;
+#pragma GCC unroll 4
+        for (y = 1; y <= len; y++) {
+            olddiag = column[y];
+            column[y] = MIN3(olddiag + 1, column[y - 1] + 1u,
+                             lastdiag + (s1[y - 1] != c));
+            lastdiag = olddiag;
+            if (column[y] < column_min) {
+                column_min = column[y];
+            }
+
+            olddiag_rc = column_rc[y];
+            column_rc[y] = MIN3(olddiag_rc + 1, column_rc[y - 1] + 1u,
+                                lastdiag_rc + (s1_rc[y - 1] != c));
+            lastdiag_rc = olddiag_rc;
+            if (column_rc[y] < column_min_rc) {
+                column_min_rc = column_rc[y];
+            }
+        }
+        if (column_min > max && column_min_rc > max) {
+            distances[0] = max + 1;
+            distances[1] = max + 1;
+            return;
+        }
+    }
+    distances[0] = column[len] <= max ? column[len] : max + 1;
+    distances[1] = column_rc[len] <= max ? column_rc[len] : max + 1;
+}
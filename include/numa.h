@@ -0,0 +1,30 @@
+#pragma once
+
+/* NUMA placement of the OpenMP teams (apm_parallel).
+ *
+ * The threads are bound by the OpenMP runtime, as set by OMP_PROC_BIND and
+ * OMP_PLACES (e.g. OMP_PROC_BIND=close OMP_PLACES=cores). print_affinity()
+ * reports, at startup, the binding and the CPU and NUMA node of every thread
+ * of the rank.
+ *
+ * The database is allocated with alloc_database() (utils.h), so the
+ * threads that split the windows read their share locally. The threads of
+ * database_over_ranks split the patterns instead: each of them reads the whole
+ * piece of its rank. When they are bound to several NUMA nodes,
+ * numa_replicate() gives every node its own copy of the piece, written by one
+ * of its threads. A copy has the size of the whole database, with the same
+ * offsets, but only the pages of the piece are ever touched.
+ */
+
+struct numa_replicas {
+    int nb_threads;
+    int nb_copies;
+    char **thread_buf;  // the buffer each thread reads
+    char **copies;      // per thread: the copy it made, if any
+};
+
+void print_affinity(int rank);
+
+int numa_replicate(struct numa_replicas *r, char *buf, int n_bytes, int start,
+                   int end);
+void numa_replicas_free(struct numa_replicas *r);
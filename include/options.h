@@ -0,0 +1,43 @@
+#pragma once
+
+// Server mode: queries merged into one search by default (-b)
+#define DEFAULT_BATCH_SIZE 64
+
+// Checkpoints: seconds of search between two of them, about (-i)
+#define DEFAULT_CHECKPOINT_INTERVAL 300
+
+/* Command line options shared by apm_sequential and apm_parallel.
+ * They must precede the positional arguments:
+ *
+ * ./apm_parallel [options] approximation_factor dna_database pattern1 ...
+ */
+struct apm_results;
+
+struct apm_options {
+    char *hits_file;      // -o: write the position of every match to this file
+    int histogram;        // -H: count the matches at each distance 0..k
+    int top_n;            // -n: report the N closest windows of each pattern
+    int nb_strands;       // -r: 2 to also search the reverse complements
+    char *pattern_file;   // -f: read (more) patterns from this file
+    int hamming;          // -s: count substitutions only
+    char *server_socket;  // -S: serve queries on this Unix socket
+    int batch_size;       // -b: (-S) queries merged into one search, at most
+    int batch_window_ms;  // -w: (-S) how long a query waits for others
+    char *cache_dir;      // -C: cache the results in this directory
+    char *phases;         // -P: report the time of every phase (table, json)
+    char *trace_file;     // -T: write a timeline of the run to this file
+    double progress;      // -p: report the progress every this many seconds
+    char *backend;        // -B: kernels of the search (list: the available)
+    char *checkpoint;     // -c: save the results as they come, and resume
+    double interval;      // -i: (-c) seconds between two checkpoints
+
+    // Not an option: when set, rank 0 of the approaches stores the counts
+    // and histograms there instead of printing them (result cache)
+    struct apm_results *results;
+};
+
+int parse_options(int *argc, char ***argv, struct apm_options *opts);
+
+void print_usage(char *progname);
+
+int cpu_only_options(struct apm_options *opts);
@@ -0,0 +1,30 @@
+#pragma once
+
+/* The patterns to search for, from the command line and/or a file (-f).
+ *
+ * They are stored one after the other (NUL-terminated) in a single arena:
+ * pattern i starts at arena[offsets[i]] and its length is
+ * offsets[i + 1] - offsets[i] - 1. This is what rank 0 broadcasts to the
+ * other ranks (3 messages whatever the number of patterns).
+ *
+ * pattern[] points to every pattern in the arena, for the approaches.
+ */
+struct pattern_set {
+    int nb_patterns;
+    int arena_size;
+    char *arena;
+    int *offsets;  // nb_patterns + 1 entries
+    char **pattern;
+};
+
+#define PATTERN_LENGTH(set, i) ((set)->offsets[(i) + 1] - (set)->offsets[i] - 1)
+
+int load_patterns(struct pattern_set *set, int argc, char **argv,
+                  char *pattern_file);
+int make_patterns(struct pattern_set *set, int nb, char **pattern,
+                  char *pattern_file);
+void free_patterns(struct pattern_set *set);
+int max_pattern_length(struct pattern_set *set);
+
+// apm_parallel only (src/patterns_mpi.c)
+int bcast_patterns(struct pattern_set *set, int rank);
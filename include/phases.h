@@ -0,0 +1,34 @@
+#pragma once
+
+/* Time spent in each phase of a search, per rank and per thread
+ * (apm_parallel -P table|json).
+ *
+ * Every rank accumulates its own phases between phases_reset() and
+ * phases_report(); the OpenMP threads of a scan record how long they searched
+ * and how long they then waited for the others at the end of the parallel
+ * region. phases_report() is collective: rank 0 gathers the times of all the
+ * ranks and prints, for each phase, rank 0 and the min, mean and max over the
+ * workers, with the imbalance (max / mean) and the slowest rank.
+ */
+
+enum apm_phase {
+    PHASE_LOAD,        // reading (or allocating) the database
+    PHASE_DISTRIBUTE,  // broadcast of the patterns and of the database
+    PHASE_WAIT,        // blocked until another rank sends something
+    PHASE_SCAN,        // searching on the CPU
+    PHASE_GPU,         // launching and waiting for the GPU kernels
+    PHASE_COLLECT,     // sending (workers) or merging (rank 0) the results
+    NB_PHASES
+};
+
+void phases_reset(void);
+void phase_begin(enum apm_phase phase);
+void phase_end(enum apm_phase phase);
+
+/* In a parallel region that starts at region_start (omp_get_wtime()): the
+ * calling thread has finished its share. phases_region_end() is called by one
+ * thread after the region: the threads that finished earlier were idle. */
+void phase_thread_done(double region_start);
+void phases_region_end(void);
+
+int phases_report(const char *format, int rank, int world_size);
@@ -0,0 +1,51 @@
+#pragma once
+
+/* Live progress of a long search (apm_parallel -p seconds).
+ *
+ * Workers count the windows they have scanned, summed over their patterns:
+ * each thread adds to its own counter every PROGRESS_STEP windows, and every
+ * `seconds` thread 0 (the thread that calls MPI) sends the total of the rank
+ * to rank 0 in a non-blocking message (TAG_PROGRESS), skipped while the
+ * previous one is still in flight. Before its results, a worker sends a last
+ * message, so that none is left over for the next query.
+ *
+ * Rank 0 polls for them while it waits for the results, and prints on stderr
+ * the progress, the throughput (database MB x patterns per second) and the
+ * ETA of the run, and the progress of every worker: the lag of the slowest
+ * one, and those that have not reported for 3 periods (stalled or slow).
+ */
+
+// Windows a thread scans between two updates of its counter
+#define PROGRESS_STEP 4096
+
+/* Every rank, at the start of a query: seconds between two reports, 0 for
+ * none. */
+int progress_reset(double seconds, int rank, int world_size);
+
+/* Worker: the windows it has to scan (all its patterns) */
+void progress_begin(long long nb_windows);
+
+/* Worker, any thread: windows scanned since the last call */
+void progress_add(long long nb_windows);
+
+/* Worker, after its scan, before sending its results */
+void progress_finish(void);
+
+/* In a scan loop: one more window, added every PROGRESS_STEP */
+static inline void progress_tick(int *nb_windows) {
+    if (++*nb_windows == PROGRESS_STEP) {
+        progress_add(*nb_windows);
+        *nb_windows = 0;
+    }
+}
+
+/* Rank 0: the workers that report are ranks 1..nb_workers */
+void progress_watch(int nb_workers);
+
+/* Rank 0: returns when a message with this tag is ready to be received from
+ * any rank, printing the progress in the meantime (returns at once when
+ * there is no progress report). */
+void progress_wait(int tag);
+
+/* Rank 0: after the results of a worker, its last progress messages */
+void progress_drain(int source);
@@ -0,0 +1,39 @@
+#pragma once
+
+/* Scratch memory of a run: the DP columns (one per strand) and the reverse
+ * complement that the kernels need for each pattern.
+ *
+ * Instead of a malloc/free per pattern and per thread, a scratch_pool keeps
+ * one block per thread for the whole run, sized once from the longest
+ * pattern. Blocks start on a cache line and are padded to a whole number of
+ * lines, so that two threads never write to the same line.
+ *
+ * scratch_pool_init allocates the blocks in a parallel region, each thread
+ * its own, and writes them at once: with the first-touch policy of Linux,
+ * the pages land on the NUMA node of the thread that uses them. The parallel
+ * regions of the run then find theirs with scratch_get.
+ */
+
+#define SCRATCH_ALIGNMENT 64
+
+struct scratch {
+    int *column;       // nb_strands * (max_length + 1) ints
+    char *pattern_rc;  // max_length + 1 chars
+};
+
+struct scratch_pool {
+    int nb_threads;
+    int max_length;
+    int nb_strands;
+    struct scratch *threads;
+};
+
+int scratch_pool_init(struct scratch_pool *pool, int max_length,
+                      int nb_strands);
+void scratch_pool_free(struct scratch_pool *pool);
+
+// My block, from a parallel region with at most pool->nb_threads threads
+static inline struct scratch *scratch_get(struct scratch_pool *pool,
+                                          int thread) {
+    return &pool->threads[thread];
+}
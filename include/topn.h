@@ -0,0 +1,52 @@
+#pragma once
+
+/* Top-N mode (-n N): the N windows closest to a pattern.
+ *
+ * A topn is a bounded max-heap of (distance, offset): heap[0] is the worst of
+ * the kept windows. Ties are broken on the offset (the first window wins), so
+ * that the result does not depend on how the database was split between
+ * threads and ranks.
+ */
+
+struct best_match {
+    int distance;
+    int offset;
+};
+
+struct topn {
+    struct best_match *heap;
+    int count;
+    int size;
+};
+
+int topn_init(struct topn *t, int size);
+void topn_free(struct topn *t);
+void topn_add(struct topn *t, int distance, int offset);
+void topn_merge(struct topn *dst, struct topn *src);
+void topn_sort(struct topn *t);
+
+void print_topn(char *pattern, const char *strand, struct topn *t);
+
+// Windows farther than this bound cannot enter the heap any more
+static inline int topn_bound(struct topn *t, int max) {
+    return t->count == t->size ? t->heap[0].distance : max;
+}
+
+// Bound for a window searched for nb consecutive heaps (both strands) that
+// still has to be compared exactly with approx_factor
+static inline int topn_window_bound(struct topn *t, int nb, int max,
+                                    int approx_factor) {
+    int bound = approx_factor;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        if (topn_bound(&t[i], max) > bound) {
+            bound = topn_bound(&t[i], max);
+        }
+    }
+    return bound;
+}
+
+// apm_parallel only (src/results_mpi.c)
+int send_topn(struct topn *t, int nb, int dest, int tag);
+int recv_topn(struct topn *t, int nb, int source, int tag);
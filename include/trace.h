@@ -0,0 +1,47 @@
+#pragma once
+
+/* Timeline of a search, in the Chrome trace format (apm_parallel -T file),
+ * to open in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Every thread of every rank records its events (the phases of phases.h:
+ * file reads, MPI broadcasts, sends and receives, scans and GPU kernels, and
+ * the tasks of each thread: its patterns, and the chunks it pulls from its
+ * chunk_queue.h, the accelerator's included) in its
+ * own ring buffer, without locks; when a ring is full the oldest events are
+ * overwritten. trace_write() is collective: rank 0 gathers the events of all
+ * the ranks and writes one JSON file, one process per rank and one track per
+ * thread. The clocks of the ranks are aligned by a barrier in trace_reset().
+ */
+
+// Events kept per thread
+#define TRACE_RING_SIZE 65536
+
+enum trace_name {
+    TRACE_LOAD,
+    TRACE_DISTRIBUTE,
+    TRACE_WAIT,
+    TRACE_SCAN,
+    TRACE_GPU,
+    TRACE_COLLECT,
+    TRACE_PATTERN,  // a thread searching one pattern (arg: its index)
+    TRACE_CHUNK,    // a thread searching a chunk of its queue (first and
+                    // count of its windows for one pattern, arg: its index;
+                    // or of its patterns in DB_OVER_RANKS)
+    NB_TRACE_NAMES
+};
+
+/* Collective: starts a trace when file is not NULL, otherwise turns tracing
+ * off. Returns 1 if the ring buffers cannot be allocated (tracing is off). */
+int trace_reset(const char *file);
+
+/* An event of the calling thread, between begin and end (omp_get_wtime()),
+ * arg < 0 for none. Nothing when tracing is off. */
+void trace_record(enum trace_name name, double begin, double end, int arg);
+
+// A TRACE_CHUNK event: the chunk [first, first + count) of the queue
+void trace_record_chunk(double begin, double end, int arg, long long first,
+                        long long count);
+
+/* Collective: rank 0 writes the events of every rank and thread to the file
+ * given to trace_reset(). */
+int trace_write(int rank, int world_size);
@@ -1,10 +1,103 @@
 #pragma once
 
+#include <stddef.h>
+
 char *read_input_file(char *filename, int *size);
 
+/* Database buffers, on 2 MiB huge pages when possible (explicit, else
+ * transparent, else regular pages: the mode is reported on stderr), and
+ * first written by the OpenMP threads that search them (NUMA). Freed with
+ * free_huge(). */
+char *read_database(char *filename, int *size);
+char *alloc_database(size_t size);
+char *alloc_huge(size_t size);
+void free_huge(char *buf);
+
 #define MIN3(a, b, c) \
     ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
 #define TESTPERFORMANCE_NO_LEVENSHTEIN 0
 
 int levenshtein(char *s1, char *s2, int len, int *column);
+int levenshtein_bounded(char *s1, char *s2, int len, int *column, int max);
+void levenshtein_strands(char *s1, char *s1_rc, char *s2, int len, int *column,
+                         int max, int *distances);
+
+/* The same kernels, specialized for patterns of up to 16, 32, 64 and 128
+ * characters (narrow cells in a local column). levenshtein_select() picks the
+ * kernels of the class of a pattern of length len; longer patterns get the
+ * generic ones above. */
+struct levenshtein_kernels {
+    int (*distance)(char *s1, char *s2, int len, int *column);
+    int (*bounded)(char *s1, char *s2, int len, int *column, int max);
+    void (*strands)(char *s1, char *s1_rc, char *s2, int len, int *column,
+                    int max, int *distances);
+};
+
+void levenshtein_select(int len, struct levenshtein_kernels *k);
+
+/* The CPU kernels of the process (apm_parallel -B, see src/main.c), set
+ * before a search:
+ * - KERNELS_SCALAR: the generic kernels for every pattern, one window at a
+ *   time in Hamming mode,
+ * - KERNELS_SIMD (default): the length classes, and the Hamming lanes at the
+ *   vector width of the compiler's target,
+ * - KERNELS_AVX2: the same with the Hamming lanes compiled for AVX2 (x86
+ *   only, if the CPU has it). */
+enum kernel_set { KERNELS_SCALAR, KERNELS_SIMD, KERNELS_AVX2 };
+
+int kernels_supported(enum kernel_set set);
+void kernels_use(enum kernel_set set);
+
+/* Hamming mode (-s): substitutions only. The distance of a window is its
+ * number of mismatches with the pattern; windows are compared HAMMING_LANES
+ * at a time, one byte counter per window. */
+#define HAMMING_LANES 32
+#define HAMMING_BATCH 256
+
+void hamming_windows(char *pattern, int len, char *buf, int n_bytes, int first,
+                     int count, int max, int *distances);
+
+// The distances of the windows [first, first + count), for both strands
+struct hamming_batch {
+    int first;
+    int count;
+    int distances[2][HAMMING_BATCH];
+};
+
+static inline void hamming_batch_init(struct hamming_batch *b) {
+    b->first = 0;
+    b->count = 0;
+}
+
+// Distances of window j (end is the first window not to compute): reads them
+// from the current batch, or computes the batch starting at j
+static inline void hamming_batch_get(struct hamming_batch *b, char *s1,
+                                     char *s1_rc, int len, char *buf,
+                                     int n_bytes, int j, int end, int max,
+                                     int *distances) {
+    if (j < b->first || j >= b->first + b->count) {
+        b->first = j;
+        b->count = end - j < HAMMING_BATCH ? end - j : HAMMING_BATCH;
+        hamming_windows(s1, len, buf, n_bytes, j, b->count, max,
+                        b->distances[0]);
+        if (s1_rc != NULL) {
+            hamming_windows(s1_rc, len, buf, n_bytes, j, b->count, max,
+                            b->distances[1]);
+        }
+    }
+    distances[0] = b->distances[0][j - b->first];
+    if (s1_rc != NULL) {
+        distances[1] = b->distances[1][j - b->first];
+    }
+}
+
+void reverse_complement(char *pattern, int len, char *rc);
+
+/* With -r, the results of pattern i are stored in slot 2i (the pattern
+ * itself) and 2i + 1 (its reverse complement) */
+#define STRAND_LABEL(slot, nb_strands) \
+    ((nb_strands) == 1 ? "" : ((slot) % 2 ? " (-)" : " (+)"))
+
+void print_histogram(char *pattern, const char *strand, int *histogram,
+                     int approx_factor);
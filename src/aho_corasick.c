@@ -0,0 +1,296 @@
+#include "aho_corasick.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Windows scanned by a thread at once: a chunk re-reads max_length - 1 bytes
+// of the next one, which is negligible at this size
+#define AC_CHUNK_SIZE (1 << 18)
+
+#define AC_MISSING 0xffffffffu
+
+// Top-N needs the distance of every window, which the automaton does not
+// compute
+int use_multi_pattern_engine(int approx_factor, int nb_patterns,
+                             struct apm_options *opts) {
+    return approx_factor == 0 && opts->top_n == 0 &&
+           nb_patterns >= AC_MIN_PATTERNS;
+}
+
+// slot may be NULL: pattern i is then reported in slot i.
+// The patterns are not copied, they must outlive the automaton.
+int ac_build(struct ac_automaton *ac, char **pattern, int *length, int *slot,
+             int nb_patterns) {
+    int *fail, *queue;
+    int capacity = 1;
+    int nc, i, k, c, s, t;
+    int head, tail;
+
+    memset(ac, 0, sizeof(struct ac_automaton));
+    ac->nb_patterns = nb_patterns;
+
+    /* Byte classes: class 0 for the bytes no pattern contains */
+    nc = 1;
+    for (i = 0; i < nb_patterns; i++) {
+        for (k = 0; k < length[i]; k++) {
+            unsigned char b = pattern[i][k];
+            if (ac->classes[b] == 0) {
+                ac->classes[b] = nc++;
+            }
+        }
+        capacity += length[i];
+        if (length[i] > ac->max_length) {
+            ac->max_length = length[i];
+        }
+    }
+    ac->nb_classes = nc;
+
+    ac->delta = (unsigned int *)malloc((size_t)capacity * nc *
+                                       sizeof(unsigned int));
+    ac->first = (int *)malloc(capacity * sizeof(int));
+    ac->dict = (int *)malloc(capacity * sizeof(int));
+    ac->next_same = (int *)malloc(nb_patterns * sizeof(int));
+    ac->pattern = (char **)malloc(nb_patterns * sizeof(char *));
+    ac->length = (int *)malloc(nb_patterns * sizeof(int));
+    ac->slot = (int *)malloc(nb_patterns * sizeof(int));
+    fail = (int *)malloc(capacity * sizeof(int));
+    queue = (int *)malloc(capacity * sizeof(int));
+    if (ac->delta == NULL || ac->first == NULL || ac->dict == NULL ||
+        ac->next_same == NULL || ac->pattern == NULL || ac->length == NULL ||
+        ac->slot == NULL || fail == NULL || queue == NULL) {
+        fprintf(stderr,
+                "Error: unable to allocate the automaton (%d states)\n",
+                capacity);
+        free(fail);
+        free(queue);
+        return 1;
+    }
+
+    /* Trie: delta holds state numbers while building */
+    ac->nb_states = 1;
+    memset(ac->delta, 0xff, (size_t)nc * sizeof(unsigned int));
+    ac->first[0] = -1;
+    ac->dict[0] = -1;
+    for (i = 0; i < nb_patterns; i++) {
+        s = 0;
+        for (k = 0; k < length[i]; k++) {
+            c = ac->classes[(unsigned char)pattern[i][k]];
+            if (ac->delta[s * nc + c] == AC_MISSING) {
+                t = ac->nb_states++;
+                memset(&ac->delta[(size_t)t * nc], 0xff,
+                       nc * sizeof(unsigned int));
+                ac->first[t] = -1;
+                ac->dict[t] = -1;
+                ac->delta[s * nc + c] = t;
+            }
+            s = ac->delta[s * nc + c];
+        }
+        ac->next_same[i] = ac->first[s];
+        ac->first[s] = i;
+        ac->pattern[i] = pattern[i];
+        ac->length[i] = length[i];
+        ac->slot[i] = slot != NULL ? slot[i] : i;
+    }
+
+    /* Failure links, breadth first: the row of fail[s] is complete when s is
+     * processed, so the missing transitions of s are copied from it */
+    head = 0;
+    tail = 0;
+    for (c = 0; c < nc; c++) {
+        t = ac->delta[c];
+        if (t == (int)AC_MISSING) {
+            ac->delta[c] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        for (c = 0; c < nc; c++) {
+            t = ac->delta[s * nc + c];
+            if (t == (int)AC_MISSING) {
+                ac->delta[s * nc + c] = ac->delta[fail[s] * nc + c];
+            } else {
+                fail[t] = ac->delta[fail[s] * nc + c];
+                ac->dict[t] =
+                    ac->first[fail[t]] != -1 ? fail[t] : ac->dict[fail[t]];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    /* State numbers -> row offsets, flagged when a pattern ends there */
+    for (i = 0; i < ac->nb_states * nc; i++) {
+        t = ac->delta[i];
+        ac->delta[i] = (unsigned int)t * nc;
+        if (ac->first[t] != -1 || ac->dict[t] != -1) {
+            ac->delta[i] |= AC_OUTPUT;
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+void ac_free(struct ac_automaton *ac) {
+    free(ac->delta);
+    free(ac->first);
+    free(ac->dict);
+    free(ac->next_same);
+    free(ac->pattern);
+    free(ac->length);
+    free(ac->slot);
+    memset(ac, 0, sizeof(struct ac_automaton));
+}
+
+// Matches of every pattern ending in the state at row, at position p
+static void report(struct ac_automaton *ac, unsigned int row, int p, int end,
+                   int *counts, struct hit_buffer *hits) {
+    int s = row / ac->nb_classes;
+    int x, id;
+
+    for (x = ac->first[s] != -1 ? s : ac->dict[s]; x != -1; x = ac->dict[x]) {
+        for (id = ac->first[x]; id != -1; id = ac->next_same[id]) {
+            int j = p - ac->length[id] + 1;
+            if (j < end) {
+                counts[id]++;
+                if (hits != NULL) {
+                    hit_buffer_add(hits, ac->slot[id], j, 0);
+                }
+            }
+        }
+    }
+}
+
+// Adds to counts[i] the number of windows j in [start, end) at distance 0
+// of pattern i, with the same windows as the other kernels: near the end of
+// the database, the window is shorter than the pattern and matches if it is
+// a prefix of it.
+void ac_scan(struct ac_automaton *ac, char *buf, int n_bytes, int start,
+             int end, int *counts, struct hit_buffer *hits) {
+    int nb_patterns = ac->nb_patterns;
+    int nb_chunks = (end - start + AC_CHUNK_SIZE - 1) / AC_CHUNK_SIZE;
+    int chunk, i, j;
+
+    if (end <= start) {
+        return;
+    }
+
+#pragma omp parallel default(none) private(chunk)                        \
+    firstprivate(ac, buf, n_bytes, start, end, nb_chunks, nb_patterns) \
+    shared(counts, hits)
+    {
+        // Each thread buffers its own positions, merged below
+        struct hit_buffer my_hits;
+        hit_buffer_init(&my_hits);
+
+#pragma omp for schedule(dynamic) reduction(+ : counts[:nb_patterns])
+        for (chunk = 0; chunk < nb_chunks; chunk++) {
+            int from = start + chunk * AC_CHUNK_SIZE;
+            int to = from + AC_CHUNK_SIZE < end ? from + AC_CHUNK_SIZE : end;
+            int last = to + ac->max_length - 1 < n_bytes
+                           ? to + ac->max_length - 1
+                           : n_bytes;
+            const unsigned int *delta = ac->delta;
+            const unsigned char *classes = ac->classes;
+            unsigned int row = 0, v;
+            int p;
+
+            for (p = from; p < last; p++) {
+                v = delta[row + classes[(unsigned char)buf[p]]];
+                row = v & ~AC_OUTPUT;
+                if (v & AC_OUTPUT) {
+                    report(ac, row, p, to, counts,
+                           hits != NULL ? &my_hits : NULL);
+                }
+            }
+        }
+
+        if (hits != NULL) {
+#pragma omp critical
+            hit_buffer_append(hits, &my_hits);
+        }
+
+        hit_buffer_free(&my_hits);
+    }
+
+    /* Windows cut by the end of the database */
+    for (i = 0; i < nb_patterns; i++) {
+        j = n_bytes - ac->length[i] + 1;
+        for (j = j > start ? j : start; j < end; j++) {
+            if (!memcmp(ac->pattern[i], &buf[j], n_bytes - j)) {
+                counts[i]++;
+                if (hits != NULL) {
+                    hit_buffer_add(hits, ac->slot[i], j, 0);
+                }
+            }
+        }
+    }
+}
+
+// Searches the patterns mine[0..nb_mine) of the set (all of them if mine is
+// NULL), and their reverse complements with nb_strands == 2, in the windows
+// [start, end) with a single automaton.
+// counts[m * nb_strands + s] is set to the number of matches of strand s of
+// the m-th pattern; hits are reported in the global result slots.
+int ac_search(struct pattern_set *set, int *mine, int nb_mine, int nb_strands,
+              char *buf, int n_bytes, int start, int end, int *counts,
+              struct hit_buffer *hits) {
+    struct ac_automaton ac;
+    int nb = nb_mine * nb_strands;
+    // NULL reverse complements until they are allocated
+    char **pattern = (char **)calloc(nb + 1, sizeof(char *));
+    int *length = (int *)malloc((nb + 1) * sizeof(int));
+    int *slot = (int *)malloc((nb + 1) * sizeof(int));
+    int m, s, res = 0;
+
+    if (pattern == NULL || length == NULL || slot == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %d patterns\n",
+                nb);
+        res = 1;
+    }
+
+    for (m = 0; res == 0 && m < nb_mine; m++) {
+        int i = mine != NULL ? mine[m] : m;
+
+        for (s = 0; s < nb_strands; s++) {
+            length[m * nb_strands + s] = PATTERN_LENGTH(set, i);
+            slot[m * nb_strands + s] = i * nb_strands + s;
+        }
+        pattern[m * nb_strands] = set->pattern[i];
+        if (nb_strands == 2) {
+            pattern[m * nb_strands + 1] =
+                (char *)malloc((PATTERN_LENGTH(set, i) + 1) * sizeof(char));
+            if (pattern[m * nb_strands + 1] == NULL) {
+                fprintf(stderr, "Unable to allocate string of size %d\n",
+                        PATTERN_LENGTH(set, i));
+                res = 1;
+                break;
+            }
+            reverse_complement(set->pattern[i], PATTERN_LENGTH(set, i),
+                               pattern[m * nb_strands + 1]);
+        }
+    }
+
+    if (res == 0) {
+        res = ac_build(&ac, pattern, length, slot, nb);
+    }
+    if (res == 0) {
+        memset(counts, 0, nb * sizeof(int));
+        ac_scan(&ac, buf, n_bytes, start, end, counts, hits);
+        ac_free(&ac);
+    }
+
+    for (m = 0; pattern != NULL && nb_strands == 2 && m < nb_mine; m++) {
+        free(pattern[m * nb_strands + 1]);
+    }
+    free(pattern);
+    free(length);
+    free(slot);
+    return res;
+}
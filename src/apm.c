@@ -0,0 +1,342 @@
+#include "apm.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aho_corasick.h"
+#include "patterns.h"
+#include "utils.h"
+
+struct apm_context {
+    struct apm_database *db;
+    struct apm_search_options opts;
+    int nb_threads;
+
+    // Per thread, grown by the searches that need more
+    int column_size;
+    int **columns;
+    int results_size;
+    int **results;  // counts, then histograms
+    struct hit_buffer *hits;
+};
+
+struct apm_database *apm_open_database(char *filename) {
+    struct apm_database *db;
+
+    db = (struct apm_database *)malloc(sizeof(struct apm_database));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->buf = read_database(filename, &db->n_bytes);
+    if (db->buf == NULL) {
+        free(db);
+        return NULL;
+    }
+    return db;
+}
+
+struct apm_database *apm_database_from_buffer(const char *buf, int n_bytes) {
+    struct apm_database *db;
+
+    db = (struct apm_database *)malloc(sizeof(struct apm_database));
+    if (db == NULL) {
+        return NULL;
+    }
+    db->buf = alloc_database(n_bytes * sizeof(char));
+    if (db->buf == NULL) {
+        fprintf(stderr, "Unable to allocate %d byte(s) for main array\n",
+                n_bytes);
+        free(db);
+        return NULL;
+    }
+    memcpy(db->buf, buf, n_bytes);
+    db->n_bytes = n_bytes;
+    return db;
+}
+
+void apm_close_database(struct apm_database *db) {
+    if (db != NULL) {
+        free_huge(db->buf);
+        free(db);
+    }
+}
+
+void apm_default_options(struct apm_search_options *opts) {
+    memset(opts, 0, sizeof(struct apm_search_options));
+    opts->nb_strands = 1;
+}
+
+struct apm_context *apm_create_context(struct apm_database *db,
+                                       const struct apm_search_options *opts) {
+    struct apm_context *ctx;
+    int t;
+
+    if (opts->approx_factor < 0 ||
+        (opts->nb_strands != 1 && opts->nb_strands != 2)) {
+        fprintf(stderr, "Invalid search options\n");
+        return NULL;
+    }
+
+    ctx = (struct apm_context *)calloc(1, sizeof(struct apm_context));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->db = db;
+    ctx->opts = *opts;
+    ctx->nb_threads =
+        opts->nb_threads > 0 ? opts->nb_threads : omp_get_max_threads();
+
+    ctx->columns = (int **)calloc(ctx->nb_threads, sizeof(int *));
+    ctx->results = (int **)calloc(ctx->nb_threads, sizeof(int *));
+    ctx->hits = (struct hit_buffer *)calloc(ctx->nb_threads,
+                                            sizeof(struct hit_buffer));
+    if (ctx->columns == NULL || ctx->results == NULL || ctx->hits == NULL) {
+        apm_destroy_context(ctx);
+        return NULL;
+    }
+    for (t = 0; t < ctx->nb_threads; t++) {
+        hit_buffer_init(&ctx->hits[t]);
+    }
+    return ctx;
+}
+
+void apm_destroy_context(struct apm_context *ctx) {
+    int t;
+
+    if (ctx == NULL) {
+        return;
+    }
+    for (t = 0; t < ctx->nb_threads; t++) {
+        if (ctx->columns != NULL) {
+            free(ctx->columns[t]);
+        }
+        if (ctx->results != NULL) {
+            free(ctx->results[t]);
+        }
+        if (ctx->hits != NULL) {
+            hit_buffer_free(&ctx->hits[t]);
+        }
+    }
+    free(ctx->columns);
+    free(ctx->results);
+    free(ctx->hits);
+    free(ctx);
+}
+
+// Makes every per-thread array of ctx hold at least size ints
+static int grow_buffers(struct apm_context *ctx, int **buffers, int *size,
+                        int new_size) {
+    int t;
+
+    if (new_size <= *size) {
+        return 0;
+    }
+    for (t = 0; t < ctx->nb_threads; t++) {
+        int *b = (int *)realloc(buffers[t], new_size * sizeof(int));
+        if (b == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                    new_size * sizeof(int));
+            return 1;
+        }
+        buffers[t] = b;
+    }
+    *size = new_size;
+    return 0;
+}
+
+// Exact matching of many patterns: all of them in a single pass
+static int search_exact(struct apm_context *ctx, char **pattern,
+                        int nb_patterns, struct apm_results *results) {
+    struct pattern_set set;
+    int res;
+
+    if (make_patterns(&set, nb_patterns, pattern, NULL)) {
+        return 1;
+    }
+    res = ac_search(&set, NULL, nb_patterns, ctx->opts.nb_strands,
+                    ctx->db->buf, ctx->db->n_bytes, 0, ctx->db->n_bytes,
+                    results->counts,
+                    ctx->opts.collect_hits ? &results->hits : NULL);
+    if (res == 0 && results->histograms != NULL) {
+        memcpy(results->histograms, results->counts,
+               results->nb_results * sizeof(int));
+    }
+    free_patterns(&set);
+    return res;
+}
+
+int apm_search(struct apm_context *ctx, char **pattern, int nb_patterns,
+               struct apm_results *results) {
+    struct apm_options engine;
+    char *buf = ctx->db->buf;
+    int n_bytes = ctx->db->n_bytes;
+    int approx_factor = ctx->opts.approx_factor;
+    int nb_strands = ctx->opts.nb_strands;
+    int hamming = ctx->opts.hamming;
+    int collect_hits = ctx->opts.collect_hits;
+    int nb_results = nb_patterns * nb_strands;
+    int hist_size = nb_results * (approx_factor + 1);
+    int *lengths;
+    char **pattern_rc = NULL;
+    int max_length = 0;
+    int i, t;
+
+    memset(results, 0, sizeof(struct apm_results));
+    results->nb_results = nb_results;
+    hit_buffer_init(&results->hits);
+    results->counts = (int *)calloc(nb_results + 1, sizeof(int));
+    if (ctx->opts.histogram) {
+        results->histograms = (int *)calloc(hist_size + 1, sizeof(int));
+    }
+    lengths = (int *)malloc((nb_patterns + 1) * sizeof(int));
+    if (results->counts == NULL || lengths == NULL ||
+        (ctx->opts.histogram && results->histograms == NULL)) {
+        fprintf(stderr, "Error: unable to allocate memory for %d results\n",
+                nb_results);
+        free(lengths);
+        apm_free_results(results);
+        return 1;
+    }
+
+    for (i = 0; i < nb_patterns; i++) {
+        lengths[i] = strlen(pattern[i]);
+        if (lengths[i] > max_length) {
+            max_length = lengths[i];
+        }
+    }
+
+    memset(&engine, 0, sizeof(struct apm_options));
+    if (use_multi_pattern_engine(approx_factor, nb_patterns, &engine)) {
+        free(lengths);
+        if (search_exact(ctx, pattern, nb_patterns, results)) {
+            apm_free_results(results);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* One column per strand and per thread, the counts and histograms of
+     * every thread */
+    if (grow_buffers(ctx, ctx->columns, &ctx->column_size,
+                     nb_strands * (max_length + 1)) ||
+        grow_buffers(ctx, ctx->results, &ctx->results_size,
+                     nb_results + hist_size)) {
+        free(lengths);
+        apm_free_results(results);
+        return 1;
+    }
+    for (t = 0; t < ctx->nb_threads; t++) {
+        memset(ctx->results[t], 0, (nb_results + hist_size) * sizeof(int));
+    }
+
+    // The other strand is searched in the same pass
+    if (nb_strands == 2) {
+        pattern_rc = (char **)calloc(nb_patterns + 1, sizeof(char *));
+        for (i = 0; pattern_rc != NULL && i < nb_patterns; i++) {
+            pattern_rc[i] = (char *)malloc((lengths[i] + 1) * sizeof(char));
+            if (pattern_rc[i] == NULL) {
+                break;
+            }
+            reverse_complement(pattern[i], lengths[i], pattern_rc[i]);
+        }
+        if (pattern_rc == NULL || i < nb_patterns) {
+            fprintf(stderr, "Unable to allocate the reverse complements\n");
+            while (pattern_rc != NULL && i-- > 0) {
+                free(pattern_rc[i]);
+            }
+            free(pattern_rc);
+            free(lengths);
+            apm_free_results(results);
+            return 1;
+        }
+    }
+
+    /* The threads split the windows of each pattern; they do not wait for
+     * each other between patterns */
+#pragma omp parallel num_threads(ctx->nb_threads) default(none) private(i) \
+    firstprivate(ctx, pattern, pattern_rc, lengths, buf, n_bytes,          \
+                 approx_factor, nb_strands, hamming, collect_hits,         \
+                 nb_patterns, nb_results)
+    {
+        int t = omp_get_thread_num();
+        int *column = ctx->columns[t];
+        int *my_counts = ctx->results[t];
+        int *my_histograms = my_counts + nb_results;
+        struct hit_buffer *my_hits = &ctx->hits[t];
+        struct hamming_batch batch;
+        int end = n_bytes - approx_factor;
+        int j, s;
+
+        for (i = 0; i < nb_patterns; i++) {
+            char *rc = nb_strands == 2 ? pattern_rc[i] : NULL;
+            int len = lengths[i];
+            struct levenshtein_kernels kernels;
+
+            levenshtein_select(len, &kernels);
+            hamming_batch_init(&batch);
+
+#pragma omp for schedule(static) nowait
+            for (j = 0; j < end; j++) {
+                int distances[2];
+                int size = n_bytes - j < len ? n_bytes - j : len;
+
+                if (hamming) {
+                    hamming_batch_get(&batch, pattern[i], rc, len, buf,
+                                      n_bytes, j, end, approx_factor,
+                                      distances);
+                } else if (nb_strands == 2) {
+                    kernels.strands(pattern[i], rc, &buf[j], size, column,
+                                    approx_factor, distances);
+                } else {
+                    distances[0] = kernels.bounded(pattern[i], &buf[j], size,
+                                                   column, approx_factor);
+                }
+
+                for (s = 0; s < nb_strands; s++) {
+                    int slot = i * nb_strands + s;
+
+                    if (distances[s] <= approx_factor) {
+                        my_counts[slot]++;
+                        my_histograms[slot * (approx_factor + 1) +
+                                      distances[s]]++;
+                        if (collect_hits) {
+                            hit_buffer_add(my_hits, slot, j, distances[s]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Merge the results of the threads */
+    for (t = 0; t < ctx->nb_threads; t++) {
+        for (i = 0; i < nb_results; i++) {
+            results->counts[i] += ctx->results[t][i];
+        }
+        for (i = 0; results->histograms != NULL && i < hist_size; i++) {
+            results->histograms[i] += ctx->results[t][nb_results + i];
+        }
+        if (collect_hits) {
+            hit_buffer_append(&results->hits, &ctx->hits[t]);
+            ctx->hits[t].count = 0;
+            ctx->hits[t].dropped = 0;
+        }
+    }
+
+    for (i = 0; nb_strands == 2 && i < nb_patterns; i++) {
+        free(pattern_rc[i]);
+    }
+    free(pattern_rc);
+    free(lengths);
+    return 0;
+}
+
+void apm_free_results(struct apm_results *results) {
+    free(results->counts);
+    free(results->histograms);
+    hit_buffer_free(&results->hits);
+    results->counts = NULL;
+    results->histograms = NULL;
+}
@@ -0,0 +1,528 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * Differential check of the search engines
+ *
+ * Usage:
+ * ./apm_check [-s seed] [-i iterations]
+ * ./apm_check reference [options] approximation_factor dna_database
+ *             [pattern1 pattern2 ...]
+ *
+ * The first form compares every optimized engine with the reference scalar
+ * levenshtein() of src/utils.c on random and edge-case inputs: the kernels of
+ * every length class and the generic ones (distance, bounded by k, both
+ * strands) on full and truncated windows (the last windows of a buffer) with
+ * k from 0 to beyond the pattern length, the Hamming windows (vector lanes
+ * and scalar tail) against a plain count of mismatches, and the Aho-Corasick
+ * automaton (k = 0) against a plain comparison, with the database split at
+ * random seams. The kernel sets of the CPU backends (apm_parallel -B) the
+ * machine supports take turns. It prints the first mismatches and exits with
+ * 1 if any.
+ *
+ * The second form is the reference search: the options (-o, -H, -n, -r, -s)
+ * and the output of apm_sequential, but every window is compared with
+ * levenshtein() (or a plain Hamming count) and nothing else: no bound, batch,
+ * automaton nor split. scripts/check diffs every engine and decomposition
+ * against it.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aho_corasick.h"
+#include "hits.h"
+#include "options.h"
+#include "patterns.h"
+#include "topn.h"
+#include "utils.h"
+
+// Longest pattern of the kernel checks: Hamming patterns span 3 blocks of
+// the byte counters of hamming_windows() (254 characters each at most)
+#define CHECK_MAX_LENGTH 800
+#define CHECK_MAX_TEXT 3000
+#define CHECK_MAX_PATTERNS 40
+#define DEFAULT_ITERATIONS 5000
+
+// Mismatches printed, at most
+#define MAX_REPORTED 10
+
+// Lengths at the boundaries of the kernel classes (levenshtein_select())
+static const int edge_lengths[] = {1,  2,   3,   15,  16,  17,  31,  32, 33,
+                                   63, 64,  65,  127, 128, 129, 130, 200};
+#define NB_EDGE_LENGTHS (int)(sizeof(edge_lengths) / sizeof(edge_lengths[0]))
+
+static long nb_cases;
+static long nb_failures;
+
+// The CPU kernel sets (kernels_use()), in turn
+static const enum kernel_set kernel_sets[] = {KERNELS_SIMD, KERNELS_AVX2,
+                                              KERNELS_SCALAR};
+static const char *kernel_set_names[] = {"simd", "avx2", "scalar"};
+#define NB_KERNEL_SETS (int)(sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+static int current_set;
+
+/* splitmix64: fast, and the same sequence on every platform */
+static uint64_t rng_state;
+
+static uint64_t next_random(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int random_below(int n) { return (int)(next_random() % n); }
+
+static void random_bases(char *s, int n) {
+    static const char bases[] = "ACGTACGTACGTACGTN";
+    int i;
+
+    for (i = 0; i < n; i++) {
+        s[i] = bases[random_below(sizeof(bases) - 1)];
+    }
+}
+
+// A pattern length: at a class boundary half of the time
+static int random_length(int max) {
+    int length;
+
+    do {
+        length = random_below(2) ? edge_lengths[random_below(NB_EDGE_LENGTHS)]
+                                 : 1 + random_below(max);
+    } while (length > max);
+    return length;
+}
+
+// s with a few substitutions, insertions and deletions, into out[0..len)
+static void mutate(char *s, int m, char *out, int len) {
+    int edits = random_below(5);
+    int i = 0, o = 0;
+
+    while (o < len) {
+        int op = edits > 0 && random_below(m + 1) < 4 ? random_below(3) : 3;
+
+        if (op < 3) {
+            edits--;
+        }
+        if (op == 0 || i >= m) {  // substitution, or past the end
+            random_bases(&out[o++], 1);
+            i++;
+        } else if (op == 1) {  // insertion
+            random_bases(&out[o++], 1);
+        } else if (op == 2) {  // deletion
+            i++;
+        } else {
+            out[o++] = s[i++];
+        }
+    }
+}
+
+static void fail(const char *engine, const char *s1, int m, const char *s2,
+                 int len, int max, int got, int expected) {
+    nb_failures++;
+    if (nb_failures <= MAX_REPORTED) {
+        fprintf(stderr,
+                "%s (%s): pattern %.*s (%d), window %.*s (%d), max %d: %d "
+                "instead of %d\n",
+                engine, kernel_set_names[current_set], m, s1, m, len, s2, len,
+                max, got, expected);
+    }
+}
+
+/* A bounded engine gives the exact distance when it is at most max, and
+ * anything above max otherwise (max < 0: no bound) */
+static void check_distance(const char *engine, const char *s1, int m,
+                           const char *s2, int len, int max, int got,
+                           int expected) {
+    nb_cases++;
+    if (max < 0 || expected <= max ? got != expected : got <= max) {
+        fail(engine, s1, m, s2, len, max, got, expected);
+    }
+}
+
+// The Levenshtein kernels, on one window
+static void check_levenshtein(int *column) {
+    char s1[CHECK_MAX_LENGTH + 1], rc[CHECK_MAX_LENGTH + 1];
+    char s2[CHECK_MAX_LENGTH + 1];
+    struct levenshtein_kernels kernels;
+    int distances[2];
+    int m, len, max, d, d_rc;
+
+    m = random_length(200);
+    random_bases(s1, m);
+    reverse_complement(s1, m, rc);
+
+    // Full windows, and the shorter ones at the end of a buffer
+    len = random_below(4) ? m : 1 + random_below(m);
+    if (random_below(2)) {
+        mutate(random_below(2) ? s1 : rc, m, s2, len);
+    } else {
+        random_bases(s2, len);
+    }
+    max = random_below(m + 3);  // up to k >= m
+
+    // The kernels of the class of the pattern, as the drivers select them
+    levenshtein_select(m, &kernels);
+
+    d = levenshtein(s1, s2, len, column);
+    d_rc = levenshtein(rc, s2, len, column);
+
+    check_distance("levenshtein_class", s1, m, s2, len, -1,
+                   kernels.distance(s1, s2, len, column), d);
+    check_distance("levenshtein_bounded", s1, m, s2, len, max,
+                   levenshtein_bounded(s1, s2, len, column, max), d);
+    check_distance("bounded_class", s1, m, s2, len, max,
+                   kernels.bounded(s1, s2, len, column, max), d);
+
+    levenshtein_strands(s1, rc, s2, len, column, max, distances);
+    check_distance("levenshtein_strands (+)", s1, m, s2, len, max,
+                   distances[0], d);
+    check_distance("levenshtein_strands (-)", rc, m, s2, len, max,
+                   distances[1], d_rc);
+    kernels.strands(s1, rc, s2, len, column, max, distances);
+    check_distance("strands_class (+)", s1, m, s2, len, max, distances[0], d);
+    check_distance("strands_class (-)", rc, m, s2, len, max, distances[1],
+                   d_rc);
+}
+
+static int reference_hamming(char *pattern, int m, char *buf, int n_bytes,
+                             int j) {
+    int size = n_bytes - j < m ? n_bytes - j : m;
+    int x, d = 0;
+
+    for (x = 0; x < size; x++) {
+        d += pattern[x] != buf[j + x];
+    }
+    return d;
+}
+
+// A batch of Hamming windows, up to the end of a buffer
+static void check_hamming(char *text) {
+    char pattern[CHECK_MAX_LENGTH + 1];
+    int distances[HAMMING_BATCH];
+    int m, n_bytes, first, count, max, j;
+
+    m = random_length(CHECK_MAX_LENGTH);
+    n_bytes = 1 + random_below(CHECK_MAX_TEXT);
+    random_bases(text, n_bytes);
+    if (random_below(4) == 0) {
+        // Windows that mismatch almost every character: the counters are
+        // capped in every block, and must not wrap around in the next one
+        memset(text, 'C', n_bytes);
+        for (j = random_below(4); j > 0; j--) {
+            text[random_below(n_bytes)] = 'A';
+        }
+        memset(pattern, 'A', m);
+    } else if (random_below(2) && n_bytes > m) {
+        // Close windows
+        mutate(&text[random_below(n_bytes - m)], m, pattern, m);
+    } else {
+        random_bases(pattern, m);
+    }
+
+    first = random_below(n_bytes);
+    count = 1 + random_below(n_bytes - first < HAMMING_BATCH
+                                 ? n_bytes - first
+                                 : HAMMING_BATCH);
+    max = random_below(4) ? random_below(m + 3) : 255 + random_below(50);
+
+    hamming_windows(pattern, m, text, n_bytes, first, count, max, distances);
+    for (j = first; j < first + count; j++) {
+        check_distance("hamming_windows", pattern, m, &text[j],
+                       n_bytes - j < m ? n_bytes - j : m, max,
+                       distances[j - first],
+                       reference_hamming(pattern, m, text, n_bytes, j));
+    }
+}
+
+// The automaton, on a database split at 2 random seams
+static int check_automaton(char *text, int *column) {
+    char storage[CHECK_MAX_PATTERNS][CHECK_MAX_LENGTH + 1];
+    char *pattern[CHECK_MAX_PATTERNS];
+    char rc[CHECK_MAX_LENGTH + 1];
+    int counts[2 * CHECK_MAX_PATTERNS], expected[2 * CHECK_MAX_PATTERNS];
+    int piece[2 * CHECK_MAX_PATTERNS];
+    struct pattern_set set;
+    struct hit_buffer hits;
+    int nb_patterns, nb_strands, n_bytes, seams[4];
+    int i, j, s, total;
+
+    n_bytes = 1 + random_below(CHECK_MAX_TEXT);
+    random_bases(text, n_bytes);
+    nb_patterns = 1 + random_below(CHECK_MAX_PATTERNS);
+    nb_strands = 1 + random_below(2);
+    for (i = 0; i < nb_patterns; i++) {
+        int m = 1 + random_below(random_below(4) ? 12 : 40);
+
+        if (i > 0 && random_below(8) == 0) {
+            // The same pattern twice
+            strcpy(storage[i], storage[random_below(i)]);
+        } else if (random_below(2)) {
+            // From the database, often found; or running past its end, only
+            // a prefix of it in the last windows
+            int start = random_below(n_bytes);
+            int found = n_bytes - start < m ? n_bytes - start : m;
+
+            if (random_below(4) == 0 && n_bytes > m) {
+                start = n_bytes - m + random_below(m);
+                found = n_bytes - start;
+            }
+            memcpy(storage[i], &text[start], found);
+            random_bases(&storage[i][found], m - found);
+            storage[i][m] = '\0';
+        } else {
+            random_bases(storage[i], m);
+            storage[i][m] = '\0';
+        }
+        pattern[i] = storage[i];
+    }
+    if (make_patterns(&set, nb_patterns, pattern, NULL)) {
+        return 1;
+    }
+
+    // Reference: every window compared with levenshtein(), at distance 0
+    for (i = 0; i < nb_patterns * nb_strands; i++) {
+        int m = PATTERN_LENGTH(&set, i / nb_strands);
+        char *p = set.pattern[i / nb_strands];
+
+        if (i % nb_strands == 1) {
+            reverse_complement(p, m, rc);
+            p = rc;
+        }
+        expected[i] = 0;
+        for (j = 0; j < n_bytes; j++) {
+            int size = n_bytes - j < m ? n_bytes - j : m;
+
+            expected[i] += levenshtein(p, &text[j], size, column) == 0;
+        }
+        counts[i] = 0;
+    }
+
+    seams[0] = 0;
+    seams[1] = random_below(n_bytes + 1);
+    seams[2] = random_below(n_bytes + 1);
+    seams[3] = n_bytes;
+    if (seams[1] > seams[2]) {
+        int t = seams[1];
+
+        seams[1] = seams[2];
+        seams[2] = t;
+    }
+    hit_buffer_init(&hits);
+    for (s = 0; s < 3; s++) {
+        if (ac_search(&set, NULL, nb_patterns, nb_strands, text, n_bytes,
+                      seams[s], seams[s + 1], piece, &hits)) {
+            return 1;
+        }
+        for (i = 0; i < nb_patterns * nb_strands; i++) {
+            counts[i] += piece[i];
+        }
+    }
+
+    total = 0;
+    for (i = 0; i < nb_patterns * nb_strands; i++) {
+        char *p = set.pattern[i / nb_strands];
+        int m = PATTERN_LENGTH(&set, i / nb_strands);
+
+        nb_cases++;
+        if (counts[i] != expected[i]) {
+            fail(i % nb_strands == 1 ? "ac_search (-)" : "ac_search", p, m,
+                 "", 0, 0, counts[i], expected[i]);
+        }
+        total += expected[i];
+    }
+    nb_cases++;
+    if (hits.count != total) {
+        fail("ac_search hits", "", 0, "", 0, 0, hits.count, total);
+    }
+
+    hit_buffer_free(&hits);
+    free_patterns(&set);
+    return 0;
+}
+
+static int check_engines(long iterations) {
+    int *column;
+    char *text;
+    long i;
+
+    column = (int *)malloc(2 * (CHECK_MAX_LENGTH + 1) * sizeof(int));
+    text = (char *)malloc(CHECK_MAX_TEXT + CHECK_MAX_LENGTH);
+    if (column == NULL || text == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        do {
+            current_set = (current_set + 1) % NB_KERNEL_SETS;
+        } while (!kernels_supported(kernel_sets[current_set]));
+        kernels_use(kernel_sets[current_set]);
+
+        check_levenshtein(column);
+        check_hamming(text);
+        if (i % 10 == 0 && check_automaton(text, column)) {
+            return 1;
+        }
+    }
+
+    if (nb_failures > 0) {
+        printf("%ld mismatch(es) in %ld comparisons with the reference\n",
+               nb_failures, nb_cases);
+    } else {
+        printf("%ld comparisons, every engine agrees with the reference\n",
+               nb_cases);
+    }
+    free(column);
+    free(text);
+    return nb_failures > 0;
+}
+
+// apm_sequential, without any of its engines
+static int reference_search(int argc, char **argv) {
+    struct apm_options opts;
+    struct pattern_set patterns;
+    struct hit_buffer hits;
+    struct topn *best = NULL;
+    int *n_matches, *histograms, *column;
+    char *buf, *pattern_rc;
+    int approx_factor, n_bytes, nb_strands, nb_results;
+    int i, j;
+
+    if (parse_options(&argc, &argv, &opts) || argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    approx_factor = atoi(argv[1]);
+    if (load_patterns(&patterns, argc, argv, opts.pattern_file)) {
+        return 1;
+    }
+    buf = read_database(argv[2], &n_bytes);
+    if (buf == NULL) {
+        return 1;
+    }
+
+    nb_strands = opts.nb_strands;
+    nb_results = patterns.nb_patterns * nb_strands;
+    n_matches = (int *)calloc(nb_results, sizeof(int));
+    histograms = (int *)calloc(nb_results * (approx_factor + 1), sizeof(int));
+    column = (int *)malloc((max_pattern_length(&patterns) + 1) * sizeof(int));
+    pattern_rc = (char *)malloc(max_pattern_length(&patterns) + 1);
+    if (n_matches == NULL || histograms == NULL || column == NULL ||
+        pattern_rc == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory\n");
+        return 1;
+    }
+    hit_buffer_init(&hits);
+    if (opts.top_n > 0) {
+        best = (struct topn *)malloc(nb_results * sizeof(struct topn));
+        if (best == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory\n");
+            return 1;
+        }
+        for (i = 0; i < nb_results; i++) {
+            if (topn_init(&best[i], opts.top_n)) {
+                return 1;
+            }
+        }
+    }
+
+    for (i = 0; i < nb_results; i++) {
+        char *p = patterns.pattern[i / nb_strands];
+        int m = PATTERN_LENGTH(&patterns, i / nb_strands);
+
+        if (i % nb_strands == 1) {
+            reverse_complement(p, m, pattern_rc);
+            p = pattern_rc;
+        }
+        for (j = 0; j < n_bytes - approx_factor; j++) {
+            int size = n_bytes - j < m ? n_bytes - j : m;
+            int distance = opts.hamming
+                               ? reference_hamming(p, m, buf, n_bytes, j)
+                               : levenshtein(p, &buf[j], size, column);
+
+            if (best != NULL) {
+                topn_add(&best[i], distance, j);
+            }
+            if (distance <= approx_factor) {
+                n_matches[i]++;
+                histograms[i * (approx_factor + 1) + distance]++;
+                if (opts.hits_file != NULL) {
+                    hit_buffer_add(&hits, i, j, distance);
+                }
+            }
+        }
+    }
+
+    if (opts.hits_file != NULL &&
+        write_hits(opts.hits_file, &hits, nb_results)) {
+        return 1;
+    }
+    for (i = 0; i < nb_results; i++) {
+        printf("Number of matches for pattern <%s>%s: %d\n",
+               patterns.pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
+               n_matches[i]);
+    }
+    if (opts.histogram) {
+        for (i = 0; i < nb_results; i++) {
+            print_histogram(patterns.pattern[i / nb_strands],
+                            STRAND_LABEL(i, nb_strands),
+                            &histograms[i * (approx_factor + 1)],
+                            approx_factor);
+        }
+    }
+    for (i = 0; best != NULL && i < nb_results; i++) {
+        topn_sort(&best[i]);
+        print_topn(patterns.pattern[i / nb_strands],
+                   STRAND_LABEL(i, nb_strands), &best[i]);
+    }
+    return 0;
+}
+
+static void check_usage(char *progname) {
+    printf("Usage: %s [-s seed] [-i iterations]\n", progname);
+    printf(
+        "   or: %s reference [options] approximation_factor dna_database "
+        "[pattern1 pattern2 ...]\n",
+        progname);
+    printf("  -s seed        random inputs of the engine checks (default 1)\n");
+    printf("  -i iterations  random kernel inputs (default %d)\n",
+           DEFAULT_ITERATIONS);
+    printf(
+        "  reference      search like apm_sequential, with levenshtein() "
+        "only\n");
+}
+
+int main(int argc, char **argv) {
+    long iterations = DEFAULT_ITERATIONS;
+    int opt;
+
+    if (argc > 1 && !strcmp(argv[1], "reference")) {
+        return reference_search(argc - 1, argv + 1);
+    }
+
+    rng_state = 1;
+    while ((opt = getopt(argc, argv, "s:i:")) != -1) {
+        switch (opt) {
+            case 's':
+                rng_state = strtoull(optarg, NULL, 10);
+                break;
+            case 'i':
+                iterations = atol(optarg);
+                break;
+            default:
+                check_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc || iterations <= 0) {
+        check_usage(argv[0]);
+        return 1;
+    }
+
+    return check_engines(iterations);
+}
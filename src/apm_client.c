@@ -0,0 +1,203 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * Test client of the server mode (apm_parallel -S socket_path dna_database)
+ *
+ * Usage:
+ * ./apm_client [-p] socket_path [query arguments...]
+ *
+ * With query arguments, sends them as one query; otherwise sends the lines of
+ * stdin, one query each. Prints the answers and, on stderr, how long each
+ * query took. With -p, all the lines of stdin are sent before reading the
+ * answers, so that the server can merge them (load tests).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The server may still be loading the database
+#define CONNECT_RETRIES 100
+#define CONNECT_RETRY_DELAY_US 100000
+
+static int connect_server(char *socket_path) {
+    struct sockaddr_un address;
+    int retry;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    for (retry = 0; retry < CONNECT_RETRIES; retry++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&address,
+                    sizeof(struct sockaddr_un)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(CONNECT_RETRY_DELAY_US);
+    }
+    fprintf(stderr, "Unable to connect to %s\n", socket_path);
+    return -1;
+}
+
+static double elapsed_ms(struct timeval *t1) {
+    struct timeval t2;
+
+    gettimeofday(&t2, NULL);
+    return (t2.tv_sec - t1->tv_sec) * 1e3 + (t2.tv_usec - t1->tv_usec) / 1e3;
+}
+
+// Prints an answer, up to the "END" line
+static int read_answer(FILE *server) {
+    char *answer = NULL;
+    size_t answer_capacity = 0;
+    ssize_t length;
+
+    while ((length = getline(&answer, &answer_capacity, server)) != -1) {
+        if (!strcmp(answer, "END\n")) {
+            break;
+        }
+        fwrite(answer, 1, length, stdout);
+    }
+    free(answer);
+
+    if (length == -1) {
+        fprintf(stderr, "Connection closed by the server\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Sends a query and prints the answer
+static int query(FILE *server, char *line) {
+    struct timeval t1;
+
+    gettimeofday(&t1, NULL);
+    fprintf(server, "%s\n", line);
+    fflush(server);
+    if (read_answer(server)) {
+        return 1;
+    }
+    fprintf(stderr, "Query answered in %.3f ms\n", elapsed_ms(&t1));
+    return 0;
+}
+
+// Sends all the lines of stdin, then prints the answers
+static int pipeline(FILE *server) {
+    struct timeval t1;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int nb_queries = 0;
+    int quit = 0;
+    int i;
+
+    gettimeofday(&t1, NULL);
+    while ((length = getline(&line, &capacity, stdin)) != -1) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (!strcmp(line, "QUIT")) {
+            // Sent last: the server answers the queued queries first
+            quit = 1;
+        } else if (length > 0) {
+            fprintf(server, "%s\n", line);
+            nb_queries++;
+        }
+    }
+    if (quit) {
+        fprintf(server, "QUIT\n");
+    }
+    fflush(server);
+    free(line);
+
+    for (i = 0; i < nb_queries; i++) {
+        if (read_answer(server)) {
+            return 1;
+        }
+    }
+    fprintf(stderr, "%d queries answered in %.3f ms\n", nb_queries,
+            elapsed_ms(&t1));
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    FILE *server;
+    int fd, i;
+    int pipelined = 0;
+    int res = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-p")) {
+        pipelined = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 2 || (pipelined && argc > 2)) {
+        printf("Usage: %s [-p] socket_path [query arguments...]\n", argv[0]);
+        return 1;
+    }
+
+    fd = connect_server(argv[1]);
+    if (fd == -1) {
+        return 1;
+    }
+    server = fdopen(fd, "r+");
+    if (server == NULL) {
+        perror("fdopen");
+        return 1;
+    }
+
+    if (argc > 2) {
+        /* One query: the arguments, joined */
+        size_t size = 1;
+        char *line;
+
+        for (i = 2; i < argc; i++) {
+            size += strlen(argv[i]) + 1;
+        }
+        line = (char *)malloc(size);
+        if (line == NULL) {
+            return 1;
+        }
+        line[0] = '\0';
+        for (i = 2; i < argc; i++) {
+            strcat(line, argv[i]);
+            strcat(line, i + 1 < argc ? " " : "");
+        }
+        res = query(server, line);
+        free(line);
+    } else if (pipelined) {
+        res = pipeline(server);
+    } else {
+        /* One query per line of stdin */
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+
+        while (res == 0 && (length = getline(&line, &capacity, stdin)) != -1) {
+            if (length > 0 && line[length - 1] == '\n') {
+                line[length - 1] = '\0';
+            }
+            if (!strcmp(line, "QUIT")) {
+                // No answer to wait for
+                fprintf(server, "QUIT\n");
+                break;
+            }
+            res = query(server, line);
+        }
+        free(line);
+    }
+
+    fclose(server);
+    return res;
+}
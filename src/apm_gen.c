@@ -0,0 +1,665 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * Synthetic workload generator
+ *
+ * Usage:
+ * ./apm_gen [options] size dna_database [pattern_file expected_file]
+ *
+ * Writes a DNA database of size bytes (K, M, G, T suffixes: powers of 1024),
+ * the same for the same seed: bases drawn with a GC bias, interspersed repeats
+ * (mutated copies of a few repeat families) and tandem repeats, runs of N,
+ * wrapped in lines like the files of dna/.
+ *
+ * With a pattern file, also writes random patterns (one per line, for -f) and
+ * plants each of them 0 to -m times in the database, with 0 to -k random edits
+ * (substitutions, insertions, deletions). The expected file gives, for every
+ * pattern and every approximation factor from 0 to -k, the number of matches
+ * the search reports (forward strand), for the edit distance and for -s. They
+ * are computed with a plain DP over every window that overlaps a planted copy
+ * and over the last windows of the database (shorter than the patterns); the
+ * windows elsewhere only match by chance, which the generator estimates (it
+ * warns when the patterns are too short for that to be negligible).
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_FAMILIES 16
+#define FAMILY_LENGTH 300
+#define MIN_COPY_LENGTH 50
+#define FAMILY_MUTATION_RATE 0.1
+#define MAX_UNIT_LENGTH 6
+#define MIN_TANDEM_LENGTH 20
+#define MAX_TANDEM_LENGTH 200
+#define TANDEM_MUTATION_RATE 0.02
+#define N_RUN_MEAN 1000
+
+// Segment of the database when it is not wrapped (-w 0)
+#define UNWRAPPED_SEGMENT 4096
+
+// Above this number of chance matches per pattern, the counts are not exact
+#define BACKGROUND_WARNING 0.01
+
+struct gen_options {
+    uint64_t seed;
+    int width;
+    double gc;
+    double repeats;
+    double n_runs;
+    int nb_patterns;
+    int min_length;
+    int max_length;
+    int max_edits;
+    int max_plants;
+};
+
+/* splitmix64: fast, and the same sequence on every platform */
+static uint64_t rng_state;
+
+static uint64_t next_random(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double random_unit(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t random_below(uint64_t n) { return next_random() % n; }
+
+static double gc_content;
+
+static char random_base(void) {
+    uint64_t r = next_random();
+
+    if ((r >> 11) * (1.0 / 9007199254740992.0) < gc_content) {
+        return r & 1 ? 'G' : 'C';
+    }
+    return r & 1 ? 'T' : 'A';
+}
+
+static char other_base(char c) {
+    static const char bases[] = "ACGT";
+    char b;
+
+    do {
+        b = bases[random_below(4)];
+    } while (b == c);
+    return b;
+}
+
+/* Background of the database: a stream of bases that goes from random
+ * sequence to a repeat or an N-run and back */
+enum { RANDOM, FAMILY, TANDEM, N_RUN };
+
+struct source {
+    char families[NB_FAMILIES][FAMILY_LENGTH];
+    double p_family, p_tandem, p_n_run;  // to start one, at a random base
+    int mode;
+    const char *copy;
+    char unit[MAX_UNIT_LENGTH];
+    int unit_length;
+    int position;
+    int remaining;
+};
+
+static void source_init(struct source *src, struct gen_options *o) {
+    double family_fraction = 0.8 * o->repeats;
+    double tandem_fraction = 0.2 * o->repeats;
+    double random_fraction = 1 - o->repeats - o->n_runs;
+    int f, i;
+
+    for (f = 0; f < NB_FAMILIES; f++) {
+        for (i = 0; i < FAMILY_LENGTH; i++) {
+            src->families[f][i] = random_base();
+        }
+    }
+
+    /* p * mean length / random_fraction of the bases are in each kind */
+    src->p_family = family_fraction /
+                    ((FAMILY_LENGTH + MIN_COPY_LENGTH) / 2.0 * random_fraction);
+    src->p_tandem = tandem_fraction /
+                    ((MIN_TANDEM_LENGTH + MAX_TANDEM_LENGTH) / 2.0 *
+                     random_fraction);
+    src->p_n_run = o->n_runs / (N_RUN_MEAN * random_fraction);
+    src->mode = RANDOM;
+    src->remaining = 0;
+}
+
+static char next_base(struct source *src) {
+    char c;
+
+    if (src->remaining == 0) {
+        double u = random_unit();
+
+        src->mode = RANDOM;
+        src->position = 0;
+        if (u < src->p_n_run) {
+            src->mode = N_RUN;
+            src->remaining = 1 + random_below(2 * N_RUN_MEAN - 1);
+        } else if ((u -= src->p_n_run) < src->p_family) {
+            int start = random_below(FAMILY_LENGTH - MIN_COPY_LENGTH + 1);
+
+            src->mode = FAMILY;
+            src->copy = &src->families[random_below(NB_FAMILIES)][start];
+            src->remaining = FAMILY_LENGTH - start;
+        } else if (u - src->p_family < src->p_tandem) {
+            int i;
+
+            src->mode = TANDEM;
+            src->unit_length = 1 + random_below(MAX_UNIT_LENGTH);
+            for (i = 0; i < src->unit_length; i++) {
+                src->unit[i] = random_base();
+            }
+            src->remaining =
+                MIN_TANDEM_LENGTH +
+                random_below(MAX_TANDEM_LENGTH - MIN_TANDEM_LENGTH + 1);
+        } else {
+            return random_base();
+        }
+    }
+
+    switch (src->mode) {
+        case N_RUN:
+            c = 'N';
+            break;
+        case FAMILY:
+            c = src->copy[src->position];
+            if (random_unit() < FAMILY_MUTATION_RATE) {
+                c = other_base(c);
+            }
+            break;
+        default:
+            c = src->unit[src->position % src->unit_length];
+            if (random_unit() < TANDEM_MUTATION_RATE) {
+                c = other_base(c);
+            }
+            break;
+    }
+    src->position++;
+    src->remaining--;
+    return c;
+}
+
+/* A planted copy: pattern with edits, at column of segment */
+struct plant {
+    long long segment;
+    int pattern;
+    int edits;
+    int column;
+};
+
+static int edit_distance(const char *s1, const char *s2, int len,
+                         int *column) {
+    int x, y, lastdiag, olddiag;
+
+    for (y = 0; y <= len; y++) {
+        column[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        column[0] = x;
+        lastdiag = x - 1;
+        for (y = 1; y <= len; y++) {
+            int best = lastdiag + (s1[y - 1] != s2[x - 1]);
+
+            olddiag = column[y];
+            if (olddiag + 1 < best) {
+                best = olddiag + 1;
+            }
+            if (column[y - 1] + 1 < best) {
+                best = column[y - 1] + 1;
+            }
+            column[y] = best;
+            lastdiag = olddiag;
+        }
+    }
+    return column[len];
+}
+
+static int hamming_distance(const char *s1, const char *s2, int len) {
+    int i, d = 0;
+
+    for (i = 0; i < len; i++) {
+        d += s1[i] != s2[i];
+    }
+    return d;
+}
+
+/* Writes pattern with edits random edits at copy; returns its length */
+static int mutate(const char *pattern, int length, int edits, char *copy) {
+    int e;
+
+    memcpy(copy, pattern, length);
+    for (e = 0; e < edits; e++) {
+        int at = random_below(length);
+
+        switch (random_below(3)) {
+            case 0:
+                copy[at] = other_base(copy[at]);
+                break;
+            case 1:
+                memmove(&copy[at + 1], &copy[at], length - at);
+                copy[at] = random_base();
+                length++;
+                break;
+            default:
+                if (length > 1) {
+                    memmove(&copy[at], &copy[at + 1], length - at - 1);
+                    length--;
+                }
+                break;
+        }
+    }
+    return length;
+}
+
+/* Rough number of windows of a random database within k edits of a pattern:
+ * C(2 len, k) 8^k / 4^len per window. Only its order of magnitude matters. */
+static double chance_matches(long long windows, int len, int k) {
+    double log_windows = log((double)windows);
+
+    return exp(log_windows + lgamma(2 * len + 1) - lgamma(k + 1) -
+               lgamma(2 * len - k + 1) + k * log(8.0) - len * log(4.0));
+}
+
+static long long parse_size(const char *s) {
+    char *end;
+    double size = strtod(s, &end);
+
+    switch (*end) {
+        case 'T':
+            size *= 1024;
+            /* fall through */
+        case 'G':
+            size *= 1024;
+            /* fall through */
+        case 'M':
+            size *= 1024;
+            /* fall through */
+        case 'K':
+            size *= 1024;
+            end++;
+            break;
+    }
+    if (end == s || *end != '\0' || size < 1) {
+        return -1;
+    }
+    return (long long)size;
+}
+
+static void print_usage(char *progname) {
+    printf(
+        "Usage: %s [-s seed] [-w width] [-g gc] [-R repeats] [-N n_runs] "
+        "[-p nb_patterns] [-l length|min-max] [-k max_edits] "
+        "[-m max_plants] size dna_database [pattern_file expected_file]\n",
+        progname);
+    printf("  -s seed       random seed (1)\n");
+    printf("  -w width      line width, 0 for a single line (50)\n");
+    printf("  -g gc         fraction of C and G (0.41)\n");
+    printf("  -R repeats    fraction of the bases in repeats (0.3)\n");
+    printf("  -N n_runs     fraction of the bases in runs of N (0.001)\n");
+    printf("  -p nb         number of patterns (16)\n");
+    printf("  -l length     pattern length, or range of lengths (32)\n");
+    printf("  -k edits      most edits in a planted copy (2)\n");
+    printf("  -m plants     most planted copies of a pattern (8)\n");
+}
+
+static int parse_options(int argc, char **argv, struct gen_options *o) {
+    int opt;
+
+    o->seed = 1;
+    o->width = 50;
+    o->gc = 0.41;
+    o->repeats = 0.3;
+    o->n_runs = 0.001;
+    o->nb_patterns = 16;
+    o->min_length = 32;
+    o->max_length = 32;
+    o->max_edits = 2;
+    o->max_plants = 8;
+
+    while ((opt = getopt(argc, argv, "+s:w:g:R:N:p:l:k:m:")) != -1) {
+        switch (opt) {
+            case 's':
+                o->seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                o->width = atoi(optarg);
+                break;
+            case 'g':
+                o->gc = atof(optarg);
+                break;
+            case 'R':
+                o->repeats = atof(optarg);
+                break;
+            case 'N':
+                o->n_runs = atof(optarg);
+                break;
+            case 'p':
+                o->nb_patterns = atoi(optarg);
+                break;
+            case 'l':
+                if (sscanf(optarg, "%d-%d", &o->min_length, &o->max_length) !=
+                    2) {
+                    o->max_length = o->min_length;
+                }
+                break;
+            case 'k':
+                o->max_edits = atoi(optarg);
+                break;
+            case 'm':
+                o->max_plants = atoi(optarg);
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (o->width < 0 || o->gc < 0 || o->gc > 1 || o->repeats < 0 ||
+        o->n_runs < 0 || o->repeats + o->n_runs >= 1 || o->nb_patterns < 0 ||
+        o->max_edits < 0 || o->max_plants < 0 ||
+        o->min_length <= o->max_edits || o->max_length < o->min_length) {
+        fprintf(stderr,
+                "Invalid options: the fractions must be in [0, 1) and the "
+                "patterns longer than -k\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct gen_options o;
+    struct source src;
+    struct plant *plants = NULL;
+    char **patterns = NULL;
+    int *lengths = NULL;
+    long long *expected = NULL;  // per pattern: edit then Hamming, 0..k
+    int *planted = NULL;
+    char *segment, *copy, *tail;
+    int *column;
+    int tail_size = 0;
+    long long size, nb_segments, s, written = 0;
+    int segment_length, segment_bytes, reach, nb_plants = 0, next_plant = 0;
+    int nb_counts, i, k;
+    double worst_chance = 0;
+    FILE *database;
+
+    if (parse_options(argc, argv, &o) || (argc - optind != 2 &&
+                                          argc - optind != 4)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    size = parse_size(argv[optind]);
+    if (size < 0) {
+        fprintf(stderr, "Invalid size %s\n", argv[optind]);
+        return 1;
+    }
+    if (argc - optind == 2) {
+        o.nb_patterns = 0;
+    }
+
+    rng_state = o.seed;
+    gc_content = o.gc;
+
+    /* Segments: the lines, or blocks of one line. A planted copy and the
+     * windows around it stay inside one segment, the last one excepted. */
+    segment_length = o.width > 0 ? o.width : UNWRAPPED_SEGMENT;
+    segment_bytes = segment_length + (o.width > 0);
+    nb_segments = (size + segment_bytes - 1) / segment_bytes;
+    reach = 2 * o.max_edits;
+    if (o.nb_patterns > 0 && o.max_length + 2 * reach > segment_length) {
+        fprintf(stderr,
+                "Patterns of %d with %d edit(s) do not fit in lines of %d: "
+                "use -w 0 or a larger -w\n",
+                o.max_length, o.max_edits, segment_length);
+        return 1;
+    }
+
+    segment = (char *)malloc(segment_length + 1);
+    copy = (char *)malloc(o.max_length + o.max_edits + 1);
+    tail = (char *)malloc(o.max_length);
+    column = (int *)malloc((o.max_length + 1) * sizeof(int));
+    patterns = (char **)calloc(o.nb_patterns + 1, sizeof(char *));
+    lengths = (int *)malloc((o.nb_patterns + 1) * sizeof(int));
+    planted = (int *)calloc(o.nb_patterns + 1, sizeof(int));
+    nb_counts = 2 * (o.max_edits + 1);
+    expected =
+        (long long *)calloc((o.nb_patterns + 1) * nb_counts, sizeof(long long));
+    if (segment == NULL || copy == NULL || tail == NULL || column == NULL ||
+        patterns == NULL || lengths == NULL || planted == NULL ||
+        expected == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory\n");
+        return 1;
+    }
+
+    /* Patterns, and how many copies of each are planted */
+    for (i = 0; i < o.nb_patterns; i++) {
+        int j;
+
+        lengths[i] = o.min_length +
+                     random_below(o.max_length - o.min_length + 1);
+        patterns[i] = (char *)malloc(lengths[i] + 1);
+        if (patterns[i] == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory\n");
+            return 1;
+        }
+        for (j = 0; j < lengths[i]; j++) {
+            patterns[i][j] = random_base();
+        }
+        patterns[i][lengths[i]] = '\0';
+        planted[i] = random_below(o.max_plants + 1);
+        nb_plants += planted[i];
+    }
+    if (nb_plants > nb_segments - 1) {
+        fprintf(stderr, "%lld byte(s) is too small for %d planted copies\n",
+                size, nb_plants);
+        return 1;
+    }
+
+    /* One copy per segment: the segments are split into nb_plants strata,
+     * each gets one copy at a random segment, in a random order */
+    if (nb_plants > 0) {
+        int p = 0;
+
+        plants = (struct plant *)malloc(nb_plants * sizeof(struct plant));
+        if (plants == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory\n");
+            return 1;
+        }
+        for (i = 0; i < o.nb_patterns; i++) {
+            int c;
+
+            for (c = 0; c < planted[i]; c++, p++) {
+                plants[p].pattern = i;
+                plants[p].edits = random_below(o.max_edits + 1);
+            }
+        }
+        for (p = nb_plants - 1; p > 0; p--) {
+            int q = random_below(p + 1);
+            struct plant t = plants[p];
+
+            plants[p] = plants[q];
+            plants[q] = t;
+        }
+        for (p = 0; p < nb_plants; p++) {
+            long long first = (nb_segments - 1) * p / nb_plants;
+            long long last = (nb_segments - 1) * (p + 1) / nb_plants;
+            int room =
+                segment_length - lengths[plants[p].pattern] - 2 * reach;
+
+            plants[p].segment = first + random_below(last - first);
+            plants[p].column = reach + random_below(room + 1);
+        }
+    }
+
+    database = fopen(argv[optind + 1], "w");
+    if (database == NULL) {
+        fprintf(stderr, "Unable to open the database file %s\n",
+                argv[optind + 1]);
+        return 1;
+    }
+    setvbuf(database, NULL, _IOFBF, 1 << 20);
+
+    source_init(&src, &o);
+
+    for (s = 0; written < size; s++) {
+        int length = segment_length;
+        int j;
+
+        for (j = 0; j < segment_length; j++) {
+            segment[j] = next_base(&src);
+        }
+
+        if (next_plant < nb_plants && plants[next_plant].segment == s) {
+            struct plant *p = &plants[next_plant++];
+            char *pattern = patterns[p->pattern];
+            int len = lengths[p->pattern];
+            long long *counts = &expected[p->pattern * nb_counts];
+            int shift;
+
+            memcpy(&segment[p->column], copy,
+                   mutate(pattern, len, p->edits, copy));
+
+            /* Every window that overlaps the copy enough to match: the
+             * edits move the copy by up to max_edits, and a window needs
+             * as many indels as it is shifted from it */
+            for (shift = -reach; shift <= reach; shift++) {
+                char *window = &segment[p->column + shift];
+                int d = edit_distance(pattern, window, len, column);
+                int h = hamming_distance(pattern, window, len);
+
+                for (k = d; k <= o.max_edits; k++) {
+                    counts[k]++;
+                }
+                for (k = h; k <= o.max_edits; k++) {
+                    counts[o.max_edits + 1 + k]++;
+                }
+            }
+        }
+
+        if (o.width > 0) {
+            segment[length++] = '\n';
+        }
+        if (length > size - written) {
+            length = size - written;
+        }
+        if (fwrite(segment, 1, length, database) != (size_t)length) {
+            fprintf(stderr, "Unable to write the database file %s\n",
+                    argv[optind + 1]);
+            return 1;
+        }
+        written += length;
+
+        /* The last max_length bytes, for the windows at the end */
+        if (length >= o.max_length) {
+            tail_size = o.max_length;
+            memcpy(tail, &segment[length - tail_size], tail_size);
+        } else {
+            int keep = tail_size + length <= o.max_length
+                           ? tail_size
+                           : o.max_length - length;
+
+            memmove(tail, &tail[tail_size - keep], keep);
+            memcpy(&tail[keep], segment, length);
+            tail_size = keep + length;
+        }
+    }
+    if (fclose(database) != 0) {
+        fprintf(stderr, "Unable to write the database file %s\n",
+                argv[optind + 1]);
+        return 1;
+    }
+
+    /* The windows of the last size bytes are compared to the first size
+     * characters of the pattern, and searched while size > k */
+    for (i = 0; i < o.nb_patterns; i++) {
+        long long *counts = &expected[i * nb_counts];
+        int size;
+
+        for (size = 1; size < lengths[i] && size <= tail_size; size++) {
+            char *window = &tail[tail_size - size];
+            int d = edit_distance(patterns[i], window, size, column);
+            int h = hamming_distance(patterns[i], window, size);
+
+            for (k = d; k <= o.max_edits && k < size; k++) {
+                counts[k]++;
+            }
+            for (k = h; k <= o.max_edits && k < size; k++) {
+                counts[o.max_edits + 1 + k]++;
+            }
+        }
+    }
+
+    if (o.nb_patterns > 0) {
+        FILE *pattern_file = fopen(argv[optind + 2], "w");
+        FILE *expected_file = fopen(argv[optind + 3], "w");
+
+        if (pattern_file == NULL || expected_file == NULL) {
+            fprintf(stderr, "Unable to open %s or %s\n", argv[optind + 2],
+                    argv[optind + 3]);
+            return 1;
+        }
+        fprintf(expected_file,
+                "; apm_gen -s %llu: %lld byte(s), %d pattern(s), planted "
+                "with up to %d edit(s)\n"
+                "; pattern planted edit_0..edit_%d hamming_0..hamming_%d\n",
+                (unsigned long long)o.seed, size, o.nb_patterns, o.max_edits,
+                o.max_edits, o.max_edits);
+        for (i = 0; i < o.nb_patterns; i++) {
+            double chance =
+                chance_matches(size, lengths[i], o.max_edits);
+
+            if (chance > worst_chance) {
+                worst_chance = chance;
+            }
+            fprintf(pattern_file, "%s\n", patterns[i]);
+            fprintf(expected_file, "%s %d", patterns[i], planted[i]);
+            for (k = 0; k < nb_counts; k++) {
+                fprintf(expected_file, " %lld", expected[i * nb_counts + k]);
+            }
+            fprintf(expected_file, "\n");
+        }
+        fclose(pattern_file);
+        if (fclose(expected_file) != 0) {
+            fprintf(stderr, "Unable to write %s\n", argv[optind + 3]);
+            return 1;
+        }
+    }
+
+    printf("%lld byte(s) written to %s", written, argv[optind + 1]);
+    if (o.nb_patterns > 0) {
+        printf(", %d pattern(s) planted %d time(s) in all", o.nb_patterns,
+               nb_plants);
+    }
+    printf("\n");
+    if (worst_chance > BACKGROUND_WARNING) {
+        fprintf(stderr,
+                "Warning: about %.2g chance match(es) per pattern at %d "
+                "edit(s), the expected counts are lower bounds: use longer "
+                "patterns\n",
+                worst_chance, o.max_edits);
+    }
+
+    for (i = 0; i < o.nb_patterns; i++) {
+        free(patterns[i]);
+    }
+    free(patterns);
+    free(lengths);
+    free(planted);
+    free(expected);
+    free(plants);
+    free(segment);
+    free(copy);
+    free(tail);
+    free(column);
+    return 0;
+}
@@ -0,0 +1,392 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * Microbenchmark of the distance kernels
+ *
+ * Usage:
+ * ./apm_kbench [-l lengths] [-k factors] [-b bytes] [-t seconds] [-c]
+ *              [dna_database]
+ *
+ * Runs every kernel of src/utils.c alone, on one thread, over all the windows
+ * of a buffer (the database, or random bases), for each pattern length and
+ * approximation factor, and reports windows, bytes and cell updates per
+ * second, and cycles per window (time stamp counter). A cell is one entry of
+ * the DP matrix, len^2 per window (twice for both strands, len for Hamming),
+ * counted even when the kernel stops early, so that the kernels are compared
+ * on the same work. With -c, reads the hardware counters instead
+ * (perf_event_open): core cycles, instructions per cycle, cache misses and
+ * branch mispredictions per window.
+ */
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "utils.h"
+
+#define MAX_LENGTHS 32
+#define DEFAULT_BYTES (1 << 20)
+#define DEFAULT_SECONDS 0.2
+
+// Kinds of kernels: the full distance, bounded by k, both strands, Hamming
+enum { DISTANCE, BOUNDED, STRANDS, HAMMING };
+
+struct kernel {
+    const char *name;
+    int kind;
+    int specialized;  // kernel of the length class (levenshtein_select())
+};
+
+static const struct kernel kernels[] = {
+    {"levenshtein", DISTANCE, 0},
+    {"levenshtein_class", DISTANCE, 1},
+    {"bounded", BOUNDED, 0},
+    {"bounded_class", BOUNDED, 1},
+    {"strands", STRANDS, 0},
+    {"strands_class", STRANDS, 1},
+    {"hamming", HAMMING, 0},
+};
+
+#define NB_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/* Hardware counters, read as one group */
+enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NB_COUNTERS };
+
+struct counters {
+    int fd[NB_COUNTERS];
+    uint64_t values[NB_COUNTERS];
+};
+
+static int counters_open(struct counters *c) {
+    static const uint64_t configs[NB_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    int i;
+
+    for (i = 0; i < NB_COUNTERS; i++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                           i == 0 ? -1 : c->fd[0], 0);
+        if (c->fd[i] == -1) {
+            perror("perf_event_open");
+            fprintf(stderr,
+                    "No hardware counters (virtual machine, or "
+                    "/proc/sys/kernel/perf_event_paranoid > 2?)\n");
+            while (--i >= 0) {
+                close(c->fd[i]);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void counters_start(struct counters *c) {
+    ioctl(c->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void counters_stop(struct counters *c) {
+    uint64_t group[1 + NB_COUNTERS];
+    int i;
+
+    ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(c->fd[0], group, sizeof(group)) != sizeof(group)) {
+        memset(group, 0, sizeof(group));
+    }
+    for (i = 0; i < NB_COUNTERS; i++) {
+        c->values[i] = group[1 + i];
+    }
+}
+
+static void counters_close(struct counters *c) {
+    int i;
+
+    for (i = 0; i < NB_COUNTERS; i++) {
+        close(c->fd[i]);
+    }
+}
+
+static double now(void) {
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// Time stamp counter (reference cycles), 0 where there is none
+static uint64_t tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* One pass of a kernel over the windows [0, nb_windows) of buf; the sum of
+ * the distances keeps the compiler from dropping the calls */
+static long scan(const struct kernel *kernel, char *pattern, char *pattern_rc,
+                 int len, int k, char *buf, int n_bytes, int nb_windows,
+                 int *column, int *distances) {
+    struct levenshtein_kernels lk;
+    long sum = 0;
+    int j;
+
+    if (kernel->specialized) {
+        levenshtein_select(len, &lk);
+    } else {
+        lk.distance = levenshtein;
+        lk.bounded = levenshtein_bounded;
+        lk.strands = levenshtein_strands;
+    }
+
+    switch (kernel->kind) {
+        case DISTANCE:
+            for (j = 0; j < nb_windows; j++) {
+                sum += lk.distance(pattern, &buf[j], len, column);
+            }
+            break;
+        case BOUNDED:
+            for (j = 0; j < nb_windows; j++) {
+                sum += lk.bounded(pattern, &buf[j], len, column, k);
+            }
+            break;
+        case STRANDS:
+            for (j = 0; j < nb_windows; j++) {
+                int d[2];
+
+                lk.strands(pattern, pattern_rc, &buf[j], len, column, k, d);
+                sum += d[0] + d[1];
+            }
+            break;
+        default:
+            for (j = 0; j < nb_windows; j += HAMMING_BATCH) {
+                int count = nb_windows - j < HAMMING_BATCH ? nb_windows - j
+                                                           : HAMMING_BATCH;
+                int w;
+
+                hamming_windows(pattern, len, buf, n_bytes, j, count, k,
+                                distances);
+                for (w = 0; w < count; w++) {
+                    sum += distances[w];
+                }
+            }
+            break;
+    }
+    return sum;
+}
+
+static int parse_list(char *s, int *values, int max) {
+    int n = 0;
+    char *token;
+
+    for (token = strtok(s, ","); token != NULL && n < max;
+         token = strtok(NULL, ",")) {
+        values[n++] = atoi(token);
+    }
+    return n;
+}
+
+static void print_usage(char *progname) {
+    printf(
+        "Usage: %s [-l lengths] [-k factors] [-b bytes] [-t seconds] [-c] "
+        "[dna_database]\n",
+        progname);
+    printf(
+        "  -l lengths    pattern lengths, comma separated "
+        "(8,16,20,32,50,64,100,128,200)\n");
+    printf("  -k factors    approximation factors of the bounded kernels "
+           "(0,1,2,4)\n");
+    printf("  -b bytes      bytes of random bases without a database (%d)\n",
+           DEFAULT_BYTES);
+    printf("  -t seconds    least time of a measurement (%.1f)\n",
+           DEFAULT_SECONDS);
+    printf("  -c            read the hardware counters (perf_event_open)\n");
+}
+
+int main(int argc, char **argv) {
+    char default_lengths[] = "8,16,20,32,50,64,100,128,200";
+    char default_factors[] = "0,1,2,4";
+    int lengths[MAX_LENGTHS], factors[MAX_LENGTHS];
+    int nb_lengths, nb_factors, max_length = 0;
+    int n_bytes = DEFAULT_BYTES;
+    double min_seconds = DEFAULT_SECONDS;
+    int use_counters = 0;
+    struct counters counters;
+    char *lengths_arg = default_lengths, *factors_arg = default_factors;
+    char *buf, *pattern_rc;
+    int *column, *distances;
+    int opt, i, l, f;
+    long checksum = 0;
+
+    while ((opt = getopt(argc, argv, "l:k:b:t:c")) != -1) {
+        switch (opt) {
+            case 'l':
+                lengths_arg = optarg;
+                break;
+            case 'k':
+                factors_arg = optarg;
+                break;
+            case 'b':
+                n_bytes = atoi(optarg);
+                break;
+            case 't':
+                min_seconds = atof(optarg);
+                break;
+            case 'c':
+                use_counters = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    nb_lengths = parse_list(lengths_arg, lengths, MAX_LENGTHS);
+    nb_factors = parse_list(factors_arg, factors, MAX_LENGTHS);
+    for (l = 0; l < nb_lengths; l++) {
+        if (lengths[l] > max_length) {
+            max_length = lengths[l];
+        }
+    }
+
+    if (optind < argc) {
+        buf = read_input_file(argv[optind], &n_bytes);
+        if (buf == NULL) {
+            return 1;
+        }
+    } else {
+        buf = (char *)malloc(n_bytes);
+        if (buf == NULL) {
+            fprintf(stderr, "Unable to allocate %d byte(s)\n", n_bytes);
+            return 1;
+        }
+        srand(1);
+        for (i = 0; i < n_bytes; i++) {
+            buf[i] = "ACGT"[rand() % 4];
+        }
+    }
+    if (nb_lengths == 0 || nb_factors == 0 || max_length < 1 ||
+        n_bytes <= max_length) {
+        fprintf(stderr, "The buffer (%d bytes) must be longer than the "
+                        "patterns\n",
+                n_bytes);
+        return 1;
+    }
+
+    column = (int *)malloc(2 * (max_length + 1) * sizeof(int));
+    distances = (int *)malloc(HAMMING_BATCH * sizeof(int));
+    pattern_rc = (char *)malloc(max_length + 1);
+    if (column == NULL || distances == NULL || pattern_rc == NULL) {
+        fprintf(stderr, "Unable to allocate the columns\n");
+        return 1;
+    }
+
+    if (use_counters && counters_open(&counters)) {
+        use_counters = 0;
+    }
+
+    printf("%-18s %6s %3s %12s %10s %8s %10s", "kernel", "length", "k",
+           "windows/s", "MB/s", "GCUPS", "cycles/win");
+    if (use_counters) {
+        printf(" %6s %14s %15s", "IPC", "cache-miss/win", "branch-miss/win");
+    }
+    printf("\n");
+
+    for (i = 0; i < NB_KERNELS; i++) {
+        const struct kernel *kernel = &kernels[i];
+
+        for (l = 0; l < nb_lengths; l++) {
+            int len = lengths[l];
+            // The pattern: the last window of the buffer
+            char *pattern = &buf[n_bytes - len];
+            int nb_windows = n_bytes - len;
+
+            reverse_complement(pattern, len, pattern_rc);
+
+            // The full distance does not depend on k
+            for (f = 0; f < (kernel->kind == DISTANCE ? 1 : nb_factors);
+                 f++) {
+                int k = factors[f];
+                long passes = 0;
+                double t1, seconds, windows, cells, cycles;
+                uint64_t c1;
+                char k_label[16];
+
+                if (use_counters) {
+                    counters_start(&counters);
+                }
+                t1 = now();
+                c1 = tsc();
+                do {
+                    checksum += scan(kernel, pattern, pattern_rc, len, k, buf,
+                                     n_bytes, nb_windows, column, distances);
+                    passes++;
+                    seconds = now() - t1;
+                } while (seconds < min_seconds);
+                cycles = tsc() - c1;
+                if (use_counters) {
+                    counters_stop(&counters);
+                    cycles = counters.values[CYCLES];
+                }
+
+                windows = (double)passes * nb_windows;
+                cells = windows * len * len *
+                        (kernel->kind == STRANDS ? 2 : 1);
+                if (kernel->kind == HAMMING) {
+                    cells = windows * len;
+                }
+                if (kernel->kind == DISTANCE) {
+                    strcpy(k_label, "-");
+                } else {
+                    snprintf(k_label, sizeof(k_label), "%d", k);
+                }
+                // A window starts one byte after the previous one
+                printf("%-18s %6d %3s %12.4g %10.2f %8.3f %10.1f",
+                       kernel->name, len, k_label, windows / seconds,
+                       windows / seconds / 1e6, cells / seconds / 1e9,
+                       cycles / windows);
+                if (use_counters) {
+                    uint64_t *v = counters.values;
+
+                    printf(" %6.2f %14.4f %15.4f",
+                           v[CYCLES] ? (double)v[INSTRUCTIONS] / v[CYCLES] : 0,
+                           v[CACHE_MISSES] / windows,
+                           v[BRANCH_MISSES] / windows);
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (use_counters) {
+        counters_close(&counters);
+    }
+    // Printed so that the scans are not optimized away
+    fprintf(stderr, "Checksum %ld\n", checksum);
+
+    free(buf);
+    free(column);
+    free(distances);
+    free(pattern_rc);
+    return 0;
+}
@@ -0,0 +1,587 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define CACHE_DEBUG 0
+
+#define CACHE_BUCKETS (2 * CACHE_CAPACITY)
+
+// Chunks of the database hashed at a time (a multiple of 8)
+#define HASH_CHUNK (1 << 20)
+
+struct cache_entry {
+    char *key;  // "approx_factor nb_strands hamming pattern"
+    int has_histograms;
+    int nb_values;
+    int *values;                // counts, then histograms
+    struct cache_entry *next;   // in the same bucket
+    struct cache_entry *newer;  // LRU list
+    struct cache_entry *older;
+};
+
+struct result_cache {
+    char *dir;
+    char *filename;
+    char *results_path;
+    struct cache_entry **buckets;
+    struct cache_entry *newest;
+    struct cache_entry *oldest;
+    int nb_entries;
+    int nb_lines;  // in the results file
+};
+
+// The cache of the current database (kept open in server mode)
+static struct result_cache *current = NULL;
+
+int cacheable_options(struct apm_options *opts) {
+    return opts->hits_file == NULL && opts->top_n == 0;
+}
+
+/* 8 bytes at a time; size must be a multiple of 8 except for the last
+ * chunk of the database */
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t size) {
+    size_t i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        uint64_t w;
+
+        memcpy(&w, &data[i], 8);
+        h ^= w * 0x87c37b91114253d5ULL;
+        h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+    }
+    for (; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_final(uint64_t h, uint64_t size) {
+    h ^= size;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t content_hash(const char *data, size_t size) {
+    return hash_final(hash_bytes(0, data, size), size);
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int hash_file(char *filename, uint64_t *hash) {
+    char *chunk = (char *)malloc(HASH_CHUNK);
+    uint64_t h = 0, size = 0;
+    FILE *f;
+    size_t r;
+
+    f = fopen(filename, "r");
+    if (f == NULL || chunk == NULL) {
+        fprintf(stderr, "Unable to hash the database <%s>\n", filename);
+        free(chunk);
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 1;
+    }
+    while ((r = fread(chunk, 1, HASH_CHUNK, f)) > 0) {
+        h = hash_bytes(h, chunk, r);
+        size += r;
+    }
+    fclose(f);
+    free(chunk);
+
+    *hash = hash_final(h, size);
+    return 0;
+}
+
+/* The hash of the database file, from cache_dir/databases when the file did
+ * not change since it was computed. Lines: hash size mtime inode path */
+static int database_hash(char *dir, char *filename, uint64_t *hash) {
+    char path[PATH_MAX], index_path[PATH_MAX];
+    struct stat st;
+    char *line = NULL;
+    size_t capacity = 0;
+    int found = 0;
+    FILE *index;
+
+    if (stat(filename, &st) == -1 || realpath(filename, path) == NULL) {
+        fprintf(stderr, "Unable to open the text file <%s>\n", filename);
+        return 1;
+    }
+    snprintf(index_path, PATH_MAX, "%s/databases", dir);
+
+    index = fopen(index_path, "r");
+    while (index != NULL && getline(&line, &capacity, index) != -1) {
+        unsigned long long h, size, inode;
+        long long sec, nsec;
+        int end = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%llx %llu %lld.%lld %llu %n", &h, &size, &sec, &nsec,
+                   &inode, &end) == 5 &&
+            end > 0 && !strcmp(&line[end], path) &&
+            size == (unsigned long long)st.st_size &&
+            sec == (long long)st.st_mtim.tv_sec &&
+            nsec == (long long)st.st_mtim.tv_nsec &&
+            inode == (unsigned long long)st.st_ino) {
+            // The last line of the file wins
+            *hash = h;
+            found = 1;
+        }
+    }
+    free(line);
+    if (index != NULL) {
+        fclose(index);
+    }
+    if (found) {
+        return 0;
+    }
+
+    if (hash_file(filename, hash)) {
+        return 1;
+    }
+    index = fopen(index_path, "a");
+    if (index != NULL) {
+        fprintf(index, "%016llx %llu %lld.%09lld %llu %s\n",
+                (unsigned long long)*hash, (unsigned long long)st.st_size,
+                (long long)st.st_mtim.tv_sec, (long long)st.st_mtim.tv_nsec,
+                (unsigned long long)st.st_ino, path);
+        fclose(index);
+    }
+    return 0;
+}
+
+static char *make_key(char *pattern, struct apm_options *opts,
+                      int approx_factor) {
+    char *key = (char *)malloc(strlen(pattern) + 40);
+
+    if (key != NULL) {
+        sprintf(key, "%d %d %d %s", approx_factor, opts->nb_strands,
+                opts->hamming, pattern);
+    }
+    return key;
+}
+
+static void lru_unlink(struct result_cache *c, struct cache_entry *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+}
+
+static void lru_push(struct result_cache *c, struct cache_entry *e) {
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest != NULL) {
+        c->newest->newer = e;
+    } else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+static struct cache_entry *lookup(struct result_cache *c, char *key) {
+    struct cache_entry *e = c->buckets[hash_key(key) % CACHE_BUCKETS];
+
+    while (e != NULL && strcmp(e->key, key)) {
+        e = e->next;
+    }
+    if (e != NULL) {
+        lru_unlink(c, e);
+        lru_push(c, e);
+    }
+    return e;
+}
+
+static void evict_oldest(struct result_cache *c) {
+    struct cache_entry *e = c->oldest;
+    struct cache_entry **p = &c->buckets[hash_key(e->key) % CACHE_BUCKETS];
+
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    lru_unlink(c, e);
+    c->nb_entries--;
+    free(e->key);
+    free(e->values);
+    free(e);
+}
+
+// Inserts or replaces the entry of key (the cache takes key and values)
+static void insert(struct result_cache *c, char *key, int has_histograms,
+                   int nb_values, int *values) {
+    struct cache_entry *e = lookup(c, key);
+
+    if (e != NULL) {
+        free(key);
+        free(e->values);
+    } else {
+        if (c->nb_entries == CACHE_CAPACITY) {
+            evict_oldest(c);
+        }
+        e = (struct cache_entry *)malloc(sizeof(struct cache_entry));
+        if (e == NULL) {
+            free(key);
+            free(values);
+            return;
+        }
+        e->key = key;
+        e->next = c->buckets[hash_key(key) % CACHE_BUCKETS];
+        c->buckets[hash_key(key) % CACHE_BUCKETS] = e;
+        lru_push(c, e);
+        c->nb_entries++;
+    }
+    e->has_histograms = has_histograms;
+    e->nb_values = nb_values;
+    e->values = values;
+}
+
+/* Lines of the results file:
+ * has_histograms nb_values value... approx_factor nb_strands hamming pattern
+ * (the key last, as the pattern runs until the end of the line) */
+static void write_entry(FILE *f, struct cache_entry *e) {
+    int v;
+
+    fprintf(f, "%d %d", e->has_histograms, e->nb_values);
+    for (v = 0; v < e->nb_values; v++) {
+        fprintf(f, " %d", e->values[v]);
+    }
+    fprintf(f, " %s\n", e->key);
+}
+
+/* Rewrites the results file with the entries of the LRU only, oldest first
+ * so that they are loaded again in the same order: the lines of evicted or
+ * replaced entries, and cut lines, are dropped. The new file replaces the
+ * old one at once (rename). */
+static void compact(struct result_cache *c) {
+    char *path = (char *)malloc(strlen(c->results_path) + 8);
+    struct cache_entry *e;
+    FILE *f;
+
+    if (path == NULL) {
+        return;
+    }
+    sprintf(path, "%s.tmp", c->results_path);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        free(path);
+        return;
+    }
+    for (e = c->oldest; e != NULL; e = e->newer) {
+        write_entry(f, e);
+    }
+    if (fclose(f) != 0 || rename(path, c->results_path) == -1) {
+        perror(c->results_path);
+        unlink(path);
+    } else {
+        c->nb_lines = c->nb_entries;
+    }
+
+#if CACHE_DEBUG
+    printf("Result cache %s compacted: %d entries\n", c->results_path,
+           c->nb_entries);
+#endif
+    free(path);
+}
+
+static void load_results(struct result_cache *c) {
+    char *line = NULL;
+    size_t capacity = 0;
+    int complete = 1;
+    ssize_t length;
+    FILE *f;
+
+    f = fopen(c->results_path, "r");
+    if (f == NULL) {
+        return;
+    }
+    while ((length = getline(&line, &capacity, f)) != -1) {
+        int has_histograms, nb_values, end, v;
+        char *p = line;
+        int *values;
+
+        c->nb_lines++;
+        if (line[length - 1] != '\n') {
+            // Cut by an interrupted run: its pattern may be cut as well
+            continue;
+        }
+        line[length - 1] = '\0';
+        if (sscanf(p, "%d %d %n", &has_histograms, &nb_values, &end) != 2 ||
+            nb_values <= 0) {
+            continue;
+        }
+        values = (int *)malloc(nb_values * sizeof(int));
+        if (values == NULL) {
+            complete = 0;
+            break;
+        }
+        p += end;
+        for (v = 0; v < nb_values && sscanf(p, "%d %n", &values[v], &end) == 1;
+             v++) {
+            p += end;
+        }
+        if (v < nb_values || *p == '\0') {
+            // Truncated line (interrupted run)
+            free(values);
+            continue;
+        }
+        char *key = strdup(p);
+        if (key == NULL) {
+            free(values);
+            complete = 0;
+            break;
+        }
+        insert(c, key, has_histograms, nb_values, values);
+    }
+    free(line);
+    fclose(f);
+
+    // Without compaction, the patterns evicted here would be searched and
+    // appended again, and the file would grow with every run
+    if (complete && c->nb_lines > c->nb_entries) {
+        compact(c);
+    }
+}
+
+static void cache_free(struct result_cache *c) {
+    while (c->oldest != NULL) {
+        evict_oldest(c);
+    }
+    free(c->buckets);
+    free(c->results_path);
+    free(c->filename);
+    free(c->dir);
+    free(c);
+}
+
+/* db: the resident database of the server mode (hashed in memory), NULL to
+ * identify the file */
+struct result_cache *cache_open(char *dir, char *filename,
+                                struct apm_database *db) {
+    struct result_cache *c;
+    uint64_t hash;
+
+    if (current != NULL && !strcmp(current->dir, dir) &&
+        !strcmp(current->filename, filename)) {
+        return current;
+    }
+    if (current != NULL) {
+        cache_free(current);
+        current = NULL;
+    }
+
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        perror(dir);
+        return NULL;
+    }
+    if (db != NULL) {
+        hash = content_hash(db->buf, db->n_bytes);
+    } else if (database_hash(dir, filename, &hash)) {
+        return NULL;
+    }
+
+    c = (struct result_cache *)calloc(1, sizeof(struct result_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->dir = strdup(dir);
+    c->filename = strdup(filename);
+    c->results_path = (char *)malloc(strlen(dir) + 32);
+    c->buckets =
+        (struct cache_entry **)calloc(CACHE_BUCKETS, sizeof(struct cache_entry *));
+    if (c->dir == NULL || c->filename == NULL || c->results_path == NULL ||
+        c->buckets == NULL) {
+        cache_free(c);
+        return NULL;
+    }
+    sprintf(c->results_path, "%s/%016llx.results", dir,
+            (unsigned long long)hash);
+    load_results(c);
+
+#if CACHE_DEBUG
+    printf("Result cache %s: %d entries\n", c->results_path, c->nb_entries);
+#endif
+
+    current = c;
+    return c;
+}
+
+// Answers what it can from the cache; q->novel gets the other patterns
+int cache_prepare(struct result_cache *c, struct pattern_set *patterns,
+                  struct apm_options *opts, int approx_factor,
+                  struct cache_query *q) {
+    int nb_strands = opts->nb_strands;
+    int hist_size = nb_strands * (approx_factor + 1);
+    int nb_patterns = patterns->nb_patterns;
+    char **novel;
+    int nb_novel = 0;
+    int i, res;
+
+    memset(q, 0, sizeof(struct cache_query));
+    q->from_cache = (char *)calloc(nb_patterns + 1, sizeof(char));
+    q->counts = (int *)calloc(nb_patterns * nb_strands + 1, sizeof(int));
+    q->histograms = (int *)calloc(nb_patterns * hist_size + 1, sizeof(int));
+    novel = (char **)malloc((nb_patterns + 1) * sizeof(char *));
+    if (q->from_cache == NULL || q->counts == NULL || q->histograms == NULL ||
+        novel == NULL) {
+        fprintf(stderr, "Unable to allocate the results of %d patterns\n",
+                nb_patterns);
+        free(novel);
+        cache_query_free(q);
+        return 1;
+    }
+
+    for (i = 0; i < nb_patterns; i++) {
+        char *key = make_key(patterns->pattern[i], opts, approx_factor);
+        struct cache_entry *e = key != NULL ? lookup(c, key) : NULL;
+
+        free(key);
+        if (e != NULL && (!opts->histogram || e->has_histograms)) {
+            memcpy(&q->counts[i * nb_strands], e->values,
+                   nb_strands * sizeof(int));
+            if (e->has_histograms) {
+                memcpy(&q->histograms[i * hist_size], &e->values[nb_strands],
+                       hist_size * sizeof(int));
+            }
+            q->from_cache[i] = 1;
+            q->nb_cached++;
+        } else {
+            novel[nb_novel++] = patterns->pattern[i];
+        }
+    }
+
+    res = make_patterns(&q->novel, nb_novel, novel, NULL);
+    free(novel);
+    if (res) {
+        cache_query_free(q);
+    }
+    return res;
+}
+
+/* Adds the results of the searched patterns (in the order of q->novel) to
+ * the query and to the cache */
+void cache_complete(struct result_cache *c, struct pattern_set *patterns,
+                    struct apm_options *opts, int approx_factor,
+                    struct cache_query *q, struct apm_results *searched) {
+    int nb_strands = opts->nb_strands;
+    int hist_size = nb_strands * (approx_factor + 1);
+    int nb_values = nb_strands + (opts->histogram ? hist_size : 0);
+    int i, j = 0;
+    FILE *f;
+
+    f = fopen(c->results_path, "a");
+    if (f == NULL) {
+        perror(c->results_path);
+    }
+
+    for (i = 0; i < patterns->nb_patterns; i++) {
+        char *key;
+        int *values;
+
+        if (q->from_cache[i]) {
+            continue;
+        }
+        memcpy(&q->counts[i * nb_strands], &searched->counts[j * nb_strands],
+               nb_strands * sizeof(int));
+        if (opts->histogram) {
+            memcpy(&q->histograms[i * hist_size],
+                   &searched->histograms[j * hist_size],
+                   hist_size * sizeof(int));
+        }
+        j++;
+
+        // Patterns are single lines, except from the command line
+        if (strchr(patterns->pattern[i], '\n') != NULL) {
+            continue;
+        }
+        key = make_key(patterns->pattern[i], opts, approx_factor);
+        values = (int *)malloc(nb_values * sizeof(int));
+        if (key == NULL || values == NULL) {
+            free(key);
+            free(values);
+            continue;
+        }
+        memcpy(values, &q->counts[i * nb_strands], nb_strands * sizeof(int));
+        if (opts->histogram) {
+            memcpy(&values[nb_strands], &q->histograms[i * hist_size],
+                   hist_size * sizeof(int));
+        }
+
+        if (f != NULL) {
+            struct cache_entry written = {.key = key,
+                                          .has_histograms = opts->histogram,
+                                          .nb_values = nb_values,
+                                          .values = values};
+
+            write_entry(f, &written);
+            c->nb_lines++;
+        }
+        insert(c, key, opts->histogram, nb_values, values);
+    }
+
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    // A server appends for as long as it runs
+    if (c->nb_lines > 2 * CACHE_CAPACITY) {
+        compact(c);
+    }
+}
+
+// Prints the results of the query, as the approaches do
+void cache_print(struct pattern_set *patterns, struct apm_options *opts,
+                 int approx_factor, struct cache_query *q) {
+    int nb_results = patterns->nb_patterns * opts->nb_strands;
+    int nb_strands = opts->nb_strands;
+    int i;
+
+    for (i = 0; i < nb_results; i++) {
+        printf("Number of matches for pattern <%s>%s: %d\n",
+               patterns->pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
+               q->counts[i]);
+    }
+
+    if (opts->histogram) {
+        for (i = 0; i < nb_results; i++) {
+            print_histogram(patterns->pattern[i / nb_strands],
+                            STRAND_LABEL(i, nb_strands),
+                            &q->histograms[i * (approx_factor + 1)],
+                            approx_factor);
+        }
+    }
+}
+
+void cache_query_free(struct cache_query *q) {
+    free_patterns(&q->novel);
+    free(q->from_cache);
+    free(q->counts);
+    free(q->histograms);
+    memset(q, 0, sizeof(struct cache_query));
+}
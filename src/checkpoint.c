@@ -0,0 +1,254 @@
+#include "checkpoint.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "utils.h"
+
+#define CHECKPOINT_DEBUG 0
+
+#define HEADER_SIZE 128
+
+// A batch is at most this many times larger than the previous one (whose
+// speed may have been measured on a few patterns)
+#define CHECKPOINT_GROWTH 4
+
+// Identifies the search: its checkpoint is only resumed by the same one
+static void make_header(char *header, struct apm_database *db,
+                        struct pattern_set *patterns, struct apm_options *opts,
+                        int approx_factor) {
+    snprintf(header, HEADER_SIZE,
+             "apm checkpoint %016llx %016llx %d %d %d %d %d\n",
+             (unsigned long long)content_hash(db->buf, db->n_bytes),
+             (unsigned long long)content_hash(patterns->arena,
+                                              patterns->arena_size),
+             patterns->nb_patterns, approx_factor, opts->nb_strands,
+             opts->hamming, opts->histogram);
+}
+
+// One line of results: pattern value...
+static void load_line(struct checkpoint *c, char *line) {
+    int nb_values = c->nb_strands + c->hist_size;
+    int pattern, end, v;
+    int *values;
+    char *p = line;
+
+    values = (int *)malloc(nb_values * sizeof(int));
+    if (values == NULL) {
+        return;
+    }
+    if (sscanf(p, "%d %n", &pattern, &end) == 1 && pattern >= 0 &&
+        pattern < c->nb_patterns && !c->done[pattern]) {
+        p += end;
+        for (v = 0; v < nb_values && sscanf(p, "%d %n", &values[v], &end) == 1;
+             v++) {
+            p += end;
+        }
+        if (v == nb_values && *p == '\0') {
+            memcpy(&c->counts[pattern * c->nb_strands], values,
+                   c->nb_strands * sizeof(int));
+            memcpy(&c->histograms[pattern * c->hist_size],
+                   &values[c->nb_strands], c->hist_size * sizeof(int));
+            c->done[pattern] = 1;
+            c->nb_done++;
+        }
+    }
+    free(values);
+}
+
+/* The results of the file, if it exists. *is_new when it has no header yet,
+ * *cut when its last line was cut. Returns 1 when it is the checkpoint of
+ * another search. */
+static int load(struct checkpoint *c, char *header, int *is_new, int *cut) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int res = 0;
+    FILE *f;
+
+    *is_new = 1;
+    *cut = 0;
+    f = fopen(c->path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (getline(&line, &capacity, f) != -1) {
+        *is_new = 0;
+        if (strcmp(line, header)) {
+            fprintf(stderr,
+                    "Checkpoint <%s> belongs to another search (database, "
+                    "patterns, approximation factor, -r, -s or -H): remove it "
+                    "or use another file\n",
+                    c->path);
+            res = 1;
+        }
+    }
+    while (!res && (length = getline(&line, &capacity, f)) != -1) {
+        if (line[length - 1] != '\n') {
+            // Interrupted run
+            *cut = 1;
+            break;
+        }
+        line[length - 1] = '\0';
+        load_line(c, line);
+    }
+    free(line);
+    fclose(f);
+    return res;
+}
+
+int checkpoint_open(struct checkpoint *c, char *path, struct apm_database *db,
+                    struct pattern_set *patterns, struct apm_options *opts,
+                    int approx_factor, int nb_workers) {
+    char header[HEADER_SIZE];
+    int nb_patterns = patterns->nb_patterns;
+    int is_new, cut;
+
+    memset(c, 0, sizeof(struct checkpoint));
+    c->path = path;
+    c->nb_patterns = nb_patterns;
+    c->nb_strands = opts->nb_strands;
+    c->hist_size = opts->histogram ? opts->nb_strands * (approx_factor + 1) : 0;
+    c->interval = opts->interval;
+    c->multiple = nb_workers > 0 ? nb_workers : 1;
+    c->done = (char *)calloc(nb_patterns + 1, sizeof(char));
+    c->counts = (int *)calloc(nb_patterns * c->nb_strands + 1, sizeof(int));
+    c->histograms = (int *)calloc(nb_patterns * c->hist_size + 1, sizeof(int));
+    if (c->done == NULL || c->counts == NULL || c->histograms == NULL) {
+        fprintf(stderr, "Unable to allocate the results of %d patterns\n",
+                nb_patterns);
+        checkpoint_close(c);
+        return 1;
+    }
+
+    make_header(header, db, patterns, opts, approx_factor);
+    if (load(c, header, &is_new, &cut)) {
+        checkpoint_close(c);
+        return 1;
+    }
+
+    c->file = fopen(path, "a");
+    if (c->file == NULL) {
+        perror(path);
+        checkpoint_close(c);
+        return 1;
+    }
+    if (is_new) {
+        fputs(header, c->file);
+    } else if (cut) {
+        fputs("\n", c->file);
+    }
+    if (fflush(c->file) || fsync(fileno(c->file))) {
+        perror(path);
+        checkpoint_close(c);
+        return 1;
+    }
+
+    printf("Checkpoint %s: %d of %d pattern(s) already searched\n", path,
+           c->nb_done, nb_patterns);
+    return 0;
+}
+
+int checkpoint_next_batch(struct checkpoint *c, int *batch) {
+    long long size = c->multiple;
+    int nb = 0;
+
+    if (c->batch_size > 0) {
+        // What the last batch would have searched in the interval
+        size = (long long)CHECKPOINT_GROWTH * c->batch_size;
+        if (c->seconds > 0 && c->batch_size * c->interval / c->seconds < size) {
+            size = (long long)(c->batch_size * c->interval / c->seconds);
+        }
+
+        // The same number of patterns for every worker, one at least
+        size = (size + c->multiple - 1) / c->multiple * c->multiple;
+        if (size < c->multiple) {
+            size = c->multiple;
+        }
+    }
+
+    while (c->next < c->nb_patterns && nb < size) {
+        if (!c->done[c->next]) {
+            batch[nb++] = c->next;
+        }
+        c->next++;
+    }
+
+#if CHECKPOINT_DEBUG
+    printf("Checkpoint: next batch of %d pattern(s)\n", nb);
+#endif
+    return nb;
+}
+
+int checkpoint_save(struct checkpoint *c, int *batch, int nb,
+                    struct apm_results *results, double seconds) {
+    int i, v;
+
+    for (i = 0; i < nb; i++) {
+        int pattern = batch[i];
+        int *counts = &c->counts[pattern * c->nb_strands];
+        int *histograms = &c->histograms[pattern * c->hist_size];
+
+        memcpy(counts, &results->counts[i * c->nb_strands],
+               c->nb_strands * sizeof(int));
+        memcpy(histograms, &results->histograms[i * c->hist_size],
+               c->hist_size * sizeof(int));
+
+        fprintf(c->file, "%d", pattern);
+        for (v = 0; v < c->nb_strands; v++) {
+            fprintf(c->file, " %d", counts[v]);
+        }
+        for (v = 0; v < c->hist_size; v++) {
+            fprintf(c->file, " %d", histograms[v]);
+        }
+        fprintf(c->file, "\n");
+
+        c->done[pattern] = 1;
+        c->nb_done++;
+    }
+
+    // On the disk before the next batch
+    if (fflush(c->file) || fsync(fileno(c->file))) {
+        perror(c->path);
+        return 1;
+    }
+
+    c->batch_size = nb;
+    c->seconds = seconds;
+    fprintf(stderr,
+            "Checkpoint: %d of %d pattern(s) searched (a batch of %d in "
+            "%.1f s)\n",
+            c->nb_done, c->nb_patterns, nb, seconds);
+    return 0;
+}
+
+void checkpoint_print(struct checkpoint *c, struct pattern_set *patterns,
+                      int approx_factor) {
+    int nb_results = c->nb_patterns * c->nb_strands;
+    int i;
+
+    for (i = 0; i < nb_results; i++) {
+        printf("Number of matches for pattern <%s>%s: %d\n",
+               patterns->pattern[i / c->nb_strands],
+               STRAND_LABEL(i, c->nb_strands), c->counts[i]);
+    }
+
+    for (i = 0; c->hist_size > 0 && i < nb_results; i++) {
+        print_histogram(patterns->pattern[i / c->nb_strands],
+                        STRAND_LABEL(i, c->nb_strands),
+                        &c->histograms[i * (approx_factor + 1)],
+                        approx_factor);
+    }
+}
+
+void checkpoint_close(struct checkpoint *c) {
+    if (c->file != NULL) {
+        fclose(c->file);
+    }
+    free(c->done);
+    free(c->counts);
+    free(c->histograms);
+    memset(c, 0, sizeof(struct checkpoint));
+}
@@ -0,0 +1,171 @@
+#include "chunk_queue.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_ALIGNMENT 64
+
+// Weight of the last chunk in the speed of a consumer
+#define CHUNK_RATE_WEIGHT 0.5
+
+// A consumer, alone on its cache line: only it writes there, the others read
+// its rate
+struct chunk_consumer {
+    double rate;  // items per second, 0 before its first chunk
+    int pulled;   // its static slice is handed out (this scan)
+    int nb_chunks;
+    long long nb_items;
+    char padding[CHUNK_ALIGNMENT - sizeof(double) - 2 * sizeof(int) -
+                 sizeof(long long)];
+};
+
+int chunk_queue_init(struct chunk_queue *q, int nb_consumers) {
+    void *consumers;
+
+    memset(q, 0, sizeof(struct chunk_queue));
+    if (posix_memalign(&consumers, CHUNK_ALIGNMENT,
+                       nb_consumers * sizeof(struct chunk_consumer))) {
+        fprintf(stderr, "Error: unable to allocate the work queue\n");
+        return 1;
+    }
+    q->consumers = (struct chunk_consumer *)consumers;
+    memset(q->consumers, 0, nb_consumers * sizeof(struct chunk_consumer));
+    q->nb_consumers = nb_consumers;
+    return 0;
+}
+
+void chunk_queue_free(struct chunk_queue *q) {
+    free(q->consumers);
+    q->consumers = NULL;
+    q->nb_consumers = 0;
+}
+
+void chunk_queue_reset(struct chunk_queue *q, long long start, long long end,
+                       int dynamic) {
+    int c;
+
+    q->start = start;
+    q->end = end > start ? end : start;
+    q->dynamic = dynamic;
+    for (c = 0; c < q->nb_consumers; c++) {
+        q->consumers[c].pulled = 0;
+    }
+    __atomic_store_n(&q->next, q->start, __ATOMIC_RELAXED);
+}
+
+static double rate_of(struct chunk_queue *q, int c) {
+    double rate;
+
+    __atomic_load(&q->consumers[c].rate, &rate, __ATOMIC_RELAXED);
+    return rate;
+}
+
+// Half of the share of consumer c in the remaining items
+static long long chunk_size(struct chunk_queue *q, int c, long long remaining,
+                            long long min_size, long long max_size) {
+    double mine = rate_of(q, c);
+    double total = 0;
+    long long fair = (q->end - q->start) / q->nb_consumers;
+    long long size;
+    int i;
+
+    // A small scan: no more than an even split, whatever min_size
+    if (min_size > fair) {
+        min_size = fair;
+    }
+    size = min_size;
+
+    if (mine > 0) {
+        // The consumers without a speed yet count as fast as me
+        for (i = 0; i < q->nb_consumers; i++) {
+            double rate = rate_of(q, i);
+            total += rate > 0 ? rate : mine;
+        }
+        size = (long long)(remaining * (mine / total) / 2);
+    }
+    if (size < min_size) {
+        size = min_size;
+    }
+    if (size > max_size) {
+        size = max_size;
+    }
+    return size < 1 ? 1 : size;
+}
+
+long long chunk_queue_pull(struct chunk_queue *q, int c, long long min_size,
+                           long long max_size, long long *first) {
+    struct chunk_consumer *me = &q->consumers[c];
+    long long next, size;
+
+    if (!q->dynamic) {
+        // My slice of the threads of the region, once
+        long long n = q->end - q->start;
+        int nb_slices = omp_get_num_threads();
+
+        if (me->pulled || c >= nb_slices) {
+            return 0;
+        }
+        me->pulled = 1;
+        *first = q->start + n * c / nb_slices;
+        size = q->start + n * (c + 1) / nb_slices - *first;
+        me->nb_chunks += size > 0;
+        me->nb_items += size;
+        return size;
+    }
+
+    next = __atomic_load_n(&q->next, __ATOMIC_RELAXED);
+    do {
+        if (next >= q->end) {
+            return 0;
+        }
+        size = chunk_size(q, c, q->end - next, min_size, max_size);
+        if (size > q->end - next) {
+            size = q->end - next;
+        }
+    } while (!__atomic_compare_exchange_n(&q->next, &next, next + size, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *first = next;
+    me->nb_chunks++;
+    me->nb_items += size;
+    return size;
+}
+
+void chunk_queue_done(struct chunk_queue *q, int c, long long nb_items,
+                      double seconds) {
+    double rate, old;
+
+    if (nb_items <= 0 || seconds <= 0) {
+        return;
+    }
+    rate = nb_items / seconds;
+    old = rate_of(q, c);
+    if (old > 0) {
+        rate = CHUNK_RATE_WEIGHT * rate + (1 - CHUNK_RATE_WEIGHT) * old;
+    }
+    __atomic_store(&q->consumers[c].rate, &rate, __ATOMIC_RELAXED);
+}
+
+void chunk_queue_report(struct chunk_queue *q, int rank, const char *name,
+                        const char *items) {
+    long long total = 0, others = 0;
+    int c, chunks = 0;
+
+    for (c = 0; c < q->nb_consumers; c++) {
+        total += q->consumers[c].nb_items;
+        if (c > 0) {
+            others += q->consumers[c].nb_items;
+            chunks += q->consumers[c].nb_chunks;
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+    fprintf(stderr,
+            "Rank %d split: %s %.1f%% of the %s (%d chunk(s)), %d thread(s) "
+            "%.1f%% (%d chunk(s))\n",
+            rank, name, 100.0 * q->consumers[0].nb_items / total, items,
+            q->consumers[0].nb_chunks, q->nb_consumers - 1,
+            100.0 * others / total, chunks);
+}
@@ -0,0 +1,39 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * CPU-only build (make CPU_ONLY=1): the entry points of the .cu files
+ * without CUDA. No device is ever found, so the approaches never call the
+ * kernels.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void getDeviceCount(int *deviceCountPtr) { *deviceCountPtr = 0; }
+
+void setDevice(int rank, int deviceCount) {}
+
+void kernel_begin(char *buf, int n_bytes, int max_pattern_length) {
+    fprintf(stderr, "Error: apm_parallel was built without CUDA\n");
+    abort();
+}
+
+void kernel_pattern(char *my_pattern, int pattern_length) {}
+
+int invoke_kernel(int first, int nb_windows, int approx_factor) { return 0; }
+
+void kernel_end(void) {}
+
+int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patterns,
+                  int *sizePatterns, int *numberOfMatchesInitialized) {
+    fprintf(stderr, "Error: apm_parallel was built without CUDA\n");
+    abort();
+}
+
+void searchPatternsGPU(int n_bytes, int nb_patterns, int firstPattern,
+                       int lastPattern, int indexFinishMyPieceWithoutExtra,
+                       int myRank, int numberProcesses, int indexStartMyPiece,
+                       int approx_factor) {}
+
+int *getGPUResult(int nb_patterns) { return NULL; }
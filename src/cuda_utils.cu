@@ -10,6 +10,12 @@
 extern "C" void getDeviceCount(int *deviceCountPtr) {
     cudaError_t error_id = cudaGetDeviceCount(deviceCountPtr);
 
+    // A node without a GPU (or its driver) runs the CPU backends
+    if (error_id == cudaErrorNoDevice ||
+        error_id == cudaErrorInsufficientDriver) {
+        *deviceCountPtr = 0;
+        return;
+    }
     if (error_id != cudaSuccess) {
         printf("cudaGetDeviceCount returned %d\n-> %s\n",
                static_cast<int>(error_id), cudaGetErrorString(error_id));
@@ -0,0 +1,60 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "approaches.h"
+#include "phases.h"
+#include "utils.h"
+
+/* Rank 0 reads the database and broadcasts it: every rank gets the whole
+ * buffer. Rank 0 broadcasts a negative size when it could not read it, so
+ * that every rank returns an error. */
+int bcast_database(char *filename, int rank, struct apm_database *db) {
+    int mpi_call_result;
+
+    db->buf = NULL;
+    db->n_bytes = -1;
+    if (rank == 0) {
+        phase_begin(PHASE_LOAD);
+        db->buf = read_database(filename, &db->n_bytes);
+        if (db->buf == NULL) {
+            db->n_bytes = -1;
+        }
+        phase_end(PHASE_LOAD);
+    }
+
+    // Send size of buffer (the workers wait for rank 0 to read the file)
+    phase_begin(PHASE_WAIT);
+    mpi_call_result = MPI_Bcast(&db->n_bytes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    phase_end(PHASE_WAIT);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    if (db->n_bytes < 0) {
+        return 1;
+    }
+
+    // allocate space for buffer (placed for the threads before it is filled)
+    if (rank != 0) {
+        phase_begin(PHASE_LOAD);
+        db->buf = alloc_database(db->n_bytes * sizeof(char));
+        phase_end(PHASE_LOAD);
+        if (db->buf == NULL) {
+            fprintf(stderr, "Unable to allocate %d byte(s) for main array\n",
+                    db->n_bytes);
+            return 1;
+        }
+    }
+
+    // send content of buffer
+    phase_begin(PHASE_DISTRIBUTE);
+    mpi_call_result =
+        MPI_Bcast(db->buf, db->n_bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+    phase_end(PHASE_DISTRIBUTE);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    return 0;
+}
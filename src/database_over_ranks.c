@@ -5,7 +5,16 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include "aho_corasick.h"
 #include "approaches.h"
+#include "chunk_queue.h"
+#include "hits.h"
+#include "numa.h"
+#include "phases.h"
+#include "progress.h"
+#include "scratch.h"
+#include "topn.h"
+#include "trace.h"
 #include "utils.h"
 
 #define DEBUG 0
@@ -13,16 +22,55 @@
 #define DEBUGCHARACTERS 0
 #define DEBUGBYTEOPENMP 0
 #define DEBUGOPENMPPOINTERS 0
-#define DEBUGGPU 1
+#define DEBUGGPU 0
 
-int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastPatternAnalyzedByGPU,
-                  int *sizePatterns, int indexFinishMyPieceWithoutExtra, int myRank,
-                  int numberProcesses, int indexStartMyPiece, int approx_factor, int *numberOfMatchesInitialized);
+int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patterns, int *sizePatterns,
+                  int *numberOfMatchesInitialized);
+
+void searchPatternsGPU(int n_bytes, int nb_patterns, int firstPattern, int lastPattern,
+                       int indexFinishMyPieceWithoutExtra, int myRank, int numberProcesses,
+                       int indexStartMyPiece, int approx_factor);
 
 int * getGPUResult(int nb_patterns);
 
+// Patterns the accelerator pulls from the queue at least (chunk_queue.h): a
+// launch searches one pattern per device thread
+#define ACCEL_CHUNK_PATTERNS 64
+
+// The matches of the patterns [first, last) in my windows, on the
+// accelerator (thread 0). The GPU keeps its counts until getGPUResult().
+static void accelerate(int accelerator, char *buf, int n_bytes, char **pattern,
+                       struct pattern_set *patterns, int first, int last,
+                       int indexStartMyPiece, int indexEndMyWindows,
+                       int indexFinishMyPieceWithoutExtra, int myRank,
+                       int numberProcesses, int approx_factor, int *column,
+                       int *numbersOfMatch) {
+    int i, r, size;
+
+    phase_begin(PHASE_GPU);
+    if (accelerator == ACCEL_CUDA) {
+        searchPatternsGPU(n_bytes, patterns->nb_patterns, first, last,
+                          indexFinishMyPieceWithoutExtra, myRank,
+                          numberProcesses, indexStartMyPiece, approx_factor);
+    } else {
+        for (i = first; i < last; i++) {
+            int size_pattern = PATTERN_LENGTH(patterns, i);
+
+            for (r = indexStartMyPiece; r < indexEndMyWindows; r++) {
+                size = n_bytes - r < size_pattern ? n_bytes - r : size_pattern;
+                numbersOfMatch[i] += levenshtein(pattern[i], &buf[r], size,
+                                                 column) <= approx_factor;
+            }
+        }
+    }
+    phase_end(PHASE_GPU);
+}
+
 int database_over_ranks(int argc, char **argv, int myRank,
-                        int numberProcesses, int cuda_device_exists) {
+                        int numberProcesses, int accelerator,
+                        struct apm_options *opts,
+                        struct pattern_set *patterns,
+                        struct apm_database *db) {
     char **pattern;
     char *filename;
     int approx_factor = 0;
@@ -32,7 +80,13 @@ int database_over_ranks(int argc, char **argv, int myRank,
     struct timeval t1, t2;
     double duration;
     int n_bytes;
-    int *n_matches;
+    int *n_matches = NULL;
+    int *histograms;
+    struct hit_buffer hits;
+    struct topn *best = NULL;
+    char **pattern_rc = NULL;
+    char *rc_arena = NULL;
+    int nb_strands, nb_results, s;
 
 #if DEBUG
 #pragma omp parallel
@@ -43,11 +97,8 @@ int database_over_ranks(int argc, char **argv, int myRank,
 #endif
 
     // Check number of arguments
-    if (argc < 4) {
-        printf(
-                "Usage: %s approximation_factor "
-                "dna_database pattern1 pattern2 ...\n",
-                argv[0]);
+    if (argc < 3 || patterns->nb_patterns == 0) {
+        print_usage(argv[0]);
         return 1;
     }
 
@@ -57,41 +108,60 @@ int database_over_ranks(int argc, char **argv, int myRank,
     // Grab the filename containing the target text
     filename = argv[2];
 
-    // Get the number of patterns that the user wants to search for
-    nb_patterns = argc - 3;
+    // Every rank received the patterns from main
+    nb_patterns = patterns->nb_patterns;
+    pattern = patterns->pattern;
 
-    // Fill the pattern array
-    pattern = (char **) malloc(nb_patterns * sizeof(char *));
-    if (pattern == NULL) {
-        fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
-                nb_patterns);
+    // With -r every pattern has 2 result slots (see STRAND_LABEL)
+    nb_strands = opts->nb_strands;
+    nb_results = nb_patterns * nb_strands;
+
+    hit_buffer_init(&hits);
+
+    // One histogram of approx_factor + 1 distances per result slot
+    histograms = (int *) calloc(nb_results * (approx_factor + 1), sizeof(int));
+    if (histograms == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                nb_results * (approx_factor + 1) * sizeof(int));
         return 1;
     }
 
-    // I don't parallelize this for with OpenMP since it's already very fast in
-    // sequential programming Grab the patterns from command line
-    for (i = 0; i < nb_patterns; i++) {
-        int l;
+#if DEBUG
+    printf("Rank MPI %d. I read the patterns.\n", myRank);
+#endif
 
-        l = strlen(argv[i + 3]);
-        if (l <= 0) {
-            fprintf(stderr, "Error while parsing argument %d\n", i + 3);
+    // The other strand is searched in the same pass. The reverse
+    // complements are laid out like the patterns, in a single arena
+    if (nb_strands == 2) {
+        pattern_rc = (char **) malloc(nb_patterns * sizeof(char *));
+        rc_arena = (char *) malloc(patterns->arena_size * sizeof(char));
+        if (pattern_rc == NULL || rc_arena == NULL) {
+            fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
+                    nb_patterns);
             return 1;
         }
+        for (i = 0; i < nb_patterns; i++) {
+            pattern_rc[i] = &rc_arena[patterns->offsets[i]];
+            reverse_complement(pattern[i], PATTERN_LENGTH(patterns, i),
+                               pattern_rc[i]);
+        }
+    }
 
-        pattern[i] = (char *) malloc((l + 1) * sizeof(char));
-        if (pattern[i] == NULL) {
-            fprintf(stderr, "Unable to allocate string of size %d\n", l);
+    // The N closest windows of each result slot (in my piece, for the workers)
+    if (opts->top_n > 0) {
+        best = (struct topn *) malloc(nb_results * sizeof(struct topn));
+        if (best == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                    nb_results * sizeof(struct topn));
             return 1;
         }
-
-        strncpy(pattern[i], argv[i + 3], (l + 1));
+        for (i = 0; i < nb_results; i++) {
+            if (topn_init(&best[i], opts->top_n)) {
+                return 1;
+            }
+        }
     }
 
-#if DEBUG
-    printf("Rank MPI %d. I read the patterns.\n", myRank);
-#endif
-
     // I am rank 0
     if (myRank == 0) {
         printf(
@@ -99,17 +169,24 @@ int database_over_ranks(int argc, char **argv, int myRank,
                 "looking for %d pattern(s) in file %s w/ distance of %d\n",
                 nb_patterns, filename, approx_factor);
 
-        // Read the database
-        buf = read_input_file(filename, &n_bytes);
+        // Read the database (resident in server mode)
+        phase_begin(PHASE_LOAD);
+        if (db != NULL) {
+            buf = db->buf;
+            n_bytes = db->n_bytes;
+        } else {
+            buf = read_database(filename, &n_bytes);
+        }
+        phase_end(PHASE_LOAD);
         if (buf == NULL) {
             return 1;
         }
 
         // Allocate the array of matches
-        n_matches = (int *) malloc(nb_patterns * sizeof(int));
+        n_matches = (int *) malloc(nb_results * sizeof(int));
         if (n_matches == NULL) {
             fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
-                    nb_patterns * sizeof(int));
+                    nb_results * sizeof(int));
             return 1;
         }
 
@@ -138,6 +215,7 @@ int database_over_ranks(int argc, char **argv, int myRank,
 #endif
 
         // Rank 0 send to other ranks the index and end of their own pieces.
+        phase_begin(PHASE_DISTRIBUTE);
         for (j = 1; j < numberProcesses; j++) {
             int indexStartMyPiece, indexFinishMyPieceWithoutExtra;
 
@@ -164,35 +242,81 @@ int database_over_ranks(int argc, char **argv, int myRank,
             printf("Rank 0. I sent to the rank %d the info.\n", j);
 #endif
         }
+        phase_end(PHASE_DISTRIBUTE);
 
         // Initialize the number of matches to 0
-        for (i = 0; i < nb_patterns; i++) {
+        for (i = 0; i < nb_results; i++) {
             n_matches[i] = 0;
         }
 
-        // Check each pattern one by one
-        for (i = 0; i < nb_patterns; i++) {
-            // For each pattern I wait the answer from all the ranks involved.
-            for (j = 1; j < numberProcesses; j++) {
-                int numberMatches;
-                MPI_Status status;
-                MPI_Recv(&numberMatches, 1, MPI_INT, MPI_ANY_SOURCE, i,
-                         MPI_COMM_WORLD, &status);
+        // Every rank sends the counts of all the patterns at once
+        int *rankMatches = (int *) malloc(nb_results * sizeof(int));
+        if (rankMatches == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                    nb_results * sizeof(int));
+            return 1;
+        }
+        progress_watch(numberProcesses - 1);
+        for (j = 1; j < numberProcesses; j++) {
+            MPI_Status status;
+            // Waiting for the workers to finish their scan
+            phase_begin(PHASE_WAIT);
+            progress_wait(TAG_COUNTS);
+            MPI_Recv(rankMatches, nb_results, MPI_INT, MPI_ANY_SOURCE,
+                     TAG_COUNTS, MPI_COMM_WORLD, &status);
+            phase_end(PHASE_WAIT);
+            progress_drain(status.MPI_SOURCE);
 
 #if DEBUG
-                printf(
-                    "Rank 0. I have received number of matches of pattern %d "
-                    "from rank %d: %d\n",
-                    i, status.MPI_SOURCE, numberMatches);
+            printf("Rank 0. I have received the number of matches from rank "
+                   "%d\n", status.MPI_SOURCE);
 #endif
 
-                n_matches[i] = n_matches[i] + numberMatches;
+            for (i = 0; i < nb_results; i++) {
+                n_matches[i] += rankMatches[i];
             }
+        }
+        free(rankMatches);
 
-#if DEBUG
-            printf("Rank 0. Research finished for the patterns.\n");
-#endif
+        // Then every rank sends the positions of its matches
+        phase_begin(PHASE_COLLECT);
+        if (opts->hits_file != NULL) {
+            for (j = 1; j < numberProcesses; j++) {
+                if (recv_hits(&hits, j, TAG_HITS)) {
+                    return 1;
+                }
+            }
+        }
+
+        // And its histograms, summed over the ranks
+        if (opts->histogram) {
+            int *rankHistograms =
+                    (int *) malloc(nb_results * (approx_factor + 1) * sizeof(int));
+            if (rankHistograms == NULL) {
+                fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                        nb_results * (approx_factor + 1) * sizeof(int));
+                return 1;
+            }
+            for (j = 1; j < numberProcesses; j++) {
+                MPI_Recv(rankHistograms, nb_results * (approx_factor + 1),
+                         MPI_INT, j, TAG_HISTOGRAMS, MPI_COMM_WORLD,
+                         MPI_STATUS_IGNORE);
+                for (i = 0; i < nb_results * (approx_factor + 1); i++) {
+                    histograms[i] += rankHistograms[i];
+                }
+            }
+            free(rankHistograms);
+        }
+
+        // And its top-N of every pattern
+        if (best != NULL) {
+            for (j = 1; j < numberProcesses; j++) {
+                if (recv_topn(best, nb_results, j, TAG_TOPN)) {
+                    return 1;
+                }
+            }
         }
+        phase_end(PHASE_COLLECT);
 
         /* Timer stop and print it */
         gettimeofday(&t2, NULL);
@@ -202,17 +326,56 @@ int database_over_ranks(int argc, char **argv, int myRank,
                 "per rank: %f s\n\n",
                 myRank, numberProcesses, atoi(getenv("OMP_NUM_THREADS")), duration);
 
+        // With the result cache, main prints the counts and histograms
+        if (opts->results != NULL) {
+            opts->results->nb_results = nb_results;
+            opts->results->counts = n_matches;
+            opts->results->histograms = histograms;
+        }
+
         // Print the results
-        for (i = 0; i < nb_patterns; i++) {
-            printf("Number of matches for pattern <%s>: %d\n", pattern[i],
+        for (i = 0; opts->results == NULL && i < nb_results; i++) {
+            printf("Number of matches for pattern <%s>%s: %d\n",
+                   pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
                    n_matches[i]);
         }
+
+        if (opts->histogram && opts->results == NULL) {
+            for (i = 0; i < nb_results; i++) {
+                print_histogram(pattern[i / nb_strands],
+                                STRAND_LABEL(i, nb_strands),
+                                &histograms[i * (approx_factor + 1)],
+                                approx_factor);
+            }
+        }
+
+        if (best != NULL) {
+            for (i = 0; i < nb_results; i++) {
+                topn_sort(&best[i]);
+                print_topn(pattern[i / nb_strands],
+                           STRAND_LABEL(i, nb_strands), &best[i]);
+            }
+        }
+
+        if (opts->hits_file != NULL) {
+            if (write_hits(opts->hits_file, &hits, nb_results)) {
+                return 1;
+            }
+            hit_buffer_free(&hits);
+        }
     }
 
     // If I am not the rank 0
     else {
-        // Read the database
-        buf = read_input_file(filename, &n_bytes);
+        // Read the database (resident in server mode)
+        phase_begin(PHASE_LOAD);
+        if (db != NULL) {
+            buf = db->buf;
+            n_bytes = db->n_bytes;
+        } else {
+            buf = read_database(filename, &n_bytes);
+        }
+        phase_end(PHASE_LOAD);
         if (buf == NULL) {
             return 1;
         }
@@ -220,8 +383,10 @@ int database_over_ranks(int argc, char **argv, int myRank,
         int info[2];  // 1° element: indexStartMyPiece. 2° element:
         // indexFinishMyPieceWithoutExtra.
         MPI_Status status;
+        phase_begin(PHASE_WAIT);
         MPI_Recv(&info, 2, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
                  &status);
+        phase_end(PHASE_WAIT);
 #if DEBUG
         printf("Rank %d. I received info from rank 0.\n", myRank);
 #endif
@@ -231,9 +396,12 @@ int database_over_ranks(int argc, char **argv, int myRank,
                 info[1];  // Without extra to recognize words between pieces.
 
         // Initialize array where the threads of openMP will store the results.
-        int numbersOfMatch[nb_patterns];
-        for (i = 0; i < nb_patterns; i++) {
-            numbersOfMatch[i] = 0;
+        // (on the heap: there can be many more patterns than fit the stack)
+        int *numbersOfMatch = (int *) calloc(nb_results, sizeof(int));
+        if (numbersOfMatch == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                    nb_results * sizeof(int));
+            return 1;
         }
 
         // Decide if the GPU has to be used.
@@ -241,200 +409,192 @@ int database_over_ranks(int argc, char **argv, int myRank,
         // The execution time with the GPU should be less than the execution time without the GPU.
         // This could be achieved with some profiling.
 
-        int gpuActuallyUsed;
-        if (cuda_device_exists && nb_patterns > 1) { // If there is only 1 pattern, GPU is useless. CPU would take care of the only pattern
-            gpuActuallyUsed = 1;
-        } else {
-            gpuActuallyUsed = 0;
-        }
+        // Exact matching of many patterns: the automaton takes all of them
+        int useAutomaton =
+                use_multi_pattern_engine(approx_factor, nb_patterns, opts);
 
-        int *addressNumbersOfMatchGPU;
-        int lastPatternAnalyzedByGPU;
-        int firstPatternAnalyzedByThreads;
-        if (gpuActuallyUsed) {
-            // Split the patterns through CPU threads and GPU
-            lastPatternAnalyzedByGPU = nb_patterns / 2;
-            // Example: if we have 7 patterns, we tell the GPU to take patterns from 1 to 3, and the threads between 4 and 7 will be spread over the threads.
-            firstPatternAnalyzedByThreads = (nb_patterns / 2);
+        // The accelerator and the threads pull the patterns from the same
+        // queue. If there is only 1 pattern, the accelerator is useless. CPU
+        // would take care of the only pattern
+        int acceleratorUsed = ACCEL_NONE;
+        if (nb_patterns > 1 && !useAutomaton) {
+            acceleratorUsed = accelerator;
+        }
 
+        int firstPatternAnalyzedByThreads = 0;
+        if (acceleratorUsed == ACCEL_CUDA) {
             // Needed to transfer data to the GPU
-            int sizePatterns[nb_patterns];
+            int *sizePatterns = (int *) malloc(nb_patterns * sizeof(int));
+            int *numberOfMatchesInitialized =
+                    (int *) malloc(nb_patterns * sizeof(int));
+            if (sizePatterns == NULL || numberOfMatchesInitialized == NULL) {
+                fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                        2 * nb_patterns * sizeof(int));
+                return 1;
+            }
             for (i = 0; i < nb_patterns; i++) {
-                sizePatterns[i] = strlen(pattern[i]);
+                sizePatterns[i] = PATTERN_LENGTH(patterns, i);
             }
 
             // I initialize the array of the GPU here. This could have been done also in database_over_ranks.cu
-            int numberOfMatchesInitialized[nb_patterns];
             for (i = 0; i < nb_patterns; i++) {
                 numberOfMatchesInitialized[i] = 0;
             }
 
-            // Setup the GPU and execute kernel code
-            initializeGPU(buf, n_bytes, pattern, nb_patterns,
-                          lastPatternAnalyzedByGPU, sizePatterns,
-                          indexFinishMyPieceWithoutExtra,
-                          myRank,
-                          numberProcesses,
-                          indexStartMyPiece,
-                          approx_factor, numberOfMatchesInitialized);
+            // Copy the database and the patterns to the GPU, once for all its
+            // chunks
+            phase_begin(PHASE_GPU);
+            initializeGPU(buf, n_bytes, pattern, nb_patterns, sizePatterns,
+                          numberOfMatchesInitialized);
+            phase_end(PHASE_GPU);
+            free(sizePatterns);
+            free(numberOfMatchesInitialized);
 #if DEBUGGPU
             // Print the info just one time.
             printf("Using the GPU.\n");
-            printf("GPU will look for patterns from 1 to %d.\n", lastPatternAnalyzedByGPU);
-            printf("Other Threads will look for patterns from %d to %d.\n", firstPatternAnalyzedByThreads + 1,
-                   nb_patterns);
-
 #endif
 
         }
 
-        // The implementation is correct. However, I don't notice the improvements of performance that I was expecting.
-#pragma omp parallel default(none) private(i)                                \
-    firstprivate(indexFinishMyPieceWithoutExtra, indexStartMyPiece, n_bytes, \
-                 approx_factor, nb_patterns, numberProcesses, myRank, addressNumbersOfMatchGPU, lastPatternAnalyzedByGPU, firstPatternAnalyzedByThreads)        \
-        shared(buf, pattern, stderr, ompi_mpi_comm_world, ompi_mpi_int, \
-               numbersOfMatch, cuda_device_exists, gpuActuallyUsed)
-        {
-
-            // I have the GPU and I use it
-            if (gpuActuallyUsed) {
-
-#if DEBUGGPU
-#pragma omp single
-                printf("Using GPU.");
-#endif
-
-#pragma omp for schedule(static)
-
-                // Since the GPU analyzes the first part of patterns, the threads analyze the second half of the patterns
-                for (i = firstPatternAnalyzedByThreads; i < nb_patterns; i++) {
-                    double timestampStart;
-                    double timestampFinish;
-
-#if DEBUG
-                    printf(
-                    "----- MPI %d (out of %d) & OpenMP %d (out of %d). Started "
-                    "to analize pattern n° %d.\n",
-                    myRank, numberProcesses, omp_get_thread_num(),
-                    omp_get_num_threads(), i);
-#endif
-
-                    int size_pattern = strlen(pattern[i]);
-                    int *column;
-
-                    column = (int *) malloc((size_pattern + 1) * sizeof(int));
-                    if (column == NULL) {
-                        fprintf(
-                                stderr,
-                                "Error: unable to allocate memory for column (%ldB)\n",
-                                (size_pattern + 1) * sizeof(int));
-                        // return 1;
-                    }
+        // Windows owned by this rank: [indexStartMyPiece, indexEndMyWindows).
+        // Every rank holds the whole database, so a window starting near the
+        // end of my piece simply reads the extra characters from the next
+        // piece: this way I don't miss words which are placed between two
+        // pieces, and the windows of the next piece are not counted twice.
+        int indexEndMyWindows = indexFinishMyPieceWithoutExtra;
+        if (indexEndMyWindows > n_bytes - approx_factor) {
+            indexEndMyWindows = n_bytes - approx_factor;
+        }
 
-                    // If I am not the last rank I should take in consideration
-                    // extra characters from the next piece: in this way I don't
-                    // miss words which are placed between two pieces. If am the
-                    // last rank I don't take extra characters as the other ranks
-                    // since the file is finished.
-                    int indexFinishMyPieceWithExtra =
-                            indexFinishMyPieceWithoutExtra;
-                    if (myRank != numberProcesses - 1) {
-                        indexFinishMyPieceWithExtra += size_pattern - 1;
-                    }
+        // Every pattern is compared with every window of my piece (-p)
+        long long windowsPerPattern = indexEndMyWindows > indexStartMyPiece
+                                          ? indexEndMyWindows - indexStartMyPiece
+                                          : 0;
+        progress_begin(nb_patterns * windowsPerPattern);
+
+        // With the automaton, all the patterns are searched in one pass over
+        // my piece (the threads split the piece instead of the patterns)
+        phase_begin(PHASE_SCAN);
+        if (useAutomaton) {
+            if (ac_search(patterns, NULL, nb_patterns, nb_strands, buf,
+                          n_bytes, indexStartMyPiece, indexEndMyWindows,
+                          numbersOfMatch,
+                          opts->hits_file != NULL ? &hits : NULL)) {
+                return 1;
+            }
+            for (i = 0; i < nb_results; i++) {
+                histograms[i] = numbersOfMatch[i];
+            }
+            firstPatternAnalyzedByThreads = nb_patterns;
+            progress_add(nb_patterns * windowsPerPattern);
+        }
 
 #if DEBUG
-                    printf(
-                    "Rank %d. I received the info from rank 0. Start index: "
-                    "%d. Finish index: %d\n",
-                    myRank, indexStartMyPiece, indexFinishMyPieceWithoutExtra);
-                printf("Rank %d. Final index updated: %d.\n", myRank,
-                       indexFinishMyPieceWithExtra);
+        printf(
+            "Rank %d. I received the info from rank 0. Start index: "
+            "%d. Finish index: %d. Last window: %d\n",
+            myRank, indexStartMyPiece, indexFinishMyPieceWithoutExtra,
+            indexEndMyWindows);
 #endif
 
 #if DEBUGPIECEREAD
-                    printf("Rank %d: I will read the following text:\n", myRank);
-                int j;
-                for (j = indexStartMyPiece;
-                     j < indexFinishMyPieceWithExtra - approx_factor; j++) {
-                    printf("%c", buf[j]);
-                }
-                printf("\n");
-#endif
-
-                    // Traverse the input data up to the end of the file
-                    n_bytes = indexFinishMyPieceWithExtra;
-
-#if DEBUG
-                    printf(
-                    "----- MPI %d (out of %d) & OpenMP %d (out of %d). Index "
-                    "Start: %d. Index finish: %d.\n",
-                    myRank, numberProcesses, omp_get_thread_num(),
-                    omp_get_num_threads(), indexStartMyPiece, n_bytes);
-#endif
-
-                    timestampStart = omp_get_wtime();
-
-                    // It's not possible to parallelize with OpenMP this for since
-                    // the cycles are interconnected.
-                    int r;
-                    for (r = indexStartMyPiece; r < n_bytes - approx_factor; r++) {
-#if DEBUGBYTEOPENMP
-                        printf(
-                        "MPI %d (out of %d) & OpenMP %d (out of %d). I am "
-                        "analyzing byte %d for pattern %d\n",
-                        myRank, numberProcesses, omp_get_thread_num(),
-                        omp_get_num_threads(), r, i);
-
-#endif
-
-#if DEBUGCHARACTERS
-                        printf("Rank %d. I read the character: %c \n", myRank,
-                           buf[j]);
+        printf("Rank %d: I will read the following text:\n", myRank);
+        for (j = indexStartMyPiece; j < indexEndMyWindows; j++) {
+            printf("%c", buf[j]);
+        }
+        printf("\n");
 #endif
 
-                        int distance = 0;
-                        int size;
-                        size = size_pattern;
-                        if (n_bytes - r < size_pattern) {
-                            size = n_bytes - r;
-                        }
+        // When the threads run on several NUMA nodes, each node reads its
+        // own copy of my piece (the threads all read the whole piece)
+        struct numa_replicas replicas;
+        int indexEndMyPiece = indexEndMyWindows + max_pattern_length(patterns);
+        if (indexEndMyPiece > n_bytes) {
+            indexEndMyPiece = n_bytes;
+        }
+        if (firstPatternAnalyzedByThreads < nb_patterns &&
+            indexEndMyPiece > indexStartMyPiece) {
+            if (numa_replicate(&replicas, buf, n_bytes, indexStartMyPiece,
+                               indexEndMyPiece)) {
+                return 1;
+            }
+        } else {
+            replicas.nb_threads = 0;
+            replicas.thread_buf = NULL;
+            replicas.copies = NULL;
+        }
 
-#if DEBUGOPENMPPOINTERS
-                        printf(
-                        "Pattern: %p. Buf: %p. Size: %p. Columns: %p.\ni "
-                        "address: %p. i value: %d. j address: %p. j value: %d "
-                        "\n",
-                        &pattern, &buf[j], &size, &column, &i, i, &j, j);
-#endif
-                        distance = levenshtein(pattern[i], &buf[r], size, column);
+        // The columns of every thread, for all the patterns
+        struct scratch_pool scratch;
+        if (scratch_pool_init(&scratch, max_pattern_length(patterns),
+                              nb_strands)) {
+            return 1;
+        }
 
-                        if (distance <= approx_factor) {
-                            numbersOfMatch[i] += 1;
+        // The patterns left to the threads, and to the accelerator if any:
+        // its share follows its speed (static split without one)
+        struct chunk_queue queue;
+        if (chunk_queue_init(&queue, omp_get_max_threads())) {
+            return 1;
+        }
+        chunk_queue_reset(&queue, firstPatternAnalyzedByThreads, nb_patterns,
+                          acceleratorUsed != ACCEL_NONE);
 
-#if DEBUG
-                            printf("Rank %d. MATCH FOUND! \n", myRank);
-#endif
-                        }
-                    }
-                    timestampFinish = omp_get_wtime();
+        // The implementation is correct. However, I don't notice the improvements of performance that I was expecting.
+#pragma omp parallel default(none) private(i, s)                             \
+    firstprivate(indexEndMyWindows, indexStartMyPiece, n_bytes,              \
+                 approx_factor, nb_patterns, nb_strands, numberProcesses,    \
+                 myRank, indexFinishMyPieceWithoutExtra, opts, patterns)     \
+        shared(buf, pattern, pattern_rc, stderr, numbersOfMatch,           \
+               histograms, acceleratorUsed, hits, best, scratch, replicas,  \
+               queue, windowsPerPattern)
+        {
+            double region_start = omp_get_wtime();
+            int t = omp_get_thread_num();
+            int accelerating = acceleratorUsed != ACCEL_NONE && t == 0;
+            long long first, count;
 
-#if DEBUG
-                    double elapsedTime = timestampFinish - timestampStart;
-                printf("Time elapsed for a thread: %g.\n", elapsedTime);
-#endif
-                    free(column);
-                }
+            // Each thread buffers its own positions, merged below
+            struct hit_buffer my_hits;
+            hit_buffer_init(&my_hits);
 
-            } else { // I have only the CPU.
+            // The copy of the database on my NUMA node
+            char *my_piece = replicas.thread_buf != NULL
+                                 ? replicas.thread_buf[omp_get_thread_num()]
+                                 : buf;
 
 #if DEBUGGPU
 #pragma omp single
-                printf("Not using GPU.\n");
+            printf(acceleratorUsed == ACCEL_CUDA ? "Using GPU.\n"
+                                                 : "Not using GPU.\n");
 #endif
 
-#pragma omp for schedule(static)
-                // If I don't have the GPU I have to search for all the patterns.
-                for (i = 0; i < nb_patterns; i++) {
+            // If there is an accelerator, thread 0 feeds it chunks of
+            // patterns, and the other threads analyze the rest
+            while ((count = chunk_queue_pull(
+                        &queue, t, accelerating ? ACCEL_CHUNK_PATTERNS : 1,
+                        nb_patterns, &first)) > 0) {
+                double chunkStart = omp_get_wtime();
+                double chunkFinish;
+
+                if (accelerating) {
+                    accelerate(acceleratorUsed, my_piece, n_bytes, pattern,
+                               patterns, first, first + count,
+                               indexStartMyPiece, indexEndMyWindows,
+                               indexFinishMyPieceWithoutExtra, myRank,
+                               numberProcesses, approx_factor,
+                               scratch_get(&scratch, t)->column,
+                               numbersOfMatch);
+                    progress_add(count * windowsPerPattern);
+                    chunkFinish = omp_get_wtime();
+                    chunk_queue_done(&queue, t, count,
+                                     chunkFinish - chunkStart);
+                    trace_record_chunk(chunkStart, chunkFinish, -1, first,
+                                       count);
+                    continue;
+                }
+
+                for (i = first; i < first + count; i++) {
                     double timestampStart;
                     double timestampFinish;
 
@@ -446,81 +606,45 @@ int database_over_ranks(int argc, char **argv, int myRank,
                         omp_get_num_threads(), i);
 #endif
 
-                    int size_pattern = strlen(pattern[i]);
-                    int *column;
+                    int size_pattern = PATTERN_LENGTH(patterns, i);
 
-                    column = (int *) malloc((size_pattern + 1) * sizeof(int));
-                    if (column == NULL) {
-                        fprintf(
-                                stderr,
-                                "Error: unable to allocate memory for column (%ldB)\n",
-                                (size_pattern + 1) * sizeof(int));
-                        // return 1;
-                    }
+                    // One column per strand, sized for the longest pattern
+                    int *column = scratch_get(&scratch, omp_get_thread_num())->column;
 
-                    // If I am not the last rank I should take in consideration
-                    // extra characters from the next piece: in this way I don't
-                    // miss words which are placed between two pieces. If am the
-                    // last rank I don't take extra characters as the other ranks
-                    // since the file is finished.
-                    int indexFinishMyPieceWithExtra =
-                            indexFinishMyPieceWithoutExtra;
-                    if (myRank != numberProcesses - 1) {
-                        indexFinishMyPieceWithExtra += size_pattern - 1;
-                    }
+                    // The kernels of the length class of the pattern
+                    struct levenshtein_kernels kernels;
+                    levenshtein_select(size_pattern, &kernels);
 
-#if DEBUG
-                    printf(
-                        "Rank %d. I received the info from rank 0. Start index: "
-                        "%d. Finish index: %d\n",
-                        myRank, indexStartMyPiece, indexFinishMyPieceWithoutExtra);
-                    printf("Rank %d. Final index updated: %d.\n", myRank,
-                           indexFinishMyPieceWithExtra);
-#endif
-
-#if DEBUGPIECEREAD
-                    printf("Rank %d: I will read the following text:\n", myRank);
-                    int j;
-                    for (j = indexStartMyPiece;
-                         j < indexFinishMyPieceWithExtra - approx_factor; j++) {
-                        printf("%c", buf[j]);
-                    }
-                    printf("\n");
-#endif
-
-                    // Traverse the input data up to the end of the file
-                    n_bytes = indexFinishMyPieceWithExtra;
-
-#if DEBUG
-                    printf(
-                        "----- MPI %d (out of %d) & OpenMP %d (out of %d). Index "
-                        "Start: %d. Index finish: %d.\n",
-                        myRank, numberProcesses, omp_get_thread_num(),
-                        omp_get_num_threads(), indexStartMyPiece, n_bytes);
-#endif
+                    // With -s, the distances of a batch of windows at once
+                    struct hamming_batch batch;
+                    hamming_batch_init(&batch);
 
                     timestampStart = omp_get_wtime();
+                    int nb_windows = 0;
 
                     // It's not possible to parallelize with OpenMP this for since
                     // the cycles are interconnected.
                     int r;
-                    for (r = indexStartMyPiece; r < n_bytes - approx_factor; r++) {
+                    for (r = indexStartMyPiece; r < indexEndMyWindows; r++) {
 #if DEBUGBYTEOPENMP
                         printf(
                             "MPI %d (out of %d) & OpenMP %d (out of %d). I am "
                             "analyzing byte %d for pattern %d\n",
                             myRank, numberProcesses, omp_get_thread_num(),
                             omp_get_num_threads(), r, i);
-
 #endif
 
 #if DEBUGCHARACTERS
                         printf("Rank %d. I read the character: %c \n", myRank,
-                               buf[j]);
+                               my_piece[r]);
 #endif
 
                         int distance = 0;
+                        int distances[2];
                         int size;
+
+                        progress_tick(&nb_windows);
+
                         size = size_pattern;
                         if (n_bytes - r < size_pattern) {
                             size = n_bytes - r;
@@ -529,53 +653,160 @@ int database_over_ranks(int argc, char **argv, int myRank,
 #if DEBUGOPENMPPOINTERS
                         printf(
                             "Pattern: %p. Buf: %p. Size: %p. Columns: %p.\ni "
-                            "address: %p. i value: %d. j address: %p. j value: %d "
+                            "address: %p. i value: %d. r address: %p. r value: %d "
                             "\n",
-                            &pattern, &buf[j], &size, &column, &i, i, &j, j);
+                            &pattern, &my_piece[r], &size, &column, &i, i, &r, r);
 #endif
-                        distance = levenshtein(pattern[i], &buf[r], size, column);
+                        if (opts->hamming) {
+                            int bound = approx_factor;
+                            if (best != NULL) {
+                                bound = topn_window_bound(&best[i * nb_strands],
+                                                          nb_strands, size_pattern,
+                                                          approx_factor);
+                            }
+                            hamming_batch_get(&batch, pattern[i],
+                                              nb_strands == 2 ? pattern_rc[i]
+                                                              : NULL,
+                                              size_pattern, my_piece, n_bytes, r,
+                                              indexEndMyWindows, bound, distances);
+                        } else if (nb_strands == 2 || best != NULL) {
+                            // Stop computing as soon as the window can neither
+                            // match nor enter the top-N
+                            int bound = approx_factor;
+                            if (best != NULL) {
+                                bound = topn_window_bound(&best[i * nb_strands],
+                                                          nb_strands, size_pattern,
+                                                          approx_factor);
+                            }
+                            if (nb_strands == 2) {
+                                kernels.strands(pattern[i], pattern_rc[i],
+                                                &my_piece[r], size, column, bound,
+                                                distances);
+                            } else {
+                                distances[0] = kernels.bounded(
+                                        pattern[i], &my_piece[r], size, column, bound);
+                            }
+                        } else {
+                            distances[0] = kernels.distance(pattern[i], &my_piece[r], size, column);
+                        }
+
+                        for (s = 0; s < nb_strands; s++) {
+                            int slot = i * nb_strands + s;
 
-                        if (distance <= approx_factor) {
-                            numbersOfMatch[i] += 1;
+                            distance = distances[s];
+                            if (best != NULL) {
+                                topn_add(&best[slot], distance, r);
+                            }
+
+                            if (distance <= approx_factor) {
+                                numbersOfMatch[slot] += 1;
+                                histograms[slot * (approx_factor + 1) + distance]++;
+                                if (opts->hits_file != NULL) {
+                                    hit_buffer_add(&my_hits, slot, r, distance);
+                                }
 
 #if DEBUG
-                            printf("Rank %d. MATCH FOUND! \n", myRank);
+                                printf("Rank %d. MATCH FOUND! \n", myRank);
 #endif
+                            }
                         }
                     }
                     timestampFinish = omp_get_wtime();
+                    progress_add(nb_windows);
+                    trace_record(TRACE_PATTERN, timestampStart, timestampFinish, i);
 
 #if DEBUG
                     double elapsedTime = timestampFinish - timestampStart;
                     printf("Time elapsed for a thread: %g.\n", elapsedTime);
 #endif
-                    free(column);
                 }
+                chunkFinish = omp_get_wtime();
+                chunk_queue_done(&queue, t, count, chunkFinish - chunkStart);
+                trace_record_chunk(chunkStart, chunkFinish, -1, first, count);
             }
+            phase_thread_done(region_start);
+
+#pragma omp critical
+            hit_buffer_append(&hits, &my_hits);
 
+            hit_buffer_free(&my_hits);
         }
+        phases_region_end();
+        phase_end(PHASE_SCAN);
 
-        if (gpuActuallyUsed) {
+        if (acceleratorUsed == ACCEL_CUDA) {
 
             // Read GPU results and merging with the original array of results (numbersOfMatch)
+            phase_begin(PHASE_GPU);
             int *numberOfMatchesGPU = getGPUResult(nb_patterns);
+            phase_end(PHASE_GPU);
 #if DEBUGGPU
             printf("Got the results from GPU.\n");
 #endif
-            for (i = 0; i < lastPatternAnalyzedByGPU; i++) {
-                numbersOfMatch[i] = numberOfMatchesGPU[i];
+            // 0 for the patterns of the threads
+            for (i = 0; i < nb_patterns; i++) {
+                numbersOfMatch[i] += numberOfMatchesGPU[i];
             }
+            free(numberOfMatchesGPU);
+        }
+        if (acceleratorUsed != ACCEL_NONE) {
+            chunk_queue_report(&queue, myRank,
+                               acceleratorUsed == ACCEL_CUDA ? "GPU"
+                                                             : "emulated",
+                               "patterns");
         }
 
-        // I send the result of the matches of every pattern to rank 0
-        for (i = 0; i < nb_patterns; i++) {
-            int numberToSend = numbersOfMatch[i];
-            MPI_Send(&numberToSend, 1, MPI_INT, 0, i, MPI_COMM_WORLD);
+        // I send the result of the matches of every pattern to rank 0, in
+        // a single message
+        phase_begin(PHASE_COLLECT);
+        progress_finish();
+        MPI_Send(numbersOfMatch, nb_results, MPI_INT, 0, TAG_COUNTS,
+                 MPI_COMM_WORLD);
 #if DEBUG
-            printf("Rank %d (out of %d). I sent the data of pattern %d\n",
-                   myRank, numberProcesses, i);
+        printf("Rank %d (out of %d). I sent the data of the patterns\n",
+               myRank, numberProcesses);
 #endif
+        free(numbersOfMatch);
+        scratch_pool_free(&scratch);
+        numa_replicas_free(&replicas);
+        chunk_queue_free(&queue);
+
+        // The positions are sent once, after all the counts
+        if (opts->hits_file != NULL) {
+            if (send_hits(&hits, 0, TAG_HITS)) {
+                return 1;
+            }
+            hit_buffer_free(&hits);
+        }
+
+        if (opts->histogram) {
+            MPI_Send(histograms, nb_results * (approx_factor + 1), MPI_INT, 0,
+                     TAG_HISTOGRAMS, MPI_COMM_WORLD);
+        }
+
+        if (best != NULL) {
+            if (send_topn(best, nb_results, 0, TAG_TOPN)) {
+                return 1;
+            }
         }
+        phase_end(PHASE_COLLECT);
+    }
+
+    // Nothing outlives the run: the server runs one per query
+    if (myRank != 0 || opts->results == NULL) {
+        free(n_matches);
+        free(histograms);
+    }
+    if (best != NULL) {
+        for (i = 0; i < nb_results; i++) {
+            topn_free(&best[i]);
+        }
+        free(best);
+    }
+    free(pattern_rc);
+    free(rc_arena);
+    if (db == NULL) {
+        free_huge(buf);
     }
     return 0;
 }
\ No newline at end of file
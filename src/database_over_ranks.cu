@@ -15,18 +15,29 @@
 #define MIN3(a, b, c) \
     ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
+// One device thread per pattern: a launch searches up to
+// SIZE_GRID * SIZE_BLOCKS patterns
+#define SIZE_GRID 256
+#define SIZE_BLOCKS 10
+
+// Uploaded once by initializeGPU(), for all the chunks of patterns
 int *d_numbersOfMatch;
+int *d_columns;
+int *d_sizePatterns;
+char *d_buf;
+char **d_pattern;
+int columnSize;
 
 __global__ void
-searchPattern(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastPatternAnalyzedByGPU, int *sizePatterns,
-              int *numbersOfMatch, int indexFinishMyPieceWithoutExtra, int myRank, int numberProcesses,
-              int indexStartMyPiece, int approx_factor) {
+searchPattern(char *buf, int n_bytes, char **pattern, int nb_patterns, int firstPattern, int lastPattern,
+              int *sizePatterns, int *numbersOfMatch, int indexFinishMyPieceWithoutExtra, int myRank,
+              int numberProcesses, int indexStartMyPiece, int approx_factor, int *columns, int columnSize) {
 
     int i;
-    i = blockIdx.x * blockDim.x + threadIdx.x;
+    i = firstPattern + blockIdx.x * blockDim.x + threadIdx.x;
 
-    // I analyze the second half of the patterns
-    if (i < lastPatternAnalyzedByGPU) {
+    // I analyze the patterns of my chunk
+    if (i < lastPattern) {
 
         if (TESTPERFORMANCE_NO_LEVENSHTEIN) {
             /*
@@ -62,32 +73,19 @@ searchPattern(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastP
 
             int sizeActualPattern = sizePatterns[i];
 
-            int *column;
-            column = (int *) malloc((sizeActualPattern + 1) * sizeof(int));
-            if (column == NULL) {
-                /*fprintf(
-                        stderr,
-                        "Error: unable to allocate memory for column (%ldB)\n",
-                        (size_pattern + 1) * sizeof(int));
-                // return 1;*/
-            }
+            // My column, allocated with the others before the launch
+            int *column = &columns[(i - firstPattern) * columnSize];
 
-            // If I am not the last rank I should take in consideration
-            // extra characters from the next piece: in this way I don't
-            // miss words which are placed between two pieces. If am the
-            // last rank I don't take extra characters as the other ranks
-            // since the file is finished.
-            int indexFinishMyPieceWithExtra =
-                    indexFinishMyPieceWithoutExtra;
-            if (myRank != numberProcesses - 1) {
-                indexFinishMyPieceWithExtra += sizeActualPattern - 1;
+            // Same windows as the CPU threads: the ones starting in my piece.
+            // The whole database is on the device, so windows near the end
+            // of my piece read the extra characters from the next piece.
+            int indexEndMyWindows = indexFinishMyPieceWithoutExtra;
+            if (indexEndMyWindows > n_bytes - approx_factor) {
+                indexEndMyWindows = n_bytes - approx_factor;
             }
 
-            // Traverse the input data up to the end of the file
-            n_bytes = indexFinishMyPieceWithExtra;
-
             int r;
-            for (r = indexStartMyPiece; r < n_bytes - approx_factor; r++) {
+            for (r = indexStartMyPiece; r < indexEndMyWindows; r++) {
 
                 int distance = 0;
                 int size;
@@ -125,8 +123,6 @@ searchPattern(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastP
 
                 }
             }
-
-            free(column);
         }
 
     }
@@ -134,9 +130,8 @@ searchPattern(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastP
 }
 
 
-extern "C" int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patterns, int lastPatternAnalyzedByGPU,
-                             int *sizePatterns, int indexFinishMyPieceWithoutExtra, int myRank, int numberProcesses,
-                             int indexStartMyPiece, int approx_factor, int * numberOfMatchesInitialized) {
+extern "C" int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patterns, int *sizePatterns,
+                             int * numberOfMatchesInitialized) {
 
 #if DEBUG_CUDA
     printf("CUDA_DEBUG. Starting allocating data structures and memory transfers...\n");
@@ -144,12 +139,10 @@ extern "C" int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patt
 
     // I need to know the size of patterns to copy the data.
     // So I copy an array containing all the sizes of the patterns.
-    int *d_sizePatterns;
     cudaMalloc(&d_sizePatterns, nb_patterns * sizeof(int));
     cudaMemcpy(d_sizePatterns, sizePatterns, nb_patterns * sizeof(int), cudaMemcpyHostToDevice);
 
     // Allocate space for the buffer and copy data.
-    char *d_buf;
     cudaMalloc(&d_buf, n_bytes * sizeof(char));
     cudaMemcpy(d_buf, buf, n_bytes * sizeof(char), cudaMemcpyHostToDevice);
 
@@ -159,7 +152,6 @@ extern "C" int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patt
 
     // Allocate array of patterns: that is an array of arrays.
     // Need to use cudaMallocHost otherwise the following malloc throws a Segmentation Fault
-    char **d_pattern;
     cudaMallocHost(&d_pattern, nb_patterns * sizeof(char *));
 
     // Allocate space for each pattern and copy it
@@ -168,27 +160,46 @@ extern "C" int initializeGPU(char *buf, int n_bytes, char **pattern, int nb_patt
         cudaMemcpy(d_pattern[i], pattern[i], sizePatterns[i] * sizeof(char), cudaMemcpyHostToDevice);
     }
 
-    int sizeGrid = 256;
-    int sizeBlocks = 10;
+    // One column per device thread, sized for the longest pattern, instead
+    // of a malloc in each of them
+    columnSize = 1;
+    for (int i = 0; i < nb_patterns; i++) {
+        if (sizePatterns[i] + 1 > columnSize) {
+            columnSize = sizePatterns[i] + 1;
+        }
+    }
+    cudaMalloc(&d_columns, SIZE_GRID * SIZE_BLOCKS * columnSize * sizeof(int));
+
+    return 1;
+
+}
+
+// Searches the patterns [firstPattern, lastPattern) in my piece, and waits
+// for the kernels: the chunk of the GPU in the queue of the patterns
+extern "C" void searchPatternsGPU(int n_bytes, int nb_patterns, int firstPattern, int lastPattern,
+                                  int indexFinishMyPieceWithoutExtra, int myRank, int numberProcesses,
+                                  int indexStartMyPiece, int approx_factor) {
+
+    int first;
 
 #if DEBUG_CUDA
     printf("CUDA_DEBUG. Going to call the kernel code\n");
 #endif
 
-    searchPattern<<<sizeGrid, sizeBlocks>>>(d_buf, n_bytes, d_pattern, nb_patterns, lastPatternAnalyzedByGPU,
-                                            d_sizePatterns, d_numbersOfMatch, indexFinishMyPieceWithoutExtra, myRank,
-                                            numberProcesses, indexStartMyPiece, approx_factor);
+    for (first = firstPattern; first < lastPattern; first += SIZE_GRID * SIZE_BLOCKS) {
+        int last = first + SIZE_GRID * SIZE_BLOCKS < lastPattern ? first + SIZE_GRID * SIZE_BLOCKS : lastPattern;
 
-#if DEBUG_CUDA
-    printf("CUDA_DEBUG. Kernel code returned.\n");
-#endif
+        searchPattern<<<SIZE_GRID, SIZE_BLOCKS>>>(d_buf, n_bytes, d_pattern, nb_patterns, first, last,
+                                                d_sizePatterns, d_numbersOfMatch, indexFinishMyPieceWithoutExtra,
+                                                myRank, numberProcesses, indexStartMyPiece, approx_factor,
+                                                d_columns, columnSize);
+    }
+    cudaDeviceSynchronize();
 
 #if DEBUG_CUDA
-    printf("CUDA_DEBUG. Copied results of CUDA.\n");
+    printf("CUDA_DEBUG. Kernel code returned.\n");
 #endif
 
-    return 1;
-
 }
 
 extern "C" int *
@@ -200,6 +211,9 @@ getGPUResult(int nb_patterns) {
     // Copy the results from the GPU
     cudaMemcpy(numbersOfMatch, d_numbersOfMatch, nb_patterns * sizeof(int),
                cudaMemcpyDeviceToHost);
+    cudaFree(d_columns);
+    cudaFree(d_buf);
+    cudaFree(d_sizePatterns);
 
     return numbersOfMatch;
 }
\ No newline at end of file
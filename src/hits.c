@@ -0,0 +1,160 @@
+#include "hits.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HITS_MAGIC "APMHITS1"
+#define HITS_OUT_BUF_SIZE (1 << 20)
+
+void hit_buffer_init(struct hit_buffer *b) {
+    b->hits = NULL;
+    b->count = 0;
+    b->capacity = 0;
+    b->dropped = 0;
+}
+
+void hit_buffer_free(struct hit_buffer *b) {
+    free(b->hits);
+    hit_buffer_init(b);
+}
+
+int hit_buffer_reserve(struct hit_buffer *b, int capacity) {
+    struct hit *hits;
+
+    if (capacity <= b->capacity) {
+        return 0;
+    }
+
+    hits = (struct hit *)realloc(b->hits, capacity * sizeof(struct hit));
+    if (hits == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %d hits\n",
+                capacity);
+        return 1;
+    }
+
+    b->hits = hits;
+    b->capacity = capacity;
+    return 0;
+}
+
+int hit_buffer_append(struct hit_buffer *dst, struct hit_buffer *src) {
+    dst->dropped += src->dropped;
+    if (src->count == 0) {
+        return 0;
+    }
+    if (hit_buffer_reserve(dst, dst->count + src->count)) {
+        dst->dropped += src->count;
+        return 1;
+    }
+    memcpy(&dst->hits[dst->count], src->hits, src->count * sizeof(struct hit));
+    dst->count += src->count;
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    int x = ((const struct hit *)a)->offset;
+    int y = ((const struct hit *)b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+/* Buffered varint output: flushed with a single fwrite per MiB */
+struct hits_writer {
+    FILE *f;
+    unsigned char *buf;
+    int used;
+};
+
+static void put_varint(struct hits_writer *w, uint32_t value) {
+    if (w->used > HITS_OUT_BUF_SIZE - 5) {
+        fwrite(w->buf, 1, w->used, w->f);
+        w->used = 0;
+    }
+    while (value >= 0x80) {
+        w->buf[w->used++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    w->buf[w->used++] = (unsigned char)value;
+}
+
+int write_hits(char *filename, struct hit_buffer *b, int nb_patterns) {
+    struct hits_writer w;
+    struct hit *sorted;
+    int *first;
+    int i, p;
+
+    /* Group the hits by pattern (stable counting sort): threads and ranks
+     * appended them in whatever order they finished */
+    first = (int *)calloc(nb_patterns + 1, sizeof(int));
+    sorted = (struct hit *)malloc((b->count + 1) * sizeof(struct hit));
+    w.buf = (unsigned char *)malloc(HITS_OUT_BUF_SIZE);
+    if (first == NULL || sorted == NULL || w.buf == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory to sort %d hits\n",
+                b->count);
+        return 1;
+    }
+
+    for (i = 0; i < b->count; i++) {
+        first[b->hits[i].pattern + 1]++;
+    }
+    for (p = 0; p < nb_patterns; p++) {
+        first[p + 1] += first[p];
+    }
+    for (i = 0; i < b->count; i++) {
+        sorted[first[b->hits[i].pattern]++] = b->hits[i];
+    }
+    // first[p] now points past pattern p: shift back
+    for (p = nb_patterns; p > 0; p--) {
+        first[p] = first[p - 1];
+    }
+    first[0] = 0;
+
+    w.f = fopen(filename, "wb");
+    if (w.f == NULL) {
+        fprintf(stderr, "Unable to open the hits file <%s>\n", filename);
+        return 1;
+    }
+    w.used = 0;
+
+    fwrite(HITS_MAGIC, 1, strlen(HITS_MAGIC), w.f);
+    put_varint(&w, nb_patterns);
+
+    for (p = 0; p < nb_patterns; p++) {
+        struct hit *h = &sorted[first[p]];
+        int n = first[p + 1] - first[p];
+        int previous = 0;
+
+        // Per-thread buffers are already in order most of the time
+        for (i = 1; i < n; i++) {
+            if (h[i].offset < h[i - 1].offset) {
+                qsort(h, n, sizeof(struct hit), compare_offsets);
+                break;
+            }
+        }
+
+        put_varint(&w, n);
+        for (i = 0; i < n; i++) {
+            put_varint(&w, h[i].offset - previous);
+            put_varint(&w, h[i].distance);
+            previous = h[i].offset;
+        }
+    }
+
+    fwrite(w.buf, 1, w.used, w.f);
+    if (fclose(w.f) != 0) {
+        fprintf(stderr, "Unable to write the hits file <%s>\n", filename);
+        return 1;
+    }
+
+    if (b->dropped > 0) {
+        fprintf(stderr, "Warning: %d hit(s) could not be stored\n", b->dropped);
+    }
+
+    free(w.buf);
+    free(sorted);
+    free(first);
+
+    return 0;
+}
@@ -9,15 +9,108 @@
 #include <mpi.h>
 #include <omp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "approaches.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "numa.h"
+#include "phases.h"
+#include "progress.h"
+#include "trace.h"
+#include "utils.h"
 
 #define DEBUG_APPROACH_CHOSEN 0
 
 void getDeviceCount(int *deviceCountPtr);
 void setDevice(int rank, int deviceCount);
 
+/* Backends of the search, best first. By default each rank runs the first
+ * one its hardware allows (cuda only in builds with USE_GPU_FLAG, emulate
+ * never), -B name forces one on every rank. The CPU kernels search what the
+ * accelerator does not take, and everything in the modes it lacks
+ * (cpu_only_options()). */
+struct backend {
+    const char *name;
+    const char *description;
+    enum accelerator accelerator;  // next to the threads (approaches.h)
+    enum kernel_set kernels;       // of the CPU (utils.h)
+};
+
+static const struct backend backends[] = {
+    {"cuda", "CUDA kernels, and the avx2 (else simd) CPU kernels",
+     ACCEL_CUDA, KERNELS_AVX2},
+    {"avx2", "length-class kernels, Hamming lanes compiled for AVX2",
+     ACCEL_NONE, KERNELS_AVX2},
+    {"simd", "length-class kernels, Hamming lanes of the build target",
+     ACCEL_NONE, KERNELS_SIMD},
+    {"scalar", "generic kernels, one window at a time", ACCEL_NONE,
+     KERNELS_SCALAR},
+    {"emulate", "simd, with thread 0 on the scalar kernels as the GPU (tests)",
+     ACCEL_SCALAR, KERNELS_SIMD},
+};
+
+#define NB_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+// NULL if this rank can run the backend, else why not
+static const char *backend_unavailable(const struct backend *b,
+                                       int deviceCount) {
+    if (b->accelerator == ACCEL_CUDA) {
+        return deviceCount < 1 ? "no CUDA device, or built with CPU_ONLY=1"
+                               : NULL;
+    }
+    return kernels_supported(b->kernels) ? NULL : "not supported by this CPU";
+}
+
+// The backend named by -B (NULL: the default) on this rank, or NULL with a
+// message if it is unknown or this rank cannot run it
+static const struct backend *select_backend(char *name, int rank,
+                                            int deviceCount) {
+#ifdef USE_GPU_FLAG
+    int USE_GPU = 1;
+#else
+    int USE_GPU = 0;
+#endif
+    const char *why;
+    int i;
+
+    for (i = 0; i < NB_BACKENDS; i++) {
+        why = backend_unavailable(&backends[i], deviceCount);
+        if (name == NULL) {
+            if (why == NULL && backends[i].accelerator != ACCEL_SCALAR &&
+                (USE_GPU || backends[i].accelerator != ACCEL_CUDA)) {
+                return &backends[i];
+            }
+        } else if (!strcmp(name, backends[i].name)) {
+            if (why != NULL) {
+                fprintf(stderr, "Rank %d cannot run the %s backend: %s\n",
+                        rank, name, why);
+                return NULL;
+            }
+            return &backends[i];
+        }
+    }
+    if (rank == 0) {
+        fprintf(stderr, "Unknown backend <%s> (-B list)\n", name);
+    }
+    return NULL;
+}
+
+// -B list: the backends as rank 0 sees them
+static void list_backends(int deviceCount) {
+    const char *why;
+    int i;
+
+    printf("Backends, best first (rank 0):\n");
+    for (i = 0; i < NB_BACKENDS; i++) {
+        why = backend_unavailable(&backends[i], deviceCount);
+        printf("  %-7s %s%s%s%s\n", backends[i].name,
+               backends[i].description, why != NULL ? " (unavailable: " : "",
+               why != NULL ? why : "", why != NULL ? ")" : "");
+    }
+}
+
 float getRatio(float x) {
     while (x < 1) {
         x = x * 2;
@@ -27,19 +120,318 @@ float getRatio(float x) {
     return ratioHardwareOptimizationApproachChosen;
 }
 
+// Cost model: 1 if PATTERNS_OVER_RANKS uses the hardware better than
+// DB_OVER_RANKS for n_patterns
+static int patterns_over_ranks_is_better(int n_patterns, int rank,
+                                         int world_size) {
+    int omp_threads;
+#pragma omp parallel
+    { omp_threads = omp_get_num_threads(); }
+
+    int active_ranks = world_size - 1;
+    float ratioPatterns = getRatio((float)active_ranks / (float)n_patterns);
+    float ratioDatabase = getRatio((float)omp_threads / (float)n_patterns);
+
+#if DEBUG_APPROACH_CHOSEN
+    if (rank == 0) {
+        printf(
+            "jobDimensionPatternsOverRanks = %lf, ratioPatterns = %lf // "
+            "jobDimensionDatabaseOverRanks = %lf, ratioDatabase = %lf\n",
+            (float)active_ranks / (float)n_patterns,
+            (float)omp_threads / (float)n_patterns, ratioPatterns,
+            ratioDatabase);
+    }
+#endif
+
+    // Use Cost Model equations
+    if (fabs(ratioPatterns - ratioDatabase) <= 1E-6) {
+        // Both of the approaches use the hardware at its
+        // maximum capacity, we default to DB-over-ranks approach
+        // (random choice creates unnecessary synchronization challenge -
+        // all ranks should get the same seed)
+        return 0;
+    }
+
+    // We choose the approach that optimizes better the use of
+    // hardware.
+    return ratioPatterns < ratioDatabase;
+}
+
+// The approach chosen, on these patterns
+static int search(int argc, char **argv, struct apm_options *opts, int rank,
+                  int world_size, int accelerator,
+                  struct pattern_set *patterns, struct apm_database *db,
+                  int use_patterns_over_ranks) {
+#if DEBUG_APPROACH_CHOSEN
+    if (rank == 0) {
+        printf("Approach chosen: %s\n",
+               (use_patterns_over_ranks ? "PATTERNS_OVER_RANKS"
+                                        : "DB_OVER_RANKS"));
+    }
+#endif
+    if (use_patterns_over_ranks) {
+        return patterns_over_ranks_hybrid(argc, argv, rank, world_size,
+                                          accelerator, opts, patterns, db);
+    }
+    return database_over_ranks(argc, argv, rank, world_size, accelerator,
+                               opts, patterns, db);
+}
+
+/* -c: the patterns in batches on the database loaded once (checkpoint.h).
+ * Rank 0 picks the patterns of every batch, broadcasts their indices and
+ * saves their results; the others search them. */
+static int search_in_batches(int argc, char **argv, struct apm_options *opts,
+                             int rank, int world_size, int accelerator,
+                             struct pattern_set *patterns,
+                             struct apm_database *db,
+                             int use_patterns_over_ranks) {
+    struct apm_database loaded;
+    struct apm_results *results = opts->results;
+    struct apm_results batch_results;
+    struct pattern_set batch_patterns;
+    struct checkpoint c;
+    int nb_patterns = patterns->nb_patterns;
+    int *batch;
+    char **batch_pattern;
+    int failed = 0, res = 0;
+    int nb = 0, i;
+    double start;
+
+    memset(&c, 0, sizeof(struct checkpoint));
+    if (db == NULL) {
+        if (bcast_database(argv[2], rank, &loaded)) {
+            return 1;
+        }
+        db = &loaded;
+    }
+
+    batch = (int *)malloc((nb_patterns + 1) * sizeof(int));
+    batch_pattern = (char **)malloc((nb_patterns + 1) * sizeof(char *));
+    if (batch == NULL || batch_pattern == NULL) {
+        fprintf(stderr, "Error: unable to allocate the batches\n");
+        failed = 1;
+    } else if (rank == 0) {
+        failed = checkpoint_open(&c, opts->checkpoint, db, patterns, opts,
+                                 atoi(argv[1]), world_size - 1);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        res = 1;
+    }
+
+    while (!failed) {
+        if (rank == 0) {
+            nb = checkpoint_next_batch(&c, batch);
+        }
+        MPI_Bcast(&nb, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (nb == 0) {
+            break;
+        }
+        MPI_Bcast(batch, nb, MPI_INT, 0, MPI_COMM_WORLD);
+
+        for (i = 0; i < nb; i++) {
+            batch_pattern[i] = patterns->pattern[batch[i]];
+        }
+        res = make_patterns(&batch_patterns, nb, batch_pattern, NULL);
+
+        // Rank 0 of the approach stores the results of the batch
+        memset(&batch_results, 0, sizeof(struct apm_results));
+        opts->results = rank == 0 ? &batch_results : NULL;
+        start = MPI_Wtime();
+        if (res == 0) {
+            res = search(argc, argv, opts, rank, world_size, accelerator,
+                         &batch_patterns, db, use_patterns_over_ranks);
+            free_patterns(&batch_patterns);
+        }
+        if (rank == 0 && res == 0) {
+            res = checkpoint_save(&c, batch, nb, &batch_results,
+                                  MPI_Wtime() - start);
+        }
+        free(batch_results.counts);
+        free(batch_results.histograms);
+
+        // Every rank stops at the first error
+        failed = res != 0;
+        MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX,
+                      MPI_COMM_WORLD);
+    }
+    opts->results = results;
+
+    // The results of the file and of this run, printed (or merged with the
+    // result cache)
+    if (rank == 0 && c.file != NULL) {
+        if (!failed && results != NULL) {
+            results->nb_results = nb_patterns * opts->nb_strands;
+            results->counts = c.counts;
+            results->histograms = c.histograms;
+            c.counts = NULL;
+            c.histograms = NULL;
+        } else if (!failed) {
+            checkpoint_print(&c, patterns, atoi(argv[1]));
+        }
+        checkpoint_close(&c);
+    }
+
+    free(batch);
+    free(batch_pattern);
+    if (db == &loaded) {
+        free_huge(loaded.buf);
+    }
+    return failed;
+}
+
+// One search: approximation_factor dna_database patterns... [approach]
+// (options already parsed). db is the resident database of the server mode,
+// NULL to read argv[2].
+int run_query(int argc, char **argv, struct apm_options *opts, int rank,
+              int world_size, int accelerator, struct apm_database *db) {
+    int res;
+
+    // Every phase of this query, on every rank (-P), and its timeline (-T)
+    phases_reset();
+    trace_reset(opts->trace_file);
+    progress_reset(opts->progress, rank, world_size);
+
+    // Check if parallelization approach was explicitly provided (mainly for
+    // debugging) or if it must be computed (real usage)
+    char *chosen_approach = argv[argc - 1];
+    int use_patterns_over_ranks = 0;
+    int approach_provided = 0;
+
+    if (!strcmp(chosen_approach, "DB_OVER_RANKS") ||
+        !strcmp(chosen_approach, "PATTERNS_OVER_RANKS")) {
+        // decrease argc so that processing functions ignore last flag
+        argc -= 1;
+        approach_provided = 1;
+    }
+
+    // Rank 0 reads the patterns (command line and -f file) and broadcasts
+    // them to every rank in bulk
+    struct pattern_set patterns;
+    phase_begin(PHASE_LOAD);
+    if (rank == 0 &&
+        load_patterns(&patterns, argc, argv, opts->pattern_file)) {
+        patterns.nb_patterns = -1;
+    }
+    phase_end(PHASE_LOAD);
+
+    // With a result cache (-C), rank 0 answers the patterns it already knows
+    // and only sends the others to the ranks
+    struct result_cache *cache = NULL;
+    struct cache_query cached;
+    struct apm_results searched_results;
+    struct pattern_set *searched = &patterns;
+    int use_cache = opts->cache_dir != NULL && cacheable_options(opts) &&
+                    argc >= 3;
+    int nothing_to_search = 0;
+
+    if (use_cache && rank == 0 && patterns.nb_patterns > 0) {
+        cache = cache_open(opts->cache_dir, argv[2], db);
+        if (cache != NULL && cache_prepare(cache, &patterns, opts,
+                                           atoi(argv[1]), &cached)) {
+            cache = NULL;
+        }
+        if (cache != NULL) {
+            printf("Result cache: %d of %d pattern(s) already searched\n",
+                   cached.nb_cached, patterns.nb_patterns);
+            searched = &cached.novel;
+            nothing_to_search = cached.novel.nb_patterns == 0;
+        }
+    }
+
+    phase_begin(PHASE_DISTRIBUTE);
+    if (bcast_patterns(searched, rank)) {
+        phase_end(PHASE_DISTRIBUTE);
+        if (cache != NULL) {
+            cache_query_free(&cached);
+        }
+        if (rank == 0) {
+            free_patterns(&patterns);
+        }
+        return 1;
+    }
+    if (use_cache) {
+        MPI_Bcast(&nothing_to_search, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    phase_end(PHASE_DISTRIBUTE);
+    if (cache != NULL) {
+        memset(&searched_results, 0, sizeof(struct apm_results));
+        opts->results = &searched_results;
+    }
+
+    // Positions and histograms are only collected by the CPU kernels
+    int use_accelerator = cpu_only_options(opts) ? ACCEL_NONE : accelerator;
+
+    if (approach_provided) {
+        use_patterns_over_ranks = strcmp(chosen_approach, "DB_OVER_RANKS") != 0;
+    } else if (!nothing_to_search) {
+        // Approach not provided, it must be computed
+        use_patterns_over_ranks =
+            patterns_over_ranks_is_better(searched->nb_patterns, rank,
+                                          world_size);
+    }
+
+    if (nothing_to_search) {
+        res = 0;
+    } else if (opts->checkpoint != NULL) {
+        res = search_in_batches(argc, argv, opts, rank, world_size,
+                                use_accelerator, searched, db,
+                                use_patterns_over_ranks);
+    } else {
+        res = search(argc, argv, opts, rank, world_size, use_accelerator,
+                     searched, db, use_patterns_over_ranks);
+    }
+
+    // Rank 0 merges what the ranks found with the cached results
+    if (cache != NULL) {
+        opts->results = NULL;
+        if (res == 0 &&
+            (nothing_to_search || searched_results.counts != NULL)) {
+            if (!nothing_to_search) {
+                cache_complete(cache, &patterns, opts, atoi(argv[1]), &cached,
+                               &searched_results);
+            }
+            cache_print(&patterns, opts, atoi(argv[1]), &cached);
+        }
+        free(searched_results.counts);
+        free(searched_results.histograms);
+        cache_query_free(&cached);
+    }
+
+    free_patterns(&patterns);
+
+    // Rank 0 gathers the times and events of all the ranks (every rank
+    // takes part)
+    if (opts->phases != NULL) {
+        phases_report(opts->phases, rank, world_size);
+    }
+    if (opts->trace_file != NULL) {
+        trace_write(rank, world_size);
+    }
+
+    if (res != 0) {
+        printf("%s on Rank %d/%d returned with error %d\n\n",
+               (use_patterns_over_ranks ? "PATTERNS_OVER_RANKS"
+                                        : "DB_OVER_PATTERNS"),
+               rank, world_size, res);
+    }
+
+    return res;
+}
+
 int main(int argc, char **argv) {
     int rank, world_size;
     int res;
+    int deviceCount;
     int mpi_call_result;
+    int failed;
+    struct apm_options opts;
+    const struct backend *backend;
 
-#ifdef USE_GPU_FLAG
-    int USE_GPU = 1;
-#else
-    int USE_GPU = 0;
-#endif
-
-    /* MPI Initialization */
-    MPI_Init(&argc, &argv);
+    /* MPI Initialization: only the master thread of a rank calls MPI, also
+     * from within a parallel region (progress reports, -p) */
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
@@ -61,89 +453,65 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Check if parallelization approach was explicitly provided (mainly for
-    // debugging) or if it must be computed (real usage)
-    char *chosen_approach = argv[argc - 1];
-    int use_patterns_over_ranks = 0;
+    if (parse_options(&argc, &argv, &opts)) {
+        if (rank == 0) {
+            print_usage(argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
 
-    int deviceCount;
     getDeviceCount(&deviceCount);
 
-    // This function call returns 0 if there are no CUDA capable devices.
-    setDevice(rank, deviceCount);
+    if (opts.backend != NULL && !strcmp(opts.backend, "list")) {
+        if (rank == 0) {
+            list_backends(deviceCount);
+        }
+        MPI_Finalize();
+        return 0;
+    }
 
-    if (!strcmp(chosen_approach, "DB_OVER_RANKS")) {
-        // decrease argc so that processing functions ignore last flag
-        argc -= 1;
-        res = database_over_ranks(argc, argv, rank, world_size,
-                                  USE_GPU && (deviceCount >= 1));
-    } else if (!strcmp(chosen_approach, "PATTERNS_OVER_RANKS")) {
-        // decrease argc so that processing functions ignore last flag
-        argc -= 1;
-        use_patterns_over_ranks = 1;
-        res = patterns_over_ranks_hybrid(argc, argv, rank, world_size,
-                                         USE_GPU && (deviceCount >= 1));
-    } else {
-        // Approach not provided, it must be computed
-        int n_patterns = argc - 3;
-        int omp_threads;
-#pragma omp parallel
-        { omp_threads = omp_get_num_threads(); }
+    // Every rank picks its backend; the run stops if one of them cannot run
+    // the backend of -B
+    backend = select_backend(opts.backend, rank, deviceCount);
+    failed = backend == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        MPI_Finalize();
+        return 1;
+    }
+    if (backend->accelerator == ACCEL_CUDA) {
+        setDevice(rank, deviceCount);
+    }
+    kernels_use(kernels_supported(backend->kernels) ? backend->kernels
+                                                    : KERNELS_SIMD);
 
-        int active_ranks = world_size - 1;
-        float ratioPatterns = getRatio((float)active_ranks / (float)n_patterns);
-        float ratioDatabase = getRatio((float)omp_threads / (float)n_patterns);
+    // One line when every rank runs the same backend, one per rank otherwise
+    int chosen[2] = {backend - backends, -(backend - backends)};
+    MPI_Allreduce(MPI_IN_PLACE, chosen, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (chosen[0] != -chosen[1]) {
+        fprintf(stderr, "Rank %d backend: %s\n", rank, backend->name);
+    } else if (rank == 0) {
+        fprintf(stderr, "Backend: %s\n", backend->name);
+    }
 
-#if DEBUG_APPROACH_CHOSEN
-        if (rank == 0) {
-            printf(
-                "jobDimensionPatternsOverRanks = %lf, ratioPatterns = %lf // "
-                "jobDimensionDatabaseOverRanks = %lf, ratioDatabase = %lf\n",
-                (float)active_ranks / (float)n_patterns,
-                (float)omp_threads / (float)n_patterns, ratioPatterns,
-                ratioDatabase);
-        }
-#endif
+    // Where the OpenMP threads of every rank run (OMP_PROC_BIND, OMP_PLACES)
+    print_affinity(rank);
 
-        // Use Cost Model equations
-        if (fabs(ratioPatterns - ratioDatabase) <= 1E-6) {
-            // Both of the approaches use the hardware at its
-            // maximum capacity, we default to DB-over-ranks approach
-            // (random choice creates unnecessary synchronization challenge -
-            // all ranks should get the same seed)
-            use_patterns_over_ranks = 0;
-        } else {
-            // We choose the approach that optimizes better the use of
-            // hardware.
-            if (ratioPatterns < ratioDatabase) {
-                use_patterns_over_ranks = 1;
-            } else {
-                use_patterns_over_ranks = 0;
+    if (opts.server_socket != NULL) {
+        // argv[1] is the database: it stays loaded between the queries
+        if (argc != 2) {
+            if (rank == 0) {
+                print_usage(argv[0]);
             }
-        }
-
-#if DEBUG_APPROACH_CHOSEN
-        if (rank == 0) {
-            printf("Approach chosen: %s\n",
-                   (use_patterns_over_ranks ? "PATTERNS_OVER_RANKS"
-                                            : "DB_OVER_RANKS"));
-        }
-#endif
-        // Call the decided strategy
-        if (use_patterns_over_ranks) {
-            res = patterns_over_ranks_hybrid(argc, argv, rank, world_size,
-                                             USE_GPU && (deviceCount >= 1));
+            res = 1;
         } else {
-            res = database_over_ranks(argc, argv, rank, world_size,
-                                      USE_GPU && (deviceCount >= 1));
+            res = serve(&opts, argv[1], rank, world_size,
+                        backend->accelerator);
         }
-    }
-
-    if (res != 0) {
-        printf("%s on Rank %d/%d returned with error %d\n\n",
-               (use_patterns_over_ranks ? "PATTERNS_OVER_RANKS"
-                                        : "DB_OVER_PATTERNS"),
-               rank, world_size, res);
+    } else {
+        res = run_query(argc, argv, &opts, rank, world_size,
+                        backend->accelerator, NULL);
     }
 
     mpi_call_result = MPI_Finalize();
@@ -152,5 +520,5 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    return 0;
+    return res;
 }
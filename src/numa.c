@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NUMA_DEBUG 0
+
+// Room for the CPU and node of every thread
+#define AFFINITY_LINE_SIZE 65536
+
+// CPU and NUMA node the calling thread runs on (0 when unknown)
+static void current_cpu(int *cpu, int *node) {
+    unsigned int c = 0, n = 0;
+
+    if (syscall(SYS_getcpu, &c, &n, NULL) != 0) {
+        c = 0;
+        n = 0;
+    }
+    *cpu = c;
+    *node = n;
+}
+
+static const char *proc_bind_name(omp_proc_bind_t bind) {
+    switch (bind) {
+        case omp_proc_bind_false:
+            return "false";
+        case omp_proc_bind_true:
+            return "true";
+        case omp_proc_bind_master:
+            return "master";
+        case omp_proc_bind_close:
+            return "close";
+        case omp_proc_bind_spread:
+            return "spread";
+        default:
+            return "?";
+    }
+}
+
+void print_affinity(int rank) {
+    int nb_threads = omp_get_max_threads();
+    int *cpus = (int *)malloc(2 * nb_threads * sizeof(int));
+    char *line = (char *)malloc(AFFINITY_LINE_SIZE);
+    char host[256];
+    char *places = getenv("OMP_PLACES");
+    int length, t;
+
+    if (cpus == NULL || line == NULL) {
+        free(cpus);
+        free(line);
+        return;
+    }
+    if (gethostname(host, sizeof(host)) != 0) {
+        strcpy(host, "?");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+#pragma omp parallel num_threads(nb_threads)
+    current_cpu(&cpus[2 * omp_get_thread_num()],
+                &cpus[2 * omp_get_thread_num() + 1]);
+
+    // One line per rank, written at once
+    length = snprintf(line, AFFINITY_LINE_SIZE,
+                      "Rank %d on %s: OMP_PROC_BIND=%s OMP_PLACES=%s, %d "
+                      "thread(s) on cpu(node)",
+                      rank, host, proc_bind_name(omp_get_proc_bind()),
+                      places != NULL ? places : "unset", nb_threads);
+    for (t = 0; t < nb_threads && length < AFFINITY_LINE_SIZE; t++) {
+        length += snprintf(&line[length], AFFINITY_LINE_SIZE - length,
+                           " %d(%d)", cpus[2 * t], cpus[2 * t + 1]);
+    }
+    fprintf(stderr, "%s\n", line);
+
+    free(cpus);
+    free(line);
+}
+
+int numa_replicate(struct numa_replicas *r, char *buf, int n_bytes, int start,
+                   int end) {
+    int *nodes;
+    int t, failed = 0;
+
+    r->nb_threads = omp_get_max_threads();
+    r->nb_copies = 0;
+    r->thread_buf = (char **)malloc(r->nb_threads * sizeof(char *));
+    r->copies = (char **)calloc(r->nb_threads, sizeof(char *));
+    nodes = (int *)malloc(r->nb_threads * sizeof(int));
+    if (r->thread_buf == NULL || r->copies == NULL || nodes == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %d threads\n",
+                r->nb_threads);
+        free(nodes);
+        return 1;
+    }
+    for (t = 0; t < r->nb_threads; t++) {
+        r->thread_buf[t] = buf;
+        nodes[t] = 0;
+    }
+
+    // Unbound threads may move to another node: the copies would not help
+    if (omp_get_proc_bind() == omp_proc_bind_false) {
+        free(nodes);
+        return 0;
+    }
+
+#pragma omp parallel num_threads(r->nb_threads)
+    {
+        int cpu;
+        current_cpu(&cpu, &nodes[omp_get_thread_num()]);
+    }
+    for (t = 1; t < r->nb_threads && nodes[t] == nodes[0]; t++) {
+    }
+    if (t == r->nb_threads) {
+        // A single node: the first-touch placement is enough
+        free(nodes);
+        return 0;
+    }
+
+    /* The first thread of every node copies the piece, the others of the
+     * node read its copy */
+#pragma omp parallel num_threads(r->nb_threads) reduction(| : failed)
+    {
+        int me = omp_get_thread_num();
+        int first = 0;
+
+        while (nodes[first] != nodes[me]) {
+            first++;
+        }
+        if (first == me) {
+            r->copies[me] = (char *)malloc(n_bytes * sizeof(char));
+            if (r->copies[me] == NULL) {
+                failed = 1;
+            } else {
+                memcpy(&r->copies[me][start], &buf[start], end - start);
+            }
+        }
+#pragma omp barrier
+        if (r->copies[first] != NULL) {
+            r->thread_buf[me] = r->copies[first];
+        }
+    }
+    for (t = 0; t < r->nb_threads; t++) {
+        r->nb_copies += r->copies[t] != NULL;
+    }
+
+#if NUMA_DEBUG
+    printf("%d copies of [%d, %d) for %d threads\n", r->nb_copies, start, end,
+           r->nb_threads);
+#endif
+
+    free(nodes);
+    if (failed) {
+        // The threads without a copy read buf
+        fprintf(stderr, "Unable to copy the database on every NUMA node\n");
+    }
+    return 0;
+}
+
+void numa_replicas_free(struct numa_replicas *r) {
+    int t;
+
+    for (t = 0; r->copies != NULL && t < r->nb_threads; t++) {
+        free(r->copies[t]);
+    }
+    free(r->copies);
+    free(r->thread_buf);
+    r->copies = NULL;
+    r->thread_buf = NULL;
+}
@@ -0,0 +1,195 @@
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void print_usage(char *progname) {
+    printf(
+        "Usage: %s [-o hits_file] [-H] [-n N] [-r] [-s] [-f pattern_file] "
+        "[-C cache_dir] [-P table|json] [-T trace_file] [-p seconds] "
+        "[-B backend] [-c checkpoint_file [-i seconds]] "
+        "approximation_factor dna_database [pattern1 pattern2 ...]\n",
+        progname);
+    printf(
+        "   or: %s -S socket_path [-b batch_size] [-w window_ms] "
+        "[-C cache_dir] [-B backend] dna_database (apm_parallel only)\n",
+        progname);
+    printf("  -o hits_file  write (pattern, offset, distance) of every match\n");
+    printf(
+        "  -H            report the number of matches at each distance "
+        "0..approximation_factor\n");
+    printf(
+        "  -n N          report the N windows closest to each pattern, "
+        "whatever their distance\n");
+    printf(
+        "  -r            search both strands: each pattern and its reverse "
+        "complement\n");
+    printf(
+        "  -f file       read more patterns from file (one per line, or "
+        "FASTA)\n");
+    printf(
+        "  -s            substitutions only: the distance is the number of "
+        "mismatches (Hamming)\n");
+    printf(
+        "  -C dir        (apm_parallel) reuse the counts and histograms cached "
+        "in dir\n");
+    printf(
+        "  -P format     (apm_parallel) time every phase per rank and thread, "
+        "print it as a table or json\n");
+    printf(
+        "  -T file       (apm_parallel) write a timeline of every rank and "
+        "thread to file\n"
+        "                (Chrome trace: chrome://tracing, ui.perfetto.dev)\n");
+    printf(
+        "  -p seconds    (apm_parallel) report the progress, throughput, ETA "
+        "and lag of the ranks\n"
+        "                on stderr every this many seconds\n");
+    printf(
+        "  -B backend    (apm_parallel) kernels of the search: cuda, avx2, "
+        "simd, scalar or emulate\n"
+        "                (default: the best one of each rank), list to print "
+        "them\n");
+    printf(
+        "  -c file       (apm_parallel) search the patterns in batches and "
+        "save their counts and\n"
+        "                histograms to file, run again to resume (not with -o, "
+        "-n)\n");
+    printf(
+        "  -i seconds    (-c) search time between two checkpoints, about "
+        "(default: %d)\n",
+        DEFAULT_CHECKPOINT_INTERVAL);
+    printf(
+        "  -S socket     keep the database loaded and serve queries (the "
+        "arguments above,\n"
+        "                one query per line) on this Unix socket\n");
+    printf(
+        "  -b N          (-S) merge up to N queries with the same options into "
+        "one search\n");
+    printf(
+        "  -w ms         (-S) let a query wait up to ms milliseconds for "
+        "others to merge with\n");
+}
+
+// The CUDA kernels only count matches: these modes need the CPU kernels
+int cpu_only_options(struct apm_options *opts) {
+    return opts->hits_file != NULL || opts->histogram || opts->top_n > 0 ||
+           opts->nb_strands > 1 || opts->hamming;
+}
+
+// Parses the leading options and shifts argv so that argv[1] is the
+// approximation factor again, as the approaches expect.
+// Returns 0 on success, 1 on an unknown/malformed option.
+int parse_options(int *argc, char ***argv, struct apm_options *opts) {
+    int opt;
+
+    memset(opts, 0, sizeof(struct apm_options));
+    opts->nb_strands = 1;
+    opts->batch_size = DEFAULT_BATCH_SIZE;
+    opts->interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+    // '+' stops at the first positional argument (GNU getopt would
+    // otherwise permute the patterns)
+    opterr = 0;
+#ifdef __GLIBC__
+    // 0 fully resets glibc's getopt: the server parses one line per query
+    optind = 0;
+#else
+    optind = 1;
+#endif
+    while ((opt = getopt(*argc, *argv, "+o:Hn:rf:sS:b:w:C:P:T:p:B:c:i:")) !=
+           -1) {
+        switch (opt) {
+            case 'o':
+                opts->hits_file = optarg;
+                break;
+            case 'H':
+                opts->histogram = 1;
+                break;
+            case 'n':
+                opts->top_n = atoi(optarg);
+                if (opts->top_n <= 0) {
+                    fprintf(stderr, "-n expects a positive number\n");
+                    return 1;
+                }
+                break;
+            case 'r':
+                opts->nb_strands = 2;
+                break;
+            case 'f':
+                opts->pattern_file = optarg;
+                break;
+            case 's':
+                opts->hamming = 1;
+                break;
+            case 'S':
+                opts->server_socket = optarg;
+                break;
+            case 'b':
+                opts->batch_size = atoi(optarg);
+                if (opts->batch_size <= 0) {
+                    fprintf(stderr, "-b expects a positive number\n");
+                    return 1;
+                }
+                break;
+            case 'C':
+                opts->cache_dir = optarg;
+                break;
+            case 'P':
+                opts->phases = optarg;
+                if (strcmp(optarg, "table") && strcmp(optarg, "json")) {
+                    fprintf(stderr, "-P expects table or json\n");
+                    return 1;
+                }
+                break;
+            case 'T':
+                opts->trace_file = optarg;
+                break;
+            case 'p':
+                opts->progress = atof(optarg);
+                if (opts->progress <= 0) {
+                    fprintf(stderr, "-p expects a number of seconds\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                opts->backend = optarg;
+                break;
+            case 'c':
+                opts->checkpoint = optarg;
+                break;
+            case 'i':
+                opts->interval = atof(optarg);
+                if (opts->interval <= 0) {
+                    fprintf(stderr, "-i expects a number of seconds\n");
+                    return 1;
+                }
+                break;
+            case 'w':
+                opts->batch_window_ms = atoi(optarg);
+                if (opts->batch_window_ms < 0) {
+                    fprintf(stderr, "-w expects a number of milliseconds\n");
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Unknown or incomplete option -%c\n", optopt);
+                return 1;
+        }
+    }
+
+    // Only counts and histograms are checkpointed
+    if (opts->checkpoint != NULL &&
+        (opts->hits_file != NULL || opts->top_n > 0)) {
+        fprintf(stderr, "-c cannot be combined with -o or -n\n");
+        return 1;
+    }
+
+    // Keep the program name in front of the positional arguments
+    (*argv)[optind - 1] = (*argv)[0];
+    *argv += optind - 1;
+    *argc -= optind - 1;
+
+    return 0;
+}
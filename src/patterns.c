@@ -0,0 +1,167 @@
+#include "patterns.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Closes the pattern written at the end of the arena
+static int end_pattern(struct pattern_set *set, int *capacity) {
+    if (set->nb_patterns + 1 >= *capacity) {
+        int *offsets;
+
+        *capacity *= 2;
+        offsets = (int *)realloc(set->offsets, *capacity * sizeof(int));
+        if (offsets == NULL) {
+            fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
+                    *capacity);
+            return 1;
+        }
+        set->offsets = offsets;
+    }
+
+    set->arena[set->arena_size++] = '\0';
+    set->offsets[++set->nb_patterns] = set->arena_size;
+    return 0;
+}
+
+/* Plain text: one pattern per line. FASTA: the sequence lines of a record
+ * (until the next '>' header) are concatenated into one pattern.
+ * Blank lines and ';' comments are skipped, as well as trailing '\r' and
+ * blanks. The patterns are compacted in place: text is the arena. */
+static int parse_pattern_file(struct pattern_set *set, int *capacity,
+                              char *text, int size) {
+    int in_record = 0;  // FASTA record being concatenated
+    int record_start = 0;
+    int i = 0;
+
+    while (i < size) {
+        int line_end = i;
+        int length;
+
+        while (line_end < size && text[line_end] != '\n') {
+            line_end++;
+        }
+        length = line_end - i;
+        while (length > 0 && (text[i + length - 1] == '\r' ||
+                              text[i + length - 1] == ' ' ||
+                              text[i + length - 1] == '\t')) {
+            length--;
+        }
+
+        if (length > 0 && text[i] == '>') {
+            if (in_record && set->arena_size > record_start &&
+                end_pattern(set, capacity)) {
+                return 1;
+            }
+            in_record = 1;
+            record_start = set->arena_size;
+        } else if (length > 0 && text[i] != ';') {
+            // Never overwrites what is left to parse: every line shrinks by
+            // at least its '\n' (the arena has 1 more byte for the last one)
+            memmove(&set->arena[set->arena_size], &text[i], length);
+            set->arena_size += length;
+            if (!in_record && end_pattern(set, capacity)) {
+                return 1;
+            }
+        }
+
+        i = line_end + 1;
+    }
+
+    if (in_record && set->arena_size > record_start) {
+        return end_pattern(set, capacity);
+    }
+    return 0;
+}
+
+// Patterns of the file first (if any), then the ones of argv[3..argc-1]
+int load_patterns(struct pattern_set *set, int argc, char **argv,
+                  char *pattern_file) {
+    return make_patterns(set, argc > 3 ? argc - 3 : 0, &argv[argc > 3 ? 3 : 0],
+                         pattern_file);
+}
+
+// Patterns of the file first (if any, it may be NULL), then pattern[0..nb)
+int make_patterns(struct pattern_set *set, int nb, char **pattern,
+                  char *pattern_file) {
+    int capacity = 1024;
+    int file_size = 0;
+    int argv_size = 0;
+    char *text = NULL;
+    int i;
+
+    memset(set, 0, sizeof(struct pattern_set));
+
+    for (i = 0; i < nb; i++) {
+        int l = strlen(pattern[i]);
+        if (l <= 0) {
+            fprintf(stderr, "Error while parsing pattern %d\n", i + 1);
+            return 1;
+        }
+        argv_size += l + 1;
+    }
+
+    if (pattern_file != NULL) {
+        text = read_input_file(pattern_file, &file_size);
+        if (text == NULL) {
+            return 1;
+        }
+    }
+
+    // The arena never needs more than the file (+1 for a missing newline)
+    set->arena = (char *)realloc(text, file_size + 1 + argv_size);
+    set->offsets = (int *)malloc(capacity * sizeof(int));
+    if (set->arena == NULL || set->offsets == NULL) {
+        fprintf(stderr, "Unable to allocate %d byte(s) for the patterns\n",
+                file_size + 1 + argv_size);
+        return 1;
+    }
+    set->offsets[0] = 0;
+
+    if (parse_pattern_file(set, &capacity, set->arena, file_size)) {
+        return 1;
+    }
+
+    for (i = 0; i < nb; i++) {
+        int l = strlen(pattern[i]);
+
+        memcpy(&set->arena[set->arena_size], pattern[i], l);
+        set->arena_size += l;
+        if (end_pattern(set, &capacity)) {
+            return 1;
+        }
+    }
+
+    set->pattern = (char **)malloc((set->nb_patterns + 1) * sizeof(char *));
+    if (set->pattern == NULL) {
+        fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
+                set->nb_patterns);
+        return 1;
+    }
+    for (i = 0; i < set->nb_patterns; i++) {
+        set->pattern[i] = &set->arena[set->offsets[i]];
+    }
+
+    return 0;
+}
+
+void free_patterns(struct pattern_set *set) {
+    free(set->arena);
+    free(set->offsets);
+    free(set->pattern);
+    memset(set, 0, sizeof(struct pattern_set));
+}
+
+int max_pattern_length(struct pattern_set *set) {
+    int max_length = 0;
+    int i;
+
+    for (i = 0; i < set->nb_patterns; i++) {
+        if (PATTERN_LENGTH(set, i) > max_length) {
+            max_length = PATTERN_LENGTH(set, i);
+        }
+    }
+    return max_length;
+}
@@ -0,0 +1,62 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "patterns.h"
+
+/* Sends the pattern set of rank 0 to every rank. Rank 0 broadcasts a
+ * negative number of patterns when it could not load them, so that every
+ * rank returns an error. */
+int bcast_patterns(struct pattern_set *set, int rank) {
+    int mpi_call_result;
+    int sizes[2];
+    int i;
+
+    if (rank == 0) {
+        sizes[0] = set->nb_patterns;
+        sizes[1] = set->arena_size;
+    }
+    mpi_call_result = MPI_Bcast(sizes, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    if (sizes[0] < 0) {
+        return 1;
+    }
+
+    if (rank != 0) {
+        set->nb_patterns = sizes[0];
+        set->arena_size = sizes[1];
+        set->arena = (char *)malloc(set->arena_size * sizeof(char));
+        set->offsets = (int *)malloc((set->nb_patterns + 1) * sizeof(int));
+        set->pattern =
+            (char **)malloc((set->nb_patterns + 1) * sizeof(char *));
+        if (set->arena == NULL || set->offsets == NULL ||
+            set->pattern == NULL) {
+            fprintf(stderr, "Unable to allocate %d byte(s) for the patterns\n",
+                    set->arena_size);
+            return 1;
+        }
+    }
+
+    mpi_call_result = MPI_Bcast(set->offsets, set->nb_patterns + 1, MPI_INT, 0,
+                                MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    mpi_call_result = MPI_Bcast(set->arena, set->arena_size, MPI_BYTE, 0,
+                                MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+
+    if (rank != 0) {
+        for (i = 0; i < set->nb_patterns; i++) {
+            set->pattern[i] = &set->arena[set->offsets[i]];
+        }
+    }
+    return 0;
+}
@@ -21,7 +21,15 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "aho_corasick.h"
 #include "approaches.h"
+#include "chunk_queue.h"
+#include "hits.h"
+#include "phases.h"
+#include "progress.h"
+#include "scratch.h"
+#include "topn.h"
+#include "trace.h"
 #include "utils.h"
 
 #define APM_INFO 1
@@ -30,13 +38,48 @@
 #define APM_DEBUG_ALLOC 0
 #define APM_DEBUG_BYTES 0
 
-int *invoke_kernel(char *buf, int n_bytes, char *my_pattern, int pattern_length,
-                   int approx_factor, int *local_matches);
+// The database stays on the device for the whole search, the pattern for
+// all of its chunks
+void kernel_begin(char *buf, int n_bytes, int max_pattern_length);
 
-void write_kernel_result(int *local_matches, int *d_local_matches);
+void kernel_pattern(char *my_pattern, int pattern_length);
+
+int invoke_kernel(int first, int nb_windows, int approx_factor);
+
+void kernel_end(void);
+
+// Chunks of the scan of a pattern (chunk_queue.h), in windows at least: the
+// accelerator pays a launch and a copy of its counter per chunk
+#define CPU_CHUNK_WINDOWS 4096
+#define ACCEL_CHUNK_WINDOWS (1 << 16)
+
+// Matches of the pattern in the windows [first, first + nb_windows), on the
+// accelerator (thread 0)
+static int accelerate(int accelerator, char *buf, int n_bytes, int first,
+                      int nb_windows, char *pattern, int pattern_length,
+                      int approx_factor, int *column) {
+    int matches = 0;
+    int j, size;
+
+    phase_begin(PHASE_GPU);
+    if (accelerator == ACCEL_CUDA) {
+        matches = invoke_kernel(first, nb_windows, approx_factor);
+    } else {
+        for (j = first; j < first + nb_windows; j++) {
+            size = n_bytes - j < pattern_length ? n_bytes - j : pattern_length;
+            matches +=
+                levenshtein(pattern, &buf[j], size, column) <= approx_factor;
+        }
+    }
+    phase_end(PHASE_GPU);
+    return matches;
+}
 
 int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
-                               int cuda_device_exists) {
+                               int accelerator,
+                               struct apm_options *opts,
+                               struct pattern_set *patterns,
+                               struct apm_database *db) {
     char **pattern;
     char *filename;
     int approx_factor = 0;
@@ -45,24 +88,33 @@ int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
     char *buf;
     double t1, t2;
     int n_bytes;
-    int *n_matches;
+    int *n_matches = NULL;
 
     int mpi_call_result;
     MPI_Status status;
-    int local_matches;
+    int local_matches[2];
+    int *histograms;
+    struct hit_buffer hits;
+    struct topn *best = NULL;
+
+    int s, m;
 
-    int tag;
+    // With -r every pattern has 2 result slots (see STRAND_LABEL)
+    int nb_strands = opts->nb_strands;
+
+    // Patterns are distributed round-robin over the workers (the master
+    // process is skipped): worker w takes the patterns w - 1 + m * nb_workers
+    int nb_workers = world_size - 1;
+    int nb_mine = 0;
+    int hist_size;
 
 #if APM_DEBUG
     printf("World size: %d | My rank: %d\n", world_size, rank);
 #endif
 
     /* Check number of arguments */
-    if (argc < 4) {
-        printf(
-            "Usage: %s approximation_factor "
-            "dna_database pattern1 pattern2 ...\n",
-            argv[0]);
+    if (argc < 3 || patterns->nb_patterns == 0) {
+        print_usage(argv[0]);
 
         return 1;
     }
@@ -73,41 +125,66 @@ int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
     /* Grab the filename containing the target text */
     filename = argv[2];
 
-    /* Get the number of patterns that the user wants to search for */
-    nb_patterns = argc - 3;
+    /* Every rank received the patterns from main */
+    nb_patterns = patterns->nb_patterns;
+    pattern = patterns->pattern;
 
-    if (rank == 0) {
-        // Master process
+    if (rank > 0 && rank - 1 < nb_patterns) {
+        nb_mine = (nb_patterns - rank) / nb_workers + 1;
+    }
 
-        /* Fill the pattern array */
-        pattern = (char **)malloc(nb_patterns * sizeof(char *));
-        if (pattern == NULL) {
-            fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
-                    nb_patterns);
+    hist_size = nb_strands * (approx_factor + 1);
 
-            return 1;
-        }
+    hit_buffer_init(&hits);
 
-        /* Grab the patterns */
-        for (i = 0; i < nb_patterns; i++) {
-            int l;
+    /* Master: one histogram of approx_factor + 1 distances per result slot.
+     * Workers: the histograms of all their patterns */
+    histograms = (int *)calloc(
+        ((rank == 0 ? nb_patterns : nb_mine) + 1) * hist_size, sizeof(int));
+    if (histograms == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for histograms\n");
+        return 1;
+    }
 
-            l = strlen(argv[i + 3]);
-            if (l <= 0) {
-                fprintf(stderr, "Error while parsing argument %d\n", i + 3);
+    /* Top-N: one heap per result slot (of all the patterns on the master, of
+     * my patterns on the workers) */
+    if (opts->top_n > 0) {
+        int nb_heaps = (rank == 0 ? nb_patterns : nb_mine) * nb_strands;
 
+        best = (struct topn *)malloc((nb_heaps + 1) * sizeof(struct topn));
+        if (best == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for top-N\n");
+            return 1;
+        }
+        for (i = 0; i < nb_heaps; i++) {
+            if (topn_init(&best[i], opts->top_n)) {
                 return 1;
             }
+        }
+    }
 
-            pattern[i] = (char *)malloc((l + 1) * sizeof(char));
-            if (pattern[i] == NULL) {
-                fprintf(stderr, "Unable to allocate string of size %d\n", l);
+#if APM_INFO
+    /* Timer start (from the moment data distribution begins)*/
+    t1 = MPI_Wtime();
+#endif
 
-                return 1;
-            }
+    /* The database: resident in server mode, otherwise read by the master
+     * and broadcast to the workers */
+    if (db != NULL) {
+        buf = db->buf;
+        n_bytes = db->n_bytes;
+    } else {
+        struct apm_database loaded;
 
-            strncpy(pattern[i], argv[i + 3], (l + 1));
+        if (bcast_database(filename, rank, &loaded)) {
+            return 1;
         }
+        buf = loaded.buf;
+        n_bytes = loaded.n_bytes;
+    }
+
+    if (rank == 0) {
+        // Master process
 
 #if APM_INFO
         printf(
@@ -116,106 +193,107 @@ int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
             nb_patterns, filename, approx_factor);
 #endif
 
-        buf = read_input_file(filename, &n_bytes);
-        if (buf == NULL) {
-            return 1;
-        }
-
         /* Allocate the array of matches */
-        n_matches = (int *)malloc(nb_patterns * sizeof(int));
+        n_matches = (int *)malloc(nb_patterns * nb_strands * sizeof(int));
         if (n_matches == NULL) {
             fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
-                    nb_patterns * sizeof(int));
+                    nb_patterns * nb_strands * sizeof(int));
 
             return 1;
         }
 
-#if APM_INFO
-        /* Timer start (from the moment data distribution begins)*/
-        t1 = MPI_Wtime();
-#endif
+        // No pattern to send: every worker knows its share (round-robin)
 
-        // Send size of buffer
-        mpi_call_result = MPI_Bcast(&n_bytes, 1, MPI_INT, 0, MPI_COMM_WORLD);
-        if (mpi_call_result != MPI_SUCCESS) {
-            printf("MPI Error: %d\n", mpi_call_result);
+        /* recv the results, one batch per worker (whichever finishes first)
+         */
+        int *temp = (int *)malloc(
+            ((nb_patterns / nb_workers + 1) * hist_size + 1) * sizeof(int));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for results\n");
             return 1;
         }
+        int nb_active_workers = nb_workers < nb_patterns ? nb_workers
+                                                         : nb_patterns;
+        int worker;
+        progress_watch(nb_active_workers);
+        for (worker = 0; worker < nb_active_workers; worker++) {
 #if APM_DEBUG
-        printf("\n(Rank %d) Sent n_bytes=%d\n", rank, n_bytes);
-#endif
-
-        // send content of buffer
-        mpi_call_result = MPI_Bcast(buf, n_bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
-        if (mpi_call_result != MPI_SUCCESS) {
-            printf("MPI Error: %d\n", mpi_call_result);
-            return 1;
-        }
-#if APM_DEBUG_BUF
-        printf("\n(Rank %d) Sent buf=%s\n", rank, "buffer");
+            printf("Master waiting for results of a worker\n");
 #endif
 
-        // Distribute the patterns accross available ranks (round-robin
-        // scheduling)
-        for (i = 0; i < nb_patterns; i++) {
-            int dest_rank = 1 + (i % (world_size - 1));  // skip master process
-            int pattern_length = strlen(pattern[i]);
-
-            tag = i;
-
-#if APM_DEBUG
-            printf("Master sending pattern %d to rank %d\n", tag, dest_rank);
-#endif
-            mpi_call_result = MPI_Send(&pattern_length, 1, MPI_INT, dest_rank,
-                                       0, MPI_COMM_WORLD);
+            // Waiting for the next worker to finish its patterns
+            phase_begin(PHASE_WAIT);
+            progress_wait(TAG_COUNTS);
+            mpi_call_result = MPI_Recv(
+                temp, (nb_patterns / nb_workers + 1) * nb_strands, MPI_INT,
+                MPI_ANY_SOURCE, TAG_COUNTS, MPI_COMM_WORLD, &status);
+            phase_end(PHASE_WAIT);
             if (mpi_call_result != MPI_SUCCESS) {
                 printf("MPI Error: %d\n", mpi_call_result);
                 return 1;
             }
-
-            mpi_call_result = MPI_Send(pattern[i], pattern_length, MPI_BYTE,
-                                       dest_rank, tag, MPI_COMM_WORLD);
-            if (mpi_call_result != MPI_SUCCESS) {
-                printf("MPI Error: %d\n", mpi_call_result);
-                return 1;
-            }
-        }
-
-        int dest_rank;
-
-        /* recv the results */
-        int temp;
-        for (i = 0; i < nb_patterns; i++) {
-            dest_rank = 1 + (i % (world_size - 1));
+            phase_begin(PHASE_COLLECT);
+            int source = status.MPI_SOURCE;
+            progress_drain(source);
+            int nb_theirs = (nb_patterns - source) / nb_workers + 1;
 #if APM_DEBUG
-            printf("Master waiting for result from rank%d: n_matches[%d] = ?\n",
-                   dest_rank, i);
+            printf("Message from rank %d: %d pattern(s)\n", source, nb_theirs);
 #endif
-
-            mpi_call_result = MPI_Recv(&temp, 1, MPI_INT, MPI_ANY_SOURCE,
-                                       MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-            if (mpi_call_result != MPI_SUCCESS) {
-                printf("MPI Error: %d\n", mpi_call_result);
-                return 1;
+            for (m = 0; m < nb_theirs; m++) {
+                int first_slot = (source - 1 + m * nb_workers) * nb_strands;
+                for (s = 0; s < nb_strands; s++) {
+                    n_matches[first_slot + s] = temp[m * nb_strands + s];
+                }
             }
-#if APM_DEBUG
-            printf("Message from rank %d: n_matches[%d] = %d\n",
-                   status.MPI_SOURCE, status.MPI_TAG, temp);
-#endif
-            int processed_pattern_idx = status.MPI_TAG;
-            n_matches[processed_pattern_idx] = temp;
-        }
 
-        /* send a negative pattern size to tell the workers to stop */
-        int stop_value = -1;
-        for (dest_rank = 1; dest_rank < world_size; dest_rank++) {
-            mpi_call_result =
-                MPI_Send(&stop_value, 1, MPI_INT, dest_rank, 0, MPI_COMM_WORLD);
-            if (mpi_call_result != MPI_SUCCESS) {
-                printf("MPI Error: %d\n", mpi_call_result);
-                return 1;
+            // The histograms, positions and top-N follow, from the same
+            // worker
+            if (opts->histogram) {
+                mpi_call_result =
+                    MPI_Recv(temp, nb_theirs * hist_size, MPI_INT, source,
+                             TAG_HISTOGRAMS, MPI_COMM_WORLD, &status);
+                if (mpi_call_result != MPI_SUCCESS) {
+                    printf("MPI Error: %d\n", mpi_call_result);
+                    return 1;
+                }
+                for (m = 0; m < nb_theirs; m++) {
+                    memcpy(&histograms[(source - 1 + m * nb_workers) *
+                                       hist_size],
+                           &temp[m * hist_size], hist_size * sizeof(int));
+                }
             }
+            if (opts->hits_file != NULL) {
+                if (recv_hits(&hits, source, TAG_HITS)) {
+                    return 1;
+                }
+            }
+            if (best != NULL) {
+                struct topn *received = (struct topn *)malloc(
+                    nb_theirs * nb_strands * sizeof(struct topn));
+                if (received == NULL) {
+                    fprintf(stderr,
+                            "Error: unable to allocate memory for top-N\n");
+                    return 1;
+                }
+                for (i = 0; i < nb_theirs * nb_strands; i++) {
+                    topn_init(&received[i], opts->top_n);
+                }
+                if (recv_topn(received, nb_theirs * nb_strands, source,
+                              TAG_TOPN)) {
+                    return 1;
+                }
+                for (i = 0; i < nb_theirs * nb_strands; i++) {
+                    int slot = (source - 1 + (i / nb_strands) * nb_workers) *
+                                   nb_strands +
+                               i % nb_strands;
+                    topn_merge(&best[slot], &received[i]);
+                    topn_free(&received[i]);
+                }
+                free(received);
+            }
+            phase_end(PHASE_COLLECT);
         }
+        free(temp);
 
 #if APM_INFO
         /* Timer stop (when results from all Workers are received) */
@@ -225,178 +303,365 @@ int patterns_over_ranks_hybrid(int argc, char **argv, int rank, int world_size,
             "per rank: %f s\n\n",
             rank, world_size, atoi(getenv("OMP_NUM_THREADS")), t2 - t1);
 #endif
-        for (i = 0; i < nb_patterns; i++) {
-            printf("Number of matches for pattern <%.100s>: %d\n", pattern[i],
+        // With the result cache, main prints the counts and histograms
+        if (opts->results != NULL) {
+            opts->results->nb_results = nb_patterns * nb_strands;
+            opts->results->counts = n_matches;
+            opts->results->histograms = histograms;
+        }
+
+        for (i = 0; opts->results == NULL && i < nb_patterns * nb_strands;
+             i++) {
+            printf("Number of matches for pattern <%.100s>%s: %d\n",
+                   pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
                    n_matches[i]);
         }
-    } else {
-        // Worker Processes
 
-        // Initialization: get buffer & buffer content
+        if (opts->histogram && opts->results == NULL) {
+            for (i = 0; i < nb_patterns * nb_strands; i++) {
+                print_histogram(pattern[i / nb_strands],
+                                STRAND_LABEL(i, nb_strands),
+                                &histograms[i * (approx_factor + 1)],
+                                approx_factor);
+            }
+        }
 
-        // Receive size of buffer
-        mpi_call_result = MPI_Bcast(&n_bytes, 1, MPI_INT, 0, MPI_COMM_WORLD);
-        if (mpi_call_result != MPI_SUCCESS) {
-            printf("MPI Error: %d\n", mpi_call_result);
-            return 1;
+        if (best != NULL) {
+            for (i = 0; i < nb_patterns * nb_strands; i++) {
+                topn_sort(&best[i]);
+                print_topn(pattern[i / nb_strands],
+                           STRAND_LABEL(i, nb_strands), &best[i]);
+            }
         }
 
-        // allocate space for buffer
-#if APM_DEBUG_ALLOC
-        printf("\n(Rank %d) allocating %d bytes\n", rank,
-               n_bytes * sizeof(char));
-#endif
-        buf = (char *)malloc(n_bytes * sizeof(char));
-        if (buf == NULL) {
-            return 1;
+        if (opts->hits_file != NULL) {
+            if (write_hits(opts->hits_file, &hits, nb_patterns * nb_strands)) {
+                return 1;
+            }
+            hit_buffer_free(&hits);
         }
+    } else if (nb_mine > 0) {
+        // Worker Processes (more workers than patterns: the others have
+        // nothing to do but free their buffers below)
 
-        // get content of buffer & set NUL terminator
-        mpi_call_result = MPI_Bcast(buf, n_bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
-        if (mpi_call_result != MPI_SUCCESS) {
-            printf("MPI Error: %d\n", mpi_call_result);
+        int *my_matches = (int *)malloc(nb_mine * nb_strands * sizeof(int));
+        if (my_matches == NULL) {
             return 1;
         }
 
-#if APM_DEBUG_BUF
-        printf("\n(Rank %d) Received buf=%s\n", rank, "buffer");
-#endif
-
-        // Standby: wait to receive a pattern to search
-        while (1) {
-            // Receive size of pattern
-            // negative value received indicates worker to stop
-            int pattern_length;
-            mpi_call_result = MPI_Recv(&pattern_length, 1, MPI_INT, 0,
-                                       MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-            if (mpi_call_result != MPI_SUCCESS) {
-                printf("MPI Error: %d\n", mpi_call_result);
+        // Every pattern of mine is compared with every window (-p)
+        long long windows_per_pattern = n_bytes - approx_factor;
+        progress_begin(nb_mine * windows_per_pattern);
+
+        // Exact matching of many patterns: all of mine in a single pass, the
+        // threads split the database instead
+        int first_pattern_scanned = 0;
+        phase_begin(PHASE_SCAN);
+        if (use_multi_pattern_engine(approx_factor, nb_mine, opts)) {
+            int *mine = (int *)malloc(nb_mine * sizeof(int));
+            if (mine == NULL) {
                 return 1;
             }
-#if APM_DEBUG
-            printf("\n(Rank %d) Received pattern_length=%d\n", rank,
-                   pattern_length);
-#endif
-            if (pattern_length < 0) {
-                /* no more task */
-                break;
+            for (m = 0; m < nb_mine; m++) {
+                mine[m] = rank - 1 + m * nb_workers;
             }
-
-            // Allocate space for pattern
-            char *my_pattern =
-                (char *)malloc((pattern_length * 2) * sizeof(char));
-            if (my_pattern == NULL) {
+            if (ac_search(patterns, mine, nb_mine, nb_strands, buf, n_bytes, 0,
+                          n_bytes, my_matches,
+                          opts->hits_file != NULL ? &hits : NULL)) {
                 return 1;
             }
+            free(mine);
 
-            // Receive content of pattern
-            mpi_call_result =
-                MPI_Recv(my_pattern, pattern_length, MPI_BYTE, MPI_ANY_SOURCE,
-                         MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-            if (mpi_call_result != MPI_SUCCESS) {
-                printf("MPI Error: %d\n", mpi_call_result);
-                return 1;
-            }
-            tag = status.MPI_TAG;
+            // hist_size is nb_strands at distance 0
+            memcpy(histograms, my_matches, nb_mine * nb_strands * sizeof(int));
+            first_pattern_scanned = nb_mine;
+            progress_add(nb_mine * windows_per_pattern);
+        }
+
+        // The columns and reverse complements of every thread, for all my
+        // patterns
+        struct scratch_pool scratch;
+        if (scratch_pool_init(&scratch, max_pattern_length(patterns),
+                              nb_strands)) {
+            return 1;
+        }
+
+        // The windows of a pattern, split between the threads, and the
+        // accelerator if any
+        struct chunk_queue queue;
+        if (chunk_queue_init(&queue, omp_get_max_threads())) {
+            return 1;
+        }
+        phase_end(PHASE_SCAN);
+
+        // The database goes to the device once, whatever the number of chunks
+        if (accelerator == ACCEL_CUDA && first_pattern_scanned < nb_mine) {
+            phase_begin(PHASE_GPU);
+            kernel_begin(buf, n_bytes, max_pattern_length(patterns));
+            phase_end(PHASE_GPU);
+        }
+
+        // Process my patterns one after the other
+        for (m = first_pattern_scanned; m < nb_mine; m++) {
+            int tag = rank - 1 + m * nb_workers;  // index of the pattern
+            char *my_pattern = pattern[tag];
+            int pattern_length = PATTERN_LENGTH(patterns, tag);
+            int *my_histograms = &histograms[m * hist_size];
+            struct topn *my_heaps = best != NULL ? &best[m * nb_strands] : NULL;
 
 #if APM_DEBUG
-            printf("\n(Rank %d) Received pattern=%s with tag: %d\n", rank,
+            printf("\n(Rank %d) Processing pattern=%s with tag: %d\n", rank,
                    my_pattern, tag);
 #endif
 
+            // The other strand is searched in the same pass
+            char *my_pattern_rc = NULL;
+            if (nb_strands == 2) {
+                my_pattern_rc = scratch_get(&scratch, 0)->pattern_rc;
+                reverse_complement(my_pattern, pattern_length, my_pattern_rc);
+            }
+
             // Begin Processing assigned pattern
 
             /* Initialize the number of matches to 0 */
-            local_matches = 0;
-            int *device_result_address;
-            int device_result = 0;
-
-            // Best ratio determined by experiments is 75%
-            //#ifdef GPU_JOB_SIZE_75
-            int gpu_job_size = (3 * n_bytes / 4);
-            //#else
-            //            int gpu_job_size = n_bytes / 2;
-            //#endif
-
-            // Overall idea: if there is a cuda device, it takes on
-            // the first half of the workload + "ghost cells"
-            if (cuda_device_exists) {
-                device_result_address = invoke_kernel(
-                    buf, gpu_job_size + (pattern_length - 1), my_pattern,
-                    pattern_length, approx_factor, &device_result);
+            for (s = 0; s < nb_strands; s++) {
+                local_matches[s] = 0;
+            }
+
+            if (accelerator == ACCEL_CUDA) {
+                phase_begin(PHASE_GPU);
+                kernel_pattern(my_pattern, pattern_length);
+                phase_end(PHASE_GPU);
             }
 
+            phase_begin(PHASE_SCAN);
+
+            // The accelerator pulls its chunks as it goes: its share follows
+            // its speed (static split of the threads without one)
+            chunk_queue_reset(&queue, 0, n_bytes - approx_factor,
+                              accelerator != ACCEL_NONE);
+
             /* Process the input data with OpenMP Threads */
 #pragma omp parallel default(none)                                         \
     firstprivate(rank, n_bytes, approx_factor, pattern_length, my_pattern, \
-                 cuda_device_exists, gpu_job_size, buf) shared(local_matches)
+                 my_pattern_rc, nb_strands, accelerator, buf, tag, opts,   \
+                 my_heaps)                                                 \
+    shared(hits, scratch, queue)                                           \
+    reduction(+ : local_matches[:nb_strands],                              \
+                  my_histograms[:nb_strands * (approx_factor + 1)])
             {
-                rank = rank;
-                n_bytes = n_bytes;
-                gpu_job_size = gpu_job_size;
-                pattern_length = pattern_length;
-                buf = buf;
+                double region_start = omp_get_wtime();
+                int t = omp_get_thread_num();
+                int accelerating = accelerator != ACCEL_NONE && t == 0;
+                long long first, count;
 
-                // Overall idea: if there is a cuda device, omp threads take on
-                // just the second half of the workload + "ghost cells"
-                int starting_point = cuda_device_exists
-                                         ? (gpu_job_size - (pattern_length + 1))
-                                         : 0;
+                int j, s;
 
-                approx_factor = approx_factor;
-                my_pattern = my_pattern;
+                // With -s, the distances of a batch of windows at once
+                struct hamming_batch batch;
+                hamming_batch_init(&batch);
 
-                int j;
+                // One column per strand
+                int *column =
+                    scratch_get(&scratch, omp_get_thread_num())->column;
 
-                int *column = (int *)malloc((pattern_length + 1) * sizeof(int));
+                // The kernels of the length class of my pattern
+                struct levenshtein_kernels kernels;
+                levenshtein_select(pattern_length, &kernels);
 
-                int chunk_size = ((n_bytes - approx_factor) - starting_point) /
-                                 omp_get_num_threads();
+                // Each thread buffers its own positions and keeps its own
+                // top-N, merged below
+                struct hit_buffer my_hits;
+                hit_buffer_init(&my_hits);
 
-#pragma omp for schedule(static, chunk_size)
-                for (j = starting_point; j < n_bytes - approx_factor; j++) {
-#if APM_DEBUG_BYTES
-                    printf("(Rank %d - Thread %d) - processing byte %d\n", rank,
-                           omp_get_thread_num(), j);
-#endif
-                    int distance = 0;
-                    int size;
+                struct topn my_best[2];
+                for (s = 0; my_heaps != NULL && s < nb_strands; s++) {
+                    topn_init(&my_best[s], my_heaps->size);
+                }
 
-                    size = pattern_length;
-                    if (n_bytes - j < pattern_length) {
-                        size = n_bytes - j;
+                int nb_windows = 0;
+
+                while ((count = chunk_queue_pull(
+                            &queue, t,
+                            accelerating ? ACCEL_CHUNK_WINDOWS
+                                         : CPU_CHUNK_WINDOWS,
+                            n_bytes, &first)) > 0) {
+                    double chunk_start = omp_get_wtime();
+                    double chunk_end;
+
+                    if (accelerating) {
+                        local_matches[0] += accelerate(
+                            accelerator, buf, n_bytes, first, count,
+                            my_pattern, pattern_length, approx_factor, column);
+                        progress_add(count);
+                        chunk_end = omp_get_wtime();
+                        chunk_queue_done(&queue, t, count,
+                                         chunk_end - chunk_start);
+                        trace_record_chunk(chunk_start, chunk_end, tag, first,
+                                           count);
+                        continue;
                     }
 
-                    distance = levenshtein(my_pattern, &buf[j], size, column);
-
-                    if (distance <= approx_factor) {
-                        local_matches++;
+                    for (j = first; j < first + count; j++) {
+#if APM_DEBUG_BYTES
+                        printf("(Rank %d - Thread %d) - processing byte %d\n",
+                               rank, omp_get_thread_num(), j);
+#endif
+                        int distance = 0;
+                        int distances[2];
+                        int size;
+
+                        progress_tick(&nb_windows);
+
+                        size = pattern_length;
+                        if (n_bytes - j < pattern_length) {
+                            size = n_bytes - j;
+                        }
+
+                        if (opts->hamming) {
+                            int bound = approx_factor;
+                            if (my_heaps != NULL) {
+                                bound = topn_window_bound(my_best, nb_strands,
+                                                          pattern_length,
+                                                          approx_factor);
+                            }
+                            hamming_batch_get(&batch, my_pattern, my_pattern_rc,
+                                              pattern_length, buf, n_bytes, j,
+                                              first + count, bound, distances);
+                        } else if (nb_strands == 2 || my_heaps != NULL) {
+                            // The bound tightens as my heaps fill up
+                            int bound = approx_factor;
+                            if (my_heaps != NULL) {
+                                bound = topn_window_bound(my_best, nb_strands,
+                                                          pattern_length,
+                                                          approx_factor);
+                            }
+                            if (nb_strands == 2) {
+                                kernels.strands(my_pattern, my_pattern_rc,
+                                                &buf[j], size, column, bound,
+                                                distances);
+                            } else {
+                                distances[0] = kernels.bounded(
+                                    my_pattern, &buf[j], size, column, bound);
+                            }
+                        } else {
+                            distances[0] = kernels.distance(my_pattern, &buf[j],
+                                                            size, column);
+                        }
+
+                        for (s = 0; s < nb_strands; s++) {
+                            distance = distances[s];
+                            if (my_heaps != NULL) {
+                                topn_add(&my_best[s], distance, j);
+                            }
+
+                            if (distance <= approx_factor) {
+                                local_matches[s]++;
+                                my_histograms[s * (approx_factor + 1) +
+                                              distance]++;
+                                if (opts->hits_file != NULL) {
+                                    hit_buffer_add(&my_hits,
+                                                   tag * nb_strands + s, j,
+                                                   distance);
+                                }
+                            }
+                        }
                     }
+                    chunk_end = omp_get_wtime();
+                    chunk_queue_done(&queue, t, count, chunk_end - chunk_start);
+                    trace_record_chunk(chunk_start, chunk_end, tag, first,
+                                       count);
+                }
+                progress_add(nb_windows);
+                phase_thread_done(region_start);
+
+#pragma omp critical
+                {
+                    hit_buffer_append(&hits, &my_hits);
+                    for (s = 0; my_heaps != NULL && s < nb_strands; s++) {
+                        topn_merge(&my_heaps[s], &my_best[s]);
+                    }
+                }
+
+                hit_buffer_free(&my_hits);
+                for (s = 0; my_heaps != NULL && s < nb_strands; s++) {
+                    topn_free(&my_best[s]);
                 }
-                free(column);
             }
+            phases_region_end();
+            phase_end(PHASE_SCAN);
 
-            if (cuda_device_exists) {
-                write_kernel_result(&device_result, device_result_address);
-                local_matches += device_result;
+            for (s = 0; s < nb_strands; s++) {
+                my_matches[m * nb_strands + s] = local_matches[s];
             }
+        }
+        if (accelerator == ACCEL_CUDA && first_pattern_scanned < nb_mine) {
+            kernel_end();
+        }
+        if (accelerator != ACCEL_NONE) {
+            chunk_queue_report(&queue, rank,
+                               accelerator == ACCEL_CUDA ? "GPU" : "emulated",
+                               "windows");
+        }
 
 #if APM_DEBUG
-            printf("Rank %d sending result: n_matches[%d] = %d\n", rank, tag,
-                   local_matches);
+        printf("Rank %d sending results of %d pattern(s)\n", rank, nb_mine);
 #endif
-            mpi_call_result =
-                MPI_Send(&local_matches, 1, MPI_INT, 0, tag, MPI_COMM_WORLD);
+        // All my results at once: a batch of 10^5 patterns costs a handful
+        // of messages
+        phase_begin(PHASE_COLLECT);
+        progress_finish();
+        mpi_call_result = MPI_Send(my_matches, nb_mine * nb_strands, MPI_INT,
+                                   0, TAG_COUNTS, MPI_COMM_WORLD);
+        if (mpi_call_result != MPI_SUCCESS) {
+            printf("MPI Error: %d\n", mpi_call_result);
+            return 1;
+        }
+        free(my_matches);
+        scratch_pool_free(&scratch);
+        chunk_queue_free(&queue);
+
+        if (opts->histogram) {
+            mpi_call_result = MPI_Send(histograms, nb_mine * hist_size, MPI_INT,
+                                       0, TAG_HISTOGRAMS, MPI_COMM_WORLD);
             if (mpi_call_result != MPI_SUCCESS) {
                 printf("MPI Error: %d\n", mpi_call_result);
                 return 1;
             }
         }
+        if (opts->hits_file != NULL) {
+            if (send_hits(&hits, 0, TAG_HITS)) {
+                return 1;
+            }
+            hit_buffer_free(&hits);
+        }
+        if (best != NULL) {
+            if (send_topn(best, nb_mine * nb_strands, 0, TAG_TOPN)) {
+                return 1;
+            }
+        }
+        phase_end(PHASE_COLLECT);
 
 #if APM_DEBUG
         printf("\n(Rank %d) Finished Loop\n", rank);
 #endif
     }
 
+    // Nothing outlives the run: the server runs one per query
+    if (rank != 0 || opts->results == NULL) {
+        free(n_matches);
+        free(histograms);
+    }
+    if (best != NULL) {
+        for (i = 0; i < (rank == 0 ? nb_patterns : nb_mine) * nb_strands;
+             i++) {
+            topn_free(&best[i]);
+        }
+        free(best);
+    }
+    if (db == NULL) {
+        free_huge(buf);
+    }
+
     return 0;
 }
@@ -13,12 +13,17 @@
 #define DEBUG_CUDA_RESULT 0
 #define TEST_PERFORMANCE_NO_LEVENSHTEIN 0
 
+// Grid-stride loop: more blocks would only grow the scratch columns
+#define MAX_BLOCKS_PER_GRID 4096
+
 #define MIN3(a, b, c) \
     ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
+// The windows [0, nb_windows) of buf (a chunk of the database, n_bytes up to
+// its end): the windows of the end of the database are shorter
 __global__ void ComputeMatches(char *buf, char *pattern, int *local_matches,
-                               int n_bytes, int pattern_length,
-                               int approx_factor) {
+                               int n_bytes, int nb_windows, int pattern_length,
+                               int approx_factor, int *columns) {
     // Source of tip about using pragma unroll:
     // https://docs.nvidia.com/cuda/cuda-c-best-practices-guide/index.html#branch-predication
 
@@ -28,9 +33,11 @@ __global__ void ComputeMatches(char *buf, char *pattern, int *local_matches,
     int distance = 0;
     int j;
 
-    int *column = (int *)malloc((pattern_length + 1) * sizeof(int));
+    // My column, allocated with the others before the launch
+    int *column = &columns[(blockDim.x * blockIdx.x + threadIdx.x) *
+                           (pattern_length + 1)];
 
-    for (j = blockDim.x * blockIdx.x + threadIdx.x; j < n_bytes - approx_factor;
+    for (j = blockDim.x * blockIdx.x + threadIdx.x; j < nb_windows;
          j += gridDim.x * blockDim.x) {
 #if TEST_PERFORMANCE_NO_LEVENSHTEIN
         continue;
@@ -65,70 +72,73 @@ __global__ void ComputeMatches(char *buf, char *pattern, int *local_matches,
         distance = column[size];
 
         if (distance <= approx_factor) {
-            (*local_matches)++;
+            atomicAdd(local_matches, 1);
         }
     }
-
-    free(column);
 }
 
-extern "C" int *invoke_kernel(char *buf, int n_bytes, char *my_pattern,
-                              int pattern_length, int approx_factor,
-                              int *local_matches) {
-    // Allocate arrays in device memory
-    char *d_buf;
-    cudaMalloc(&d_buf, n_bytes * sizeof(char));
-    char *d_pattern;
-    cudaMalloc(&d_pattern, pattern_length * sizeof(char));
-    int *d_local_matches;
-    cudaMalloc(&d_local_matches, 1 * sizeof(int));
+// On the device for the whole search: the database, and the columns and
+// counter of the longest pattern (kernel_begin()), then the pattern being
+// searched (kernel_pattern())
+static char *d_buf;
+static int d_n_bytes;
+static char *d_pattern;
+static int d_pattern_length;
+static int *d_local_matches;
+static int *d_columns;
+
+#define THREADS_PER_BLOCK 32
 
+extern "C" void kernel_begin(char *buf, int n_bytes, int max_pattern_length) {
 #if DEBUG_CUDA
     printf("DEBUG_CUDA: Starting memory transfers...\n");
 #endif
 
-    // Copy buffer & pattern from host memory to device memory
+    cudaMalloc(&d_buf, n_bytes * sizeof(char));
     cudaMemcpy(d_buf, buf, n_bytes, cudaMemcpyHostToDevice);
-    cudaMemcpy(d_pattern, my_pattern, pattern_length, cudaMemcpyHostToDevice);
-    cudaMemcpy(d_local_matches, local_matches, 1 * sizeof(int),
-               cudaMemcpyHostToDevice);
+    d_n_bytes = n_bytes;
 
-    int threadsPerBlock = 32;
-    int blocksPerGrid = (n_bytes + threadsPerBlock - 1) / threadsPerBlock;
+    cudaMalloc(&d_pattern, max_pattern_length * sizeof(char));
+    cudaMalloc(&d_local_matches, 1 * sizeof(int));
 
-    ComputeMatches<<<blocksPerGrid, threadsPerBlock>>>(
-        d_buf, d_pattern, d_local_matches, n_bytes, pattern_length,
-        approx_factor);
+    // One column per device thread, instead of a malloc in each of them
+    cudaMalloc(&d_columns, MAX_BLOCKS_PER_GRID * THREADS_PER_BLOCK *
+                               (max_pattern_length + 1) * sizeof(int));
+}
 
-#if DEBUG_CUDA
-    printf("DEBUG_CUDA: Kernel invoked - &d_local_matches=%ld\n",
-           d_local_matches);
-#endif
+extern "C" void kernel_pattern(char *my_pattern, int pattern_length) {
+    cudaMemcpy(d_pattern, my_pattern, pattern_length, cudaMemcpyHostToDevice);
+    d_pattern_length = pattern_length;
+}
 
-    // Free device memory
-    cudaFree(d_buf);
-    cudaFree(d_pattern);
+// Matches of the pattern in the windows [first, first + nb_windows)
+extern "C" int invoke_kernel(int first, int nb_windows, int approx_factor) {
+    int local_matches;
 
-    return d_local_matches;
-}
+    int blocksPerGrid = (nb_windows + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK;
+    if (blocksPerGrid > MAX_BLOCKS_PER_GRID) {
+        blocksPerGrid = MAX_BLOCKS_PER_GRID;
+    }
 
-extern "C" void write_kernel_result(int *local_matches, int *d_local_matches) {
-#if DEBUG_CUDA
-    printf(
-        "DEBUG_CUDA: getting result from device address &d_local_matches=%ld\n",
-        d_local_matches);
-#endif
+    cudaMemset(d_local_matches, 0, 1 * sizeof(int));
+    ComputeMatches<<<blocksPerGrid, THREADS_PER_BLOCK>>>(
+        &d_buf[first], d_pattern, d_local_matches, d_n_bytes - first,
+        nb_windows, d_pattern_length, approx_factor, d_columns);
 
-    // Copy result from device memory to host memory
-    cudaMemcpy(local_matches, d_local_matches, 1 * sizeof(int),
+    // Copy result from device memory to host memory (after the kernel)
+    cudaMemcpy(&local_matches, d_local_matches, 1 * sizeof(int),
                cudaMemcpyDeviceToHost);
 
 #if DEBUG_CUDA_RESULT
-    printf("DEBUG_CUDA: Matches found = %d\n", *local_matches);
+    printf("DEBUG_CUDA: Matches found = %d\n", local_matches);
 #endif
 
-    // Free remaining device pointer
-    cudaFree(d_local_matches);
+    return local_matches;
+}
 
-    return;
+extern "C" void kernel_end(void) {
+    cudaFree(d_buf);
+    cudaFree(d_pattern);
+    cudaFree(d_local_matches);
+    cudaFree(d_columns);
 }
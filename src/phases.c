@@ -0,0 +1,231 @@
+#include "phases.h"
+
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *phase_names[NB_PHASES] = {"load", "distribute", "wait",
+                                             "scan", "gpu",  "collect"};
+
+// The event of each phase in the trace (-T)
+static const enum trace_name phase_events[NB_PHASES] = {
+    TRACE_LOAD, TRACE_DISTRIBUTE, TRACE_WAIT,
+    TRACE_SCAN, TRACE_GPU,        TRACE_COLLECT};
+
+// The times of this rank: phases, then its total
+#define RANK_VALUES (NB_PHASES + 1)
+
+// The times of a thread: searching, then waiting for the others
+#define THREAD_VALUES 2
+
+static struct {
+    double reset;
+    double begin[NB_PHASES];
+    double seconds[NB_PHASES];
+    int nb_threads;
+    double *done;     // per thread: when it finished its share of a region
+    double *threads;  // per thread: THREAD_VALUES
+} timer;
+
+void phases_reset(void) {
+    int nb_threads = omp_get_max_threads();
+
+    if (timer.nb_threads != nb_threads) {
+        free(timer.done);
+        free(timer.threads);
+        timer.done = (double *)malloc(nb_threads * sizeof(double));
+        timer.threads =
+            (double *)malloc(nb_threads * THREAD_VALUES * sizeof(double));
+        timer.nb_threads = timer.done != NULL && timer.threads != NULL
+                               ? nb_threads
+                               : 0;
+    }
+    memset(timer.seconds, 0, sizeof(timer.seconds));
+    if (timer.nb_threads > 0) {
+        memset(timer.done, 0, timer.nb_threads * sizeof(double));
+        memset(timer.threads, 0,
+               timer.nb_threads * THREAD_VALUES * sizeof(double));
+    }
+    timer.reset = omp_get_wtime();
+}
+
+void phase_begin(enum apm_phase phase) {
+    timer.begin[phase] = omp_get_wtime();
+}
+
+void phase_end(enum apm_phase phase) {
+    double end = omp_get_wtime();
+
+    timer.seconds[phase] += end - timer.begin[phase];
+    trace_record(phase_events[phase], timer.begin[phase], end, -1);
+}
+
+void phase_thread_done(double region_start) {
+    int t = omp_get_thread_num();
+
+    if (t < timer.nb_threads) {
+        timer.done[t] = omp_get_wtime();
+        timer.threads[t * THREAD_VALUES] += timer.done[t] - region_start;
+    }
+}
+
+void phases_region_end(void) {
+    double end = omp_get_wtime();
+    int t;
+
+    for (t = 0; t < timer.nb_threads; t++) {
+        if (timer.done[t] > 0) {
+            timer.threads[t * THREAD_VALUES + 1] += end - timer.done[t];
+        }
+        timer.done[t] = 0;
+    }
+}
+
+/* min, mean and max of values[first..last) (stride apart), with the index of
+ * the max */
+static void stats(double *values, int first, int last, int stride,
+                  double *min, double *mean, double *max, int *slowest) {
+    int i;
+
+    *min = *mean = *max = 0;
+    *slowest = first;
+    for (i = first; i < last; i++) {
+        double v = values[i * stride];
+
+        if (i == first || v < *min) {
+            *min = v;
+        }
+        if (i == first || v > *max) {
+            *max = v;
+            *slowest = i;
+        }
+        *mean += v;
+    }
+    if (last > first) {
+        *mean /= last - first;
+    }
+}
+
+static void print_row(const char *name, double rank0, double min, double mean,
+                      double max, const char *slowest) {
+    printf("%-16s %10.4f %10.4f %10.4f %10.4f %9.2f  %s\n", name, rank0, min,
+           mean, max, mean > 0 ? max / mean : 1.0, slowest);
+}
+
+static void print_table(double *ranks, double *threads, int *thread_offset,
+                        int world_size) {
+    char slowest[64];
+    double min, mean, max;
+    int p, r, i, slow;
+    int nb_all = thread_offset[world_size];
+
+    printf("\n%-16s %10s %10s %10s %10s %9s  %s\n", "Phase (s)", "rank 0",
+           "min", "mean", "max", "max/mean", "slowest");
+    for (p = 0; p <= NB_PHASES; p++) {
+        // Over the workers: rank 0 only distributes and collects
+        stats(&ranks[p], 1, world_size, RANK_VALUES, &min, &mean, &max, &slow);
+        snprintf(slowest, sizeof(slowest), "rank %d", slow);
+        print_row(p < NB_PHASES ? phase_names[p] : "total", ranks[p], min,
+                  mean, max, slowest);
+    }
+
+    // Over all the threads of the workers
+    for (i = 0; i < THREAD_VALUES; i++) {
+        int first = thread_offset[1];
+
+        stats(&threads[i], first, nb_all, THREAD_VALUES, &min, &mean, &max,
+              &slow);
+        for (r = 1; r < world_size && slow >= thread_offset[r + 1]; r++) {
+        }
+        snprintf(slowest, sizeof(slowest), "rank %d thread %d", r,
+                 slow - thread_offset[r]);
+        print_row(i == 0 ? "thread scan" : "thread idle", 0, min, mean, max,
+                  nb_all > first ? slowest : "-");
+    }
+    printf("\n");
+}
+
+static void print_json(double *ranks, double *threads, int *nb_threads,
+                       int *thread_offset, int world_size) {
+    int p, r, t;
+
+    printf("{\"ranks\": [");
+    for (r = 0; r < world_size; r++) {
+        printf("%s\n  {\"rank\": %d", r > 0 ? "," : "", r);
+        for (p = 0; p <= NB_PHASES; p++) {
+            printf(", \"%s\": %.6f", p < NB_PHASES ? phase_names[p] : "total",
+                   ranks[r * RANK_VALUES + p]);
+        }
+        printf(", \"threads\": [");
+        for (t = 0; t < nb_threads[r]; t++) {
+            double *v = &threads[(thread_offset[r] + t) * THREAD_VALUES];
+
+            printf("%s{\"scan\": %.6f, \"idle\": %.6f}", t > 0 ? ", " : "",
+                   v[0], v[1]);
+        }
+        printf("]}");
+    }
+    printf("\n]}\n");
+}
+
+int phases_report(const char *format, int rank, int world_size) {
+    double mine[RANK_VALUES];
+    double *ranks = NULL, *threads = NULL;
+    int *nb_threads = NULL, *counts = NULL, *offsets = NULL;
+    int *thread_offset = NULL;
+    int r, failed = 0;
+
+    memcpy(mine, timer.seconds, sizeof(timer.seconds));
+    mine[NB_PHASES] = omp_get_wtime() - timer.reset;
+
+    if (rank == 0) {
+        ranks = (double *)malloc(world_size * RANK_VALUES * sizeof(double));
+        nb_threads = (int *)malloc(world_size * sizeof(int));
+        counts = (int *)malloc(world_size * sizeof(int));
+        offsets = (int *)malloc(world_size * sizeof(int));
+        thread_offset = (int *)malloc((world_size + 1) * sizeof(int));
+        failed = ranks == NULL || nb_threads == NULL || counts == NULL ||
+                 offsets == NULL || thread_offset == NULL;
+    }
+    MPI_Gather(mine, RANK_VALUES, MPI_DOUBLE, ranks, RANK_VALUES, MPI_DOUBLE,
+               0, MPI_COMM_WORLD);
+    MPI_Gather(&timer.nb_threads, 1, MPI_INT, nb_threads, 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+
+    if (rank == 0 && !failed) {
+        thread_offset[0] = 0;
+        for (r = 0; r < world_size; r++) {
+            thread_offset[r + 1] = thread_offset[r] + nb_threads[r];
+            counts[r] = nb_threads[r] * THREAD_VALUES;
+            offsets[r] = thread_offset[r] * THREAD_VALUES;
+        }
+        threads = (double *)malloc(
+            (thread_offset[world_size] * THREAD_VALUES + 1) * sizeof(double));
+        failed = threads == NULL;
+    }
+    MPI_Gatherv(timer.threads, timer.nb_threads * THREAD_VALUES, MPI_DOUBLE,
+                threads, counts, offsets, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        if (failed) {
+            fprintf(stderr, "Error: unable to allocate memory for the times\n");
+        } else if (!strcmp(format, "json")) {
+            print_json(ranks, threads, nb_threads, thread_offset, world_size);
+        } else {
+            print_table(ranks, threads, thread_offset, world_size);
+        }
+        fflush(stdout);
+    }
+
+    free(ranks);
+    free(threads);
+    free(nb_threads);
+    free(counts);
+    free(offsets);
+    free(thread_offset);
+    return failed;
+}
@@ -0,0 +1,290 @@
+#include "progress.h"
+
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "approaches.h"
+
+#define PROGRESS_ALIGNMENT 64
+
+// Workers listed one by one in a report, at most
+#define PROGRESS_MAX_LISTED 16
+
+// The counter of a thread, alone on its cache line
+struct counter {
+    long long nb_windows;
+    char padding[PROGRESS_ALIGNMENT - sizeof(long long)];
+};
+
+// What rank 0 knows of a worker
+struct worker {
+    long long done;
+    long long total;
+    double seen;  // its last message
+    int finished;
+};
+
+static struct {
+    double seconds;  // between two reports, 0: off
+    double start;
+    double last;  // report (rank 0) or message (worker)
+
+    // Worker
+    long long total;
+    int nb_threads;
+    struct counter *threads;
+    long long message[3];  // done, total, last
+    MPI_Request request;
+    int pending;
+
+    // Rank 0
+    int nb_workers;
+    struct worker *workers;  // by rank
+} progress;
+
+int progress_reset(double seconds, int rank, int world_size) {
+    int nb_threads = omp_get_max_threads();
+    void *threads;
+
+    progress.seconds = 0;
+    if (seconds <= 0) {
+        return 0;
+    }
+
+    // Kept from a query to the next one (server mode)
+    if (progress.nb_threads != nb_threads) {
+        free(progress.threads);
+        progress.threads = NULL;
+        progress.nb_threads = 0;
+        if (posix_memalign(&threads, PROGRESS_ALIGNMENT,
+                           nb_threads * sizeof(struct counter))) {
+            fprintf(stderr, "Error: unable to allocate memory for progress\n");
+            return 1;
+        }
+        progress.threads = (struct counter *)threads;
+        progress.nb_threads = nb_threads;
+    }
+    memset(progress.threads, 0, nb_threads * sizeof(struct counter));
+
+    if (rank == 0) {
+        free(progress.workers);
+        progress.workers =
+            (struct worker *)calloc(world_size, sizeof(struct worker));
+        if (progress.workers == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for progress\n");
+            return 1;
+        }
+    }
+
+    progress.seconds = seconds;
+    progress.start = progress.last = omp_get_wtime();
+    progress.total = 0;
+    progress.pending = 0;
+    progress.nb_workers = 0;
+    return 0;
+}
+
+// Sends the windows scanned by this rank, if it is time to (thread 0)
+static void publish(int last) {
+    double now = omp_get_wtime();
+    long long done = 0;
+    int t, sent;
+
+    if (!last && now - progress.last < progress.seconds) {
+        return;
+    }
+    if (progress.pending) {
+        if (last) {
+            MPI_Wait(&progress.request, MPI_STATUS_IGNORE);
+        } else {
+            // Rank 0 is not keeping up: skip this one
+            MPI_Test(&progress.request, &sent, MPI_STATUS_IGNORE);
+            if (!sent) {
+                return;
+            }
+        }
+        progress.pending = 0;
+    }
+
+    for (t = 0; t < progress.nb_threads; t++) {
+        done += __atomic_load_n(&progress.threads[t].nb_windows,
+                                __ATOMIC_RELAXED);
+    }
+    progress.message[0] = done;
+    progress.message[1] = progress.total;
+    progress.message[2] = last;
+    if (last) {
+        MPI_Send(progress.message, 3, MPI_LONG_LONG, 0, TAG_PROGRESS,
+                 MPI_COMM_WORLD);
+    } else {
+        MPI_Isend(progress.message, 3, MPI_LONG_LONG, 0, TAG_PROGRESS,
+                  MPI_COMM_WORLD, &progress.request);
+        progress.pending = 1;
+    }
+    progress.last = now;
+}
+
+void progress_begin(long long nb_windows) {
+    if (progress.seconds <= 0) {
+        return;
+    }
+    progress.total = nb_windows;
+    publish(0);
+}
+
+void progress_add(long long nb_windows) {
+    struct counter *mine;
+    int t;
+
+    if (progress.seconds <= 0) {
+        return;
+    }
+    t = omp_get_thread_num();
+    if (t >= progress.nb_threads) {
+        return;
+    }
+
+    // Only this thread writes its counter
+    mine = &progress.threads[t];
+    __atomic_store_n(&mine->nb_windows, mine->nb_windows + nb_windows,
+                     __ATOMIC_RELAXED);
+    if (t == 0) {
+        publish(0);
+    }
+}
+
+void progress_finish(void) {
+    if (progress.seconds <= 0) {
+        return;
+    }
+    publish(1);
+}
+
+void progress_watch(int nb_workers) {
+    int r;
+
+    if (progress.seconds <= 0) {
+        return;
+    }
+    progress.nb_workers = nb_workers;
+    for (r = 1; r <= nb_workers; r++) {
+        progress.workers[r].seen = omp_get_wtime();
+    }
+}
+
+static void receive(int source) {
+    long long message[3];
+    struct worker *w = &progress.workers[source];
+
+    MPI_Recv(message, 3, MPI_LONG_LONG, source, TAG_PROGRESS, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    w->done = message[0];
+    w->total = message[1];
+    w->finished = message[2];
+    w->seen = omp_get_wtime();
+}
+
+static double fraction(struct worker *w) {
+    return w->total > 0 ? (double)w->done / w->total : w->finished;
+}
+
+static void report(void) {
+    double now = omp_get_wtime();
+    double elapsed = now - progress.start;
+    double slowest_fraction = 2, fastest_fraction = -1;
+    long long done = 0, total = 0;
+    int r, nb_known = 0, slowest = 0;
+
+    for (r = 1; r <= progress.nb_workers; r++) {
+        struct worker *w = &progress.workers[r];
+        double f = fraction(w);
+
+        if (w->total > 0 || w->finished) {
+            nb_known++;
+        }
+        done += w->done;
+        total += w->total;
+        if (f < slowest_fraction) {
+            slowest_fraction = f;
+            slowest = r;
+        }
+        if (f > fastest_fraction) {
+            fastest_fraction = f;
+        }
+    }
+
+    fprintf(stderr, "Progress %.1f s: ", elapsed);
+    if (nb_known == progress.nb_workers && total > 0) {
+        fprintf(stderr, "%.1f%%, %.1f MB/s, ETA ", 100.0 * done / total,
+                done / elapsed / 1e6);
+        if (done > 0) {
+            fprintf(stderr, "%.1f s", (total - done) * elapsed / done);
+        } else {
+            fprintf(stderr, "?");
+        }
+    } else {
+        fprintf(stderr, "%d/%d rank(s) started, %.1f MB/s", nb_known,
+                progress.nb_workers, done / elapsed / 1e6);
+    }
+
+    if (progress.nb_workers <= PROGRESS_MAX_LISTED) {
+        fprintf(stderr, " | ranks");
+        for (r = 1; r <= progress.nb_workers; r++) {
+            fprintf(stderr, " %d: %.1f%%", r,
+                    100 * fraction(&progress.workers[r]));
+        }
+    }
+    if (progress.nb_workers > 1) {
+        fprintf(stderr, " | slowest rank %d (lag %.1f points)", slowest,
+                100 * (fastest_fraction - slowest_fraction));
+    }
+
+    // Stalled, or too busy to report
+    for (r = 1; r <= progress.nb_workers; r++) {
+        struct worker *w = &progress.workers[r];
+
+        if (!w->finished && now - w->seen > 3 * progress.seconds) {
+            fprintf(stderr, " | rank %d silent for %.0f s", r, now - w->seen);
+        }
+    }
+    fprintf(stderr, "\n");
+    progress.last = now;
+}
+
+void progress_wait(int tag) {
+    MPI_Status status;
+    int ready;
+
+    if (progress.seconds <= 0) {
+        return;
+    }
+    for (;;) {
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &ready, &status);
+        if (ready) {
+            return;
+        }
+        MPI_Iprobe(MPI_ANY_SOURCE, TAG_PROGRESS, MPI_COMM_WORLD, &ready,
+                   &status);
+        if (ready) {
+            receive(status.MPI_SOURCE);
+            continue;
+        }
+        if (omp_get_wtime() - progress.last >= progress.seconds) {
+            report();
+        }
+        usleep(1000);
+    }
+}
+
+void progress_drain(int source) {
+    if (progress.seconds <= 0) {
+        return;
+    }
+    while (!progress.workers[source].finished) {
+        receive(source);
+    }
+}
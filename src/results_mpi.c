@@ -0,0 +1,158 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hits.h"
+#include "topn.h"
+
+// A hit is sent as 3 consecutive ints (pattern, offset, distance)
+
+int send_hits(struct hit_buffer *b, int dest, int tag) {
+    int mpi_call_result;
+
+    mpi_call_result = MPI_Send(&b->count, 1, MPI_INT, dest, tag, MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    if (b->count == 0) {
+        return 0;
+    }
+
+    mpi_call_result =
+        MPI_Send(b->hits, 3 * b->count, MPI_INT, dest, tag, MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    return 0;
+}
+
+// Appends the hits sent by <source> to b
+int recv_hits(struct hit_buffer *b, int source, int tag) {
+    int mpi_call_result;
+    int count;
+
+    mpi_call_result = MPI_Recv(&count, 1, MPI_INT, source, tag, MPI_COMM_WORLD,
+                               MPI_STATUS_IGNORE);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    if (hit_buffer_reserve(b, b->count + count)) {
+        return 1;
+    }
+    mpi_call_result = MPI_Recv(&b->hits[b->count], 3 * count, MPI_INT, source,
+                               tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    b->count += count;
+    return 0;
+}
+
+// An array of nb heaps is sent as the nb counts, then all the kept windows
+// as consecutive (distance, offset) ints
+
+int send_topn(struct topn *t, int nb, int dest, int tag) {
+    struct best_match *all;
+    int *counts;
+    int mpi_call_result;
+    int total = 0;
+    int i;
+
+    counts = (int *)malloc(nb * sizeof(int));
+    if (counts == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                nb * sizeof(int));
+        return 1;
+    }
+    for (i = 0; i < nb; i++) {
+        counts[i] = t[i].count;
+        total += t[i].count;
+    }
+
+    all = (struct best_match *)malloc((total + 1) * sizeof(struct best_match));
+    if (all == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                total * sizeof(struct best_match));
+        return 1;
+    }
+    total = 0;
+    for (i = 0; i < nb; i++) {
+        memcpy(&all[total], t[i].heap, t[i].count * sizeof(struct best_match));
+        total += t[i].count;
+    }
+
+    mpi_call_result = MPI_Send(counts, nb, MPI_INT, dest, tag, MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    mpi_call_result =
+        MPI_Send(all, 2 * total, MPI_INT, dest, tag, MPI_COMM_WORLD);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+
+    free(all);
+    free(counts);
+    return 0;
+}
+
+// Merges the nb heaps sent by <source> into t[0..nb-1]
+int recv_topn(struct topn *t, int nb, int source, int tag) {
+    struct topn received;
+    struct best_match *all;
+    int *counts;
+    int mpi_call_result;
+    int total = 0;
+    int i;
+
+    counts = (int *)malloc(nb * sizeof(int));
+    if (counts == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                nb * sizeof(int));
+        return 1;
+    }
+    mpi_call_result = MPI_Recv(counts, nb, MPI_INT, source, tag,
+                               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+    for (i = 0; i < nb; i++) {
+        total += counts[i];
+    }
+
+    all = (struct best_match *)malloc((total + 1) * sizeof(struct best_match));
+    if (all == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                total * sizeof(struct best_match));
+        return 1;
+    }
+    mpi_call_result = MPI_Recv(all, 2 * total, MPI_INT, source, tag,
+                               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if (mpi_call_result != MPI_SUCCESS) {
+        printf("MPI Error: %d\n", mpi_call_result);
+        return 1;
+    }
+
+    received.heap = all;
+    for (i = 0; i < nb; i++) {
+        received.count = counts[i];
+        topn_merge(&t[i], &received);
+        received.heap += counts[i];
+    }
+
+    free(all);
+    free(counts);
+    return 0;
+}
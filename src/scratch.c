@@ -0,0 +1,79 @@
+#include "scratch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Rounds size up to a whole number of cache lines
+static size_t round_to_line(size_t size) {
+    return (size + SCRATCH_ALIGNMENT - 1) / SCRATCH_ALIGNMENT *
+           SCRATCH_ALIGNMENT;
+}
+
+// Allocates and first touches the block of a thread
+static int alloc_block(struct scratch *s, size_t column_size, size_t rc_size) {
+    void *block;
+
+    if (posix_memalign(&block, SCRATCH_ALIGNMENT, column_size + rc_size)) {
+        return 1;
+    }
+    memset(block, 0, column_size + rc_size);
+
+    s->column = (int *)block;
+    s->pattern_rc = (char *)block + column_size;
+    return 0;
+}
+
+int scratch_pool_init(struct scratch_pool *pool, int max_length,
+                      int nb_strands) {
+    size_t column_size, rc_size;
+    int failed = 0;
+
+#ifdef _OPENMP
+    pool->nb_threads = omp_get_max_threads();
+#else
+    pool->nb_threads = 1;
+#endif
+    pool->max_length = max_length;
+    pool->nb_strands = nb_strands;
+    pool->threads =
+        (struct scratch *)calloc(pool->nb_threads, sizeof(struct scratch));
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %d threads\n",
+                pool->nb_threads);
+        return 1;
+    }
+
+    column_size = round_to_line(nb_strands * (max_length + 1) * sizeof(int));
+    rc_size = round_to_line((max_length + 1) * sizeof(char));
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(pool->nb_threads) reduction(| : failed)
+    failed |= alloc_block(&pool->threads[omp_get_thread_num()], column_size,
+                          rc_size);
+#else
+    failed = alloc_block(&pool->threads[0], column_size, rc_size);
+#endif
+
+    if (failed) {
+        fprintf(stderr, "Error: unable to allocate memory for column (%ldB)\n",
+                column_size + rc_size);
+        scratch_pool_free(pool);
+        return 1;
+    }
+    return 0;
+}
+
+void scratch_pool_free(struct scratch_pool *pool) {
+    int t;
+
+    for (t = 0; pool->threads != NULL && t < pool->nb_threads; t++) {
+        // pattern_rc is in the same block
+        free(pool->threads[t].column);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+}
@@ -17,6 +17,12 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "aho_corasick.h"
+#include "hits.h"
+#include "options.h"
+#include "patterns.h"
+#include "scratch.h"
+#include "topn.h"
 #include "utils.h"
 
 int main(int argc, char **argv) {
@@ -30,13 +36,26 @@ int main(int argc, char **argv) {
     double duration;
     int n_bytes;
     int *n_matches;
+    struct apm_options opts;
+    struct pattern_set patterns;
+    struct hit_buffer hits;
+    int *histograms;
+    struct topn *best = NULL;
+    int nb_strands;
+    int nb_results;
+    int first_pattern_scanned = 0;
+    struct hamming_batch batch;
+    struct scratch_pool scratch;
 
     /* Check number of arguments */
-    if (argc < 4) {
-        printf(
-            "Usage: %s approximation_factor "
-            "dna_database pattern1 pattern2 ...\n",
-            argv[0]);
+    if (parse_options(&argc, &argv, &opts) || argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (opts.server_socket != NULL || opts.cache_dir != NULL) {
+        fprintf(stderr,
+                "Server mode (-S) and result cache (-C) are only available in "
+                "apm_parallel\n");
         return 1;
     }
 
@@ -46,54 +65,64 @@ int main(int argc, char **argv) {
     /* Grab the filename containing the target text */
     filename = argv[2];
 
-    /* Get the number of patterns that the user wants to search for */
-    nb_patterns = argc - 3;
-
-    /* Fill the pattern array */
-    pattern = (char **)malloc(nb_patterns * sizeof(char *));
-    if (pattern == NULL) {
-        fprintf(stderr, "Unable to allocate array of pattern of size %d\n",
-                nb_patterns);
+    /* Grab the patterns (command line and -f file) */
+    if (load_patterns(&patterns, argc, argv, opts.pattern_file)) {
         return 1;
     }
-
-    /* Grab the patterns */
-    for (i = 0; i < nb_patterns; i++) {
-        int l;
-
-        l = strlen(argv[i + 3]);
-        if (l <= 0) {
-            fprintf(stderr, "Error while parsing argument %d\n", i + 3);
-            return 1;
-        }
-
-        pattern[i] = (char *)malloc((l + 1) * sizeof(char));
-        if (pattern[i] == NULL) {
-            fprintf(stderr, "Unable to allocate string of size %d\n", l);
-            return 1;
-        }
-
-        strncpy(pattern[i], argv[i + 3], (l + 1));
+    if (patterns.nb_patterns == 0) {
+        print_usage(argv[0]);
+        return 1;
     }
+    nb_patterns = patterns.nb_patterns;
+    pattern = patterns.pattern;
 
     printf(
         "Approximate Pattern Mathing: "
         "looking for %d pattern(s) in file %s w/ distance of %d\n",
         nb_patterns, filename, approx_factor);
 
-    buf = read_input_file(filename, &n_bytes);
+    buf = read_database(filename, &n_bytes);
     if (buf == NULL) {
         return 1;
     }
 
+    /* With -r every pattern has 2 result slots (see STRAND_LABEL) */
+    nb_strands = opts.nb_strands;
+    nb_results = nb_patterns * nb_strands;
+
     /* Allocate the array of matches */
-    n_matches = (int *)malloc(nb_patterns * sizeof(int));
+    n_matches = (int *)malloc(nb_results * sizeof(int));
     if (n_matches == NULL) {
         fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
-                nb_patterns * sizeof(int));
+                nb_results * sizeof(int));
+        return 1;
+    }
+
+    hit_buffer_init(&hits);
+
+    /* One histogram of approx_factor + 1 distances per result slot */
+    histograms = (int *)calloc(nb_results * (approx_factor + 1), sizeof(int));
+    if (histograms == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                nb_results * (approx_factor + 1) * sizeof(int));
         return 1;
     }
 
+    /* The N closest windows of each result slot */
+    if (opts.top_n > 0) {
+        best = (struct topn *)malloc(nb_results * sizeof(struct topn));
+        if (best == NULL) {
+            fprintf(stderr, "Error: unable to allocate memory for %ldB\n",
+                    nb_results * sizeof(struct topn));
+            return 1;
+        }
+        for (i = 0; i < nb_results; i++) {
+            if (topn_init(&best[i], opts.top_n)) {
+                return 1;
+            }
+        }
+    }
+
     /*****
      * BEGIN MAIN LOOP
      ******/
@@ -101,25 +130,54 @@ int main(int argc, char **argv) {
     /* Timer start */
     gettimeofday(&t1, NULL);
 
+    /* Exact matching of many patterns: all of them in a single pass */
+    if (use_multi_pattern_engine(approx_factor, nb_patterns, &opts)) {
+        if (ac_search(&patterns, NULL, nb_patterns, nb_strands, buf, n_bytes,
+                      0, n_bytes, n_matches,
+                      opts.hits_file != NULL ? &hits : NULL)) {
+            return 1;
+        }
+        for (i = 0; i < nb_results; i++) {
+            histograms[i] = n_matches[i];
+        }
+        first_pattern_scanned = nb_patterns;
+    }
+
+    /* One column per strand and the reverse complement, sized once for the
+     * longest pattern */
+    if (scratch_pool_init(&scratch, max_pattern_length(&patterns),
+                          nb_strands)) {
+        return 1;
+    }
+
     /* Check each pattern one by one */
-    for (i = 0; i < nb_patterns; i++) {
-        int size_pattern = strlen(pattern[i]);
-        int *column;
+    for (i = first_pattern_scanned; i < nb_patterns; i++) {
+        int size_pattern = PATTERN_LENGTH(&patterns, i);
+        int *column = scratch_get(&scratch, 0)->column;
+        char *pattern_rc = NULL;
+        struct levenshtein_kernels kernels;
+        int s;
+
+        /* The kernels of the length class of the pattern */
+        levenshtein_select(size_pattern, &kernels);
 
         /* Initialize the number of matches to 0 */
-        n_matches[i] = 0;
+        for (s = 0; s < nb_strands; s++) {
+            n_matches[i * nb_strands + s] = 0;
+        }
 
-        column = (int *)malloc((size_pattern + 1) * sizeof(int));
-        if (column == NULL) {
-            fprintf(stderr,
-                    "Error: unable to allocate memory for column (%ldB)\n",
-                    (size_pattern + 1) * sizeof(int));
-            return 1;
+        if (nb_strands == 2) {
+            pattern_rc = scratch_get(&scratch, 0)->pattern_rc;
+            reverse_complement(pattern[i], size_pattern, pattern_rc);
         }
 
+        /* Hamming distances are computed for a batch of windows at once */
+        hamming_batch_init(&batch);
+
         /* Traverse the input data up to the end of the file */
         for (j = 0; j < n_bytes - approx_factor; j++) {
             int distance = 0;
+            int distances[2];
             int size;
 
 #if APM_DEBUG
@@ -133,15 +191,54 @@ int main(int argc, char **argv) {
                 size = n_bytes - j;
             }
 
-            distance = levenshtein(pattern[i], &buf[j], size, column);
+            if (opts.hamming) {
+                int bound = approx_factor;
+                if (best != NULL) {
+                    bound = topn_window_bound(&best[i * nb_strands], nb_strands,
+                                              size_pattern, approx_factor);
+                }
+                hamming_batch_get(&batch, pattern[i], pattern_rc, size_pattern,
+                                  buf, n_bytes, j, n_bytes - approx_factor,
+                                  bound, distances);
+            } else if (nb_strands == 2 || best != NULL) {
+                /* Stop computing as soon as the window can neither match nor
+                 * enter the top-N */
+                int bound = approx_factor;
+                if (best != NULL) {
+                    bound = topn_window_bound(&best[i * nb_strands], nb_strands,
+                                              size_pattern, approx_factor);
+                }
+                if (nb_strands == 2) {
+                    kernels.strands(pattern[i], pattern_rc, &buf[j], size,
+                                    column, bound, distances);
+                } else {
+                    distances[0] = kernels.bounded(pattern[i], &buf[j], size,
+                                                   column, bound);
+                }
+            } else {
+                distances[0] =
+                    kernels.distance(pattern[i], &buf[j], size, column);
+            }
 
-            if (distance <= approx_factor) {
-                n_matches[i]++;
+            for (s = 0; s < nb_strands; s++) {
+                int slot = i * nb_strands + s;
+
+                distance = distances[s];
+                if (best != NULL) {
+                    topn_add(&best[slot], distance, j);
+                }
+
+                if (distance <= approx_factor) {
+                    n_matches[slot]++;
+                    histograms[slot * (approx_factor + 1) + distance]++;
+                    if (opts.hits_file != NULL) {
+                        hit_buffer_add(&hits, slot, j, distance);
+                    }
+                }
             }
         }
-
-        free(column);
     }
+    scratch_pool_free(&scratch);
 
     /* Timer stop */
     gettimeofday(&t2, NULL);
@@ -154,10 +251,37 @@ int main(int argc, char **argv) {
      * END MAIN LOOP
      ******/
 
-    for (i = 0; i < nb_patterns; i++) {
-        printf("Number of matches for pattern <%s>: %d\n", pattern[i],
+    if (opts.hits_file != NULL) {
+        if (write_hits(opts.hits_file, &hits, nb_results)) {
+            return 1;
+        }
+        hit_buffer_free(&hits);
+    }
+
+    for (i = 0; i < nb_results; i++) {
+        printf("Number of matches for pattern <%s>%s: %d\n",
+               pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
                n_matches[i]);
     }
 
+    if (opts.histogram) {
+        for (i = 0; i < nb_results; i++) {
+            print_histogram(pattern[i / nb_strands],
+                            STRAND_LABEL(i, nb_strands),
+                            &histograms[i * (approx_factor + 1)],
+                            approx_factor);
+        }
+    }
+
+    if (best != NULL) {
+        for (i = 0; i < nb_results; i++) {
+            topn_sort(&best[i]);
+            print_topn(pattern[i / nb_strands], STRAND_LABEL(i, nb_strands),
+                       &best[i]);
+            topn_free(&best[i]);
+        }
+        free(best);
+    }
+
     return 0;
 }
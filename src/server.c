@@ -0,0 +1,764 @@
+/**
+ * APPROXIMATE PATTERN MATCHING
+ *
+ * Server mode (apm_parallel -S socket_path dna_database): the database is
+ * read and broadcast once, then stays resident on every rank. Rank 0 reads
+ * the queries from a local Unix socket and all the ranks run them with the
+ * usual approaches, so a small query costs a few messages instead of an
+ * mpirun and a reload.
+ *
+ * Protocol (text, one query per line):
+ *   client: [options] approximation_factor pattern1 pattern2 ... [approach]
+ *   server: what apm_parallel prints for these arguments, then "END"
+ * A "QUIT" line stops the server. Files (-o, -f) are on the server side.
+ *
+ * Batching: rank 0 accepts several clients at once and queues their queries.
+ * Queued queries with the same options, approximation factor and approach
+ * are merged (up to -b of them) into one search over all their patterns, and
+ * the result lines are then routed back to each query. A query waits at most
+ * -w milliseconds for others; with the default of 0 only the queries that
+ * arrived during the previous search are merged, which adds no latency.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <mpi.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "approaches.h"
+#include "utils.h"
+
+#define SERVER_DEBUG 0
+
+#define MAX_CLIENTS 64
+
+struct client {
+    int fd;       // -1 when the slot is free
+    char *input;  // received bytes, not a complete line yet
+    size_t input_size;
+    size_t input_capacity;
+};
+
+struct query {
+    int client;
+    char *line;
+
+    // What the merge needs (rank 0)
+    int mergeable;
+    struct apm_options opts;
+    int approx_factor;
+    char **tokens;  // tokens of a copy of line
+    int nb_option_tokens;
+    int first_pattern;  // in tokens
+    int nb_patterns;
+    char *approach;  // NULL when not provided
+
+    // Result slots of the query in the merged search, and its answer
+    int first_slot;
+    int nb_slots;
+    char *answer;
+    size_t answer_size;
+};
+
+struct server {
+    int fd;
+    int quit;
+    struct client clients[MAX_CLIENTS];
+    struct query *queue;
+    int nb_queued;
+    int queue_capacity;
+};
+
+static double now_ms() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1e3 + t.tv_usec / 1e3;
+}
+
+static int open_socket(char *socket_path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) ==
+            -1 ||
+        listen(fd, MAX_CLIENTS) == -1) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void free_query(struct query *q) {
+    free(q->line);
+    free(q->tokens);
+    free(q->answer);
+}
+
+// Finds out whether q can be merged with others, and with which ones
+static void classify_query(struct query *q) {
+    size_t max_tokens = strlen(q->line) / 2 + 2;
+    char *copy, *token, *saveptr;
+    char **argv, **args;
+    int nb_tokens = 0;
+    int argc;
+
+    q->mergeable = 0;
+
+    // The tokens point into a copy of the line stored after them
+    q->tokens = (char **)malloc(max_tokens * sizeof(char *) +
+                                strlen(q->line) + 1);
+    args = (char **)malloc((max_tokens + 1) * sizeof(char *));
+    if (q->tokens == NULL || args == NULL) {
+        free(args);
+        return;
+    }
+    copy = (char *)&q->tokens[max_tokens];
+    strcpy(copy, q->line);
+    for (token = strtok_r(copy, " \t", &saveptr); token != NULL;
+         token = strtok_r(NULL, " \t", &saveptr)) {
+        q->tokens[nb_tokens++] = token;
+    }
+
+    // Errors are left to the query itself, which will run alone
+    args[0] = "apm_parallel";
+    memcpy(&args[1], q->tokens, nb_tokens * sizeof(char *));
+    argc = nb_tokens + 1;
+    argv = args;
+    if (parse_options(&argc, &argv, &q->opts) || argc < 2) {
+        free(args);
+        return;
+    }
+    free(args);
+
+    q->nb_option_tokens = nb_tokens + 1 - argc;
+    q->approx_factor = atoi(q->tokens[q->nb_option_tokens]);
+    q->first_pattern = q->nb_option_tokens + 1;
+    q->nb_patterns = nb_tokens - q->first_pattern;
+    q->approach = NULL;
+    if (q->nb_patterns > 0 &&
+        (!strcmp(q->tokens[nb_tokens - 1], "DB_OVER_RANKS") ||
+         !strcmp(q->tokens[nb_tokens - 1], "PATTERNS_OVER_RANKS"))) {
+        q->approach = q->tokens[nb_tokens - 1];
+        q->nb_patterns--;
+    }
+
+    // Files and phase reports are per query: those run alone
+    q->mergeable = q->nb_patterns > 0 && q->opts.hits_file == NULL &&
+                   q->opts.pattern_file == NULL &&
+                   q->opts.trace_file == NULL && q->opts.phases == NULL &&
+                   q->opts.server_socket == NULL;
+}
+
+static int same_search(struct query *a, struct query *b) {
+    return a->approx_factor == b->approx_factor &&
+           a->opts.histogram == b->opts.histogram &&
+           a->opts.top_n == b->opts.top_n &&
+           a->opts.nb_strands == b->opts.nb_strands &&
+           a->opts.hamming == b->opts.hamming &&
+           (a->opts.cache_dir == NULL
+                ? b->opts.cache_dir == NULL
+                : b->opts.cache_dir != NULL &&
+                      !strcmp(a->opts.cache_dir, b->opts.cache_dir)) &&
+           (a->approach == NULL
+                ? b->approach == NULL
+                : b->approach != NULL && !strcmp(a->approach, b->approach));
+}
+
+static int enqueue(struct server *s, int client, char *line, size_t length) {
+    struct query *q;
+
+    if (s->nb_queued == s->queue_capacity) {
+        int capacity = s->queue_capacity ? 2 * s->queue_capacity : 64;
+        q = (struct query *)realloc(s->queue, capacity * sizeof(struct query));
+        if (q == NULL) {
+            fprintf(stderr, "Unable to queue %d queries\n", capacity);
+            return 1;
+        }
+        s->queue = q;
+        s->queue_capacity = capacity;
+    }
+
+    q = &s->queue[s->nb_queued];
+    memset(q, 0, sizeof(struct query));
+    q->client = client;
+    q->line = strndup(line, length);
+    if (q->line == NULL) {
+        return 1;
+    }
+    classify_query(q);
+    s->nb_queued++;
+    return 0;
+}
+
+// Forgets a client, and its queries that were not run yet
+static void drop_client(struct server *s, int client) {
+    int i, kept = 0;
+
+    close(s->clients[client].fd);
+    s->clients[client].fd = -1;
+    s->clients[client].input_size = 0;
+
+    for (i = 0; i < s->nb_queued; i++) {
+        if (s->queue[i].client == client) {
+            free_query(&s->queue[i]);
+        } else {
+            s->queue[kept++] = s->queue[i];
+        }
+    }
+    s->nb_queued = kept;
+}
+
+// Reads what the client sent; every complete line becomes a query
+static void read_client(struct server *s, int client) {
+    struct client *c = &s->clients[client];
+    size_t start = 0;
+    ssize_t length;
+    char *newline;
+
+    if (c->input_capacity - c->input_size < 4096) {
+        char *input = (char *)realloc(c->input, c->input_capacity + 4096);
+        if (input == NULL) {
+            drop_client(s, client);
+            return;
+        }
+        c->input = input;
+        c->input_capacity += 4096;
+    }
+
+    length = read(c->fd, c->input + c->input_size,
+                  c->input_capacity - c->input_size);
+    if (length <= 0) {
+        // The client is gone
+        drop_client(s, client);
+        return;
+    }
+    c->input_size += length;
+
+    while ((newline = memchr(c->input + start, '\n',
+                             c->input_size - start)) != NULL) {
+        char *line = c->input + start;
+        size_t line_length = newline - line;
+
+        start += line_length + 1;
+        while (line_length > 0 && line[line_length - 1] == '\r') {
+            line_length--;
+        }
+        if (line_length == 4 && !strncmp(line, "QUIT", 4)) {
+            s->quit = 1;
+        } else if (line_length > 0 &&
+                   enqueue(s, client, line, line_length)) {
+            drop_client(s, client);
+            return;
+        }
+    }
+    memmove(c->input, c->input + start, c->input_size - start);
+    c->input_size -= start;
+}
+
+// Rank 0: accepts clients and reads their queries until a batch is ready
+// (batch_size queries, or the first one waited window_ms). Returns 1 when
+// the server must stop.
+static int fill_queue(struct server *s, int batch_size, int window_ms) {
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int client_of[MAX_CLIENTS + 1];
+    double deadline = -1;
+
+    while (1) {
+        int nb_fds = 0;
+        int timeout = -1;
+        int i;
+
+        if (s->nb_queued > 0) {
+            if (deadline < 0) {
+                deadline = now_ms() + window_ms;
+            }
+            if (s->nb_queued >= batch_size || now_ms() >= deadline) {
+                return 0;
+            }
+            timeout = (int)(deadline - now_ms()) + 1;
+        } else if (s->quit) {
+            return 1;
+        }
+
+        if (!s->quit) {
+            fds[nb_fds].fd = s->fd;
+            fds[nb_fds].events = POLLIN;
+            client_of[nb_fds++] = -1;
+        }
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (s->clients[i].fd != -1) {
+                fds[nb_fds].fd = s->clients[i].fd;
+                fds[nb_fds].events = POLLIN;
+                client_of[nb_fds++] = i;
+            }
+        }
+
+        if (poll(fds, nb_fds, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+
+        for (i = 0; i < nb_fds; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (client_of[i] != -1) {
+                if (s->clients[client_of[i]].fd == fds[i].fd) {
+                    read_client(s, client_of[i]);
+                }
+                continue;
+            }
+
+            // A new client
+            int fd = accept(s->fd, NULL, NULL);
+            int c;
+            if (fd == -1) {
+                continue;
+            }
+            for (c = 0; c < MAX_CLIENTS && s->clients[c].fd != -1; c++) {
+            }
+            if (c == MAX_CLIENTS) {
+                fprintf(stderr, "Too many clients (%d)\n", MAX_CLIENTS);
+                close(fd);
+            } else {
+                s->clients[c].fd = fd;
+                s->clients[c].input_size = 0;
+            }
+        }
+    }
+}
+
+// Rank 0: takes the first queued query and the following ones that can run
+// in the same search, without reordering the queries of a client. Moves
+// them to batch[] and returns their number (-1 on error); *line is the
+// query to run.
+static int next_batch(struct server *s, int batch_size, struct query *batch,
+                      char **line) {
+    int blocked[MAX_CLIENTS] = {0};
+    struct query *first;
+    size_t length = 0;
+    int nb = 0, kept = 0, slot = 0;
+    int i, t;
+
+    for (i = 0; i < s->nb_queued; i++) {
+        struct query *q = &s->queue[i];
+
+        if (i == 0 || (nb < batch_size && batch[0].mergeable &&
+                       q->mergeable && !blocked[q->client] &&
+                       same_search(&batch[0], q))) {
+            batch[nb++] = *q;
+        } else {
+            blocked[q->client] = 1;
+            s->queue[kept++] = *q;
+        }
+    }
+    s->nb_queued = kept;
+    first = &batch[0];
+
+    if (nb == 1) {
+        first->first_slot = 0;
+        first->nb_slots = INT_MAX;
+        *line = strdup(first->line);
+        return *line == NULL ? -1 : 1;
+    }
+
+    // The options of the first query, all the patterns, then the approach
+    for (i = 0; i < nb; i++) {
+        length += strlen(batch[i].line) + 1;
+    }
+    *line = (char *)malloc(length + 1);
+    if (*line == NULL) {
+        return -1;
+    }
+    (*line)[0] = '\0';
+    for (t = 0; t <= first->nb_option_tokens; t++) {
+        strcat(*line, first->tokens[t]);
+        strcat(*line, " ");
+    }
+    for (i = 0; i < nb; i++) {
+        for (t = 0; t < batch[i].nb_patterns; t++) {
+            strcat(*line, batch[i].tokens[batch[i].first_pattern + t]);
+            strcat(*line, " ");
+        }
+        batch[i].first_slot = slot;
+        batch[i].nb_slots = batch[i].nb_patterns * first->opts.nb_strands;
+        slot += batch[i].nb_slots;
+    }
+    if (first->approach != NULL) {
+        strcat(*line, first->approach);
+    }
+    return nb;
+}
+
+// Appends a line of output to the answer of q. In a merged search, the
+// header announcing the number of patterns gets the number of q.
+static void answer_line(struct query *q, char *line, size_t length,
+                        FILE *answer, int merged) {
+    char *count = merged ? strstr(line, "looking for ") : NULL;
+
+    if (count != NULL && count < line + length) {
+        char *end;
+
+        count += strlen("looking for ");
+        strtol(count, &end, 10);
+        fwrite(line, 1, count - line, answer);
+        fprintf(answer, "%d", q->nb_patterns);
+        fwrite(end, 1, line + length - end, answer);
+    } else {
+        fwrite(line, 1, length, answer);
+    }
+}
+
+/* Splits the output of a search between the queries of its batch. Rank 0
+ * prints one line per result slot for each kind of result, in slot order:
+ * the n-th line of a kind goes to the query owning slot n. The other lines
+ * (header, timing) go to every query. */
+static void split_output(char *output, size_t size, struct query *batch,
+                         int nb) {
+    static const char *kinds[] = {"Number of matches for pattern <",
+                                  "Matches per distance for pattern <",
+                                  "Best "};
+    int nb_kinds = sizeof(kinds) / sizeof(kinds[0]);
+    int seen[3] = {0, 0, 0};
+    FILE *answer[nb];
+    char *line = output;
+    int i, k;
+
+    for (i = 0; i < nb; i++) {
+        answer[i] = open_memstream(&batch[i].answer, &batch[i].answer_size);
+    }
+
+    while (line < output + size) {
+        char *newline = memchr(line, '\n', output + size - line);
+        size_t length = newline != NULL ? (size_t)(newline - line + 1)
+                                        : (size_t)(output + size - line);
+
+        for (k = 0; k < nb_kinds; k++) {
+            if (!strncmp(line, kinds[k], strlen(kinds[k]))) {
+                break;
+            }
+        }
+
+        for (i = 0; i < nb; i++) {
+            if (answer[i] == NULL) {
+                continue;
+            }
+            if (k == nb_kinds) {
+                answer_line(&batch[i], line, length, answer[i], nb > 1);
+            } else if (seen[k] >= batch[i].first_slot &&
+                       seen[k] - batch[i].first_slot < batch[i].nb_slots) {
+                fwrite(line, 1, length, answer[i]);
+            }
+        }
+        if (k < nb_kinds) {
+            seen[k]++;
+        }
+        line += length;
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (answer[i] != NULL) {
+            fprintf(answer[i], "END\n");
+            fclose(answer[i]);
+        }
+    }
+}
+
+static int write_all(int fd, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+// Rank 0: reads back what the search printed (in the capture file) and
+// answers every query of the batch
+static void send_answers(struct server *s, int capture, struct query *batch,
+                         int nb) {
+    off_t size = lseek(capture, 0, SEEK_END);
+    char *output = (char *)malloc(size + 1);
+    size_t done = 0;
+    int i;
+
+    if (output != NULL) {
+        lseek(capture, 0, SEEK_SET);
+        while (done < (size_t)size) {
+            ssize_t r = read(capture, output + done, size - done);
+            if (r <= 0) {
+                break;
+            }
+            done += r;
+        }
+        split_output(output, done, batch, nb);
+        free(output);
+    }
+
+    for (i = 0; i < nb; i++) {
+        int c = batch[i].client;
+
+        if (s->clients[c].fd != -1 &&
+            (batch[i].answer == NULL ||
+             write_all(s->clients[c].fd, batch[i].answer,
+                       batch[i].answer_size))) {
+            drop_client(s, c);
+        }
+        free_query(&batch[i]);
+    }
+}
+
+// Rank 0: answers every query of a batch that cannot run with error
+static void fail_batch(struct server *s, struct query *batch, int nb,
+                       char *error) {
+    char answer[256];
+    int size = snprintf(answer, sizeof(answer), "%s\nEND\n", error);
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        int c = batch[i].client;
+
+        if (s->clients[c].fd != -1 &&
+            write_all(s->clients[c].fd, answer, size)) {
+            drop_client(s, c);
+        }
+        free_query(&batch[i]);
+    }
+}
+
+// All ranks: runs a query line on the resident database (with the result
+// cache of the server, unless the query has its own)
+static int run_line(char *line, char *filename, char *cache_dir, int rank,
+                    int world_size, int accelerator, struct apm_database *db) {
+    struct apm_options opts;
+    char **args, **argv, **query_argv;
+    char *token, *saveptr;
+    int argc = 1;
+    int i, res;
+
+    // At most one argument every 2 characters, + program name and database
+    args = (char **)malloc((strlen(line) / 2 + 4) * sizeof(char *));
+    query_argv = (char **)malloc((strlen(line) / 2 + 4) * sizeof(char *));
+    if (args == NULL || query_argv == NULL) {
+        fprintf(stderr, "Unable to allocate the arguments of a query\n");
+        free(args);
+        free(query_argv);
+        return 1;
+    }
+    argv = args;  // parse_options moves argv
+
+    argv[0] = "apm_parallel";
+    for (token = strtok_r(line, " \t", &saveptr); token != NULL;
+         token = strtok_r(NULL, " \t", &saveptr)) {
+        argv[argc++] = token;
+    }
+    argv[argc] = NULL;
+    query_argv[0] = argv[0];
+
+    // The backend of the ranks is chosen when the server starts, and a
+    // query is never long enough to be checkpointed
+    if (parse_options(&argc, &argv, &opts) || argc < 2 ||
+        opts.server_socket != NULL || opts.backend != NULL ||
+        opts.checkpoint != NULL) {
+        if (rank == 0) {
+            print_usage(argv[0]);
+        }
+        free(args);
+        free(query_argv);
+        return 1;
+    }
+
+    if (opts.cache_dir == NULL) {
+        opts.cache_dir = cache_dir;
+    }
+
+    // The approaches expect the database in argv[2]
+    query_argv[1] = argv[1];
+    query_argv[2] = filename;
+    for (i = 2; i <= argc; i++) {
+        query_argv[i + 1] = argv[i];
+    }
+
+    res = run_query(argc + 1, query_argv, &opts, rank, world_size, accelerator,
+                    db);
+
+    free(args);
+    free(query_argv);
+    return res;
+}
+
+int serve(struct apm_options *opts, char *filename, int rank, int world_size,
+          int accelerator) {
+    struct apm_database db;
+    struct server s;
+    struct query *batch = NULL;
+    char *line = NULL;
+    int length = 0;
+    int capture = -1;
+    int mpi_call_result;
+    int i;
+
+    if (bcast_database(filename, rank, &db)) {
+        return 1;
+    }
+
+    memset(&s, 0, sizeof(struct server));
+    s.fd = -1;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        s.clients[i].fd = -1;
+    }
+
+    if (rank == 0) {
+        // A client leaving early must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+
+        // What rank 0 prints during a search is split between the queries
+        FILE *capture_file = tmpfile();
+        batch =
+            (struct query *)malloc(opts->batch_size * sizeof(struct query));
+        if (capture_file != NULL && batch != NULL) {
+            capture = dup(fileno(capture_file));
+            s.fd = open_socket(opts->server_socket);
+        }
+        if (capture_file != NULL) {
+            fclose(capture_file);
+        }
+        if (s.fd != -1) {
+            printf("Serving %s (%d bytes) on %s with %d ranks\n", filename,
+                   db.n_bytes, opts->server_socket, world_size);
+            fflush(stdout);
+        }
+    }
+
+    while (1) {
+        int nb = 0;
+
+        if (rank == 0) {
+            free(line);
+            line = NULL;
+            length = -1;
+            if (s.fd != -1 && capture != -1 &&
+                !fill_queue(&s, opts->batch_size, opts->batch_window_ms)) {
+                nb = next_batch(&s, opts->batch_size, batch, &line);
+                length = nb > 0 ? (int)strlen(line) : -1;
+            }
+
+            // The capture file is emptied before the ranks get the batch:
+            // its answers would get the output of the previous one otherwise
+            if (nb > 0 && (ftruncate(capture, 0) == -1 ||
+                           lseek(capture, 0, SEEK_SET) == -1)) {
+                perror("Unable to empty the output capture");
+                fail_batch(&s, batch, nb,
+                           "Error: unable to run the query on the server");
+                continue;
+            }
+        }
+
+        // Every rank gets the query line
+        mpi_call_result = MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (mpi_call_result != MPI_SUCCESS) {
+            printf("MPI Error: %d\n", mpi_call_result);
+            return 1;
+        }
+        if (length < 0) {
+            break;
+        }
+        if (rank != 0) {
+            free(line);
+            line = (char *)malloc(length + 1);
+            if (line == NULL) {
+                fprintf(stderr, "Unable to allocate a query of %d bytes\n",
+                        length);
+                return 1;
+            }
+        }
+        mpi_call_result =
+            MPI_Bcast(line, length + 1, MPI_CHAR, 0, MPI_COMM_WORLD);
+        if (mpi_call_result != MPI_SUCCESS) {
+            printf("MPI Error: %d\n", mpi_call_result);
+            return 1;
+        }
+
+#if SERVER_DEBUG
+        if (rank == 0) {
+            fprintf(stderr, "Batch of %d query(ies): %s\n", nb, line);
+        }
+#endif
+
+        // The output of rank 0 goes to the capture file
+        int saved_stdout = -1;
+        if (rank == 0) {
+            fflush(stdout);
+            saved_stdout = dup(STDOUT_FILENO);
+            dup2(capture, STDOUT_FILENO);
+        }
+
+        run_line(line, filename, opts->cache_dir, rank, world_size,
+                 accelerator, &db);
+
+        if (rank == 0) {
+            fflush(stdout);
+            dup2(saved_stdout, STDOUT_FILENO);
+            close(saved_stdout);
+            send_answers(&s, capture, batch, nb);
+        }
+    }
+
+    if (rank == 0) {
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (s.clients[i].fd != -1) {
+                drop_client(&s, i);
+            }
+            free(s.clients[i].input);
+        }
+        for (i = 0; i < s.nb_queued; i++) {
+            free_query(&s.queue[i]);
+        }
+        free(s.queue);
+        free(batch);
+        if (capture != -1) {
+            close(capture);
+        }
+        if (s.fd != -1) {
+            close(s.fd);
+            unlink(opts->server_socket);
+        }
+    }
+    free(line);
+    free_huge(db.buf);
+    return s.fd == -1 && rank == 0;
+}
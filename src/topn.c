@@ -0,0 +1,99 @@
+#include "topn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// a is worse than b: farther, or as far but later in the database
+#define WORSE(a, b)                 \
+    ((a).distance != (b).distance ? \
+         (a).distance > (b).distance : (a).offset > (b).offset)
+
+int topn_init(struct topn *t, int size) {
+    t->heap = (struct best_match *)malloc(size * sizeof(struct best_match));
+    if (t->heap == NULL) {
+        fprintf(stderr, "Error: unable to allocate a top-%d heap\n", size);
+        return 1;
+    }
+    t->count = 0;
+    t->size = size;
+    return 0;
+}
+
+void topn_free(struct topn *t) {
+    free(t->heap);
+    t->heap = NULL;
+    t->count = 0;
+}
+
+static void sift_down(struct best_match *heap, int count, int i) {
+    struct best_match tmp;
+
+    while (2 * i + 1 < count) {
+        int child = 2 * i + 1;
+
+        if (child + 1 < count && WORSE(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!WORSE(heap[child], heap[i])) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+void topn_add(struct topn *t, int distance, int offset) {
+    struct best_match m;
+    int i;
+
+    m.distance = distance;
+    m.offset = offset;
+
+    if (t->count < t->size) {
+        // Sift up the new leaf
+        i = t->count++;
+        while (i > 0 && WORSE(m, t->heap[(i - 1) / 2])) {
+            t->heap[i] = t->heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        t->heap[i] = m;
+    } else if (t->size > 0 && WORSE(t->heap[0], m)) {
+        // Replace the worst kept window
+        t->heap[0] = m;
+        sift_down(t->heap, t->count, 0);
+    }
+}
+
+void topn_merge(struct topn *dst, struct topn *src) {
+    int i;
+
+    for (i = 0; i < src->count; i++) {
+        topn_add(dst, src->heap[i].distance, src->heap[i].offset);
+    }
+}
+
+// Heapsort in place: afterwards heap[] is ordered from the best window
+void topn_sort(struct topn *t) {
+    struct best_match tmp;
+    int n;
+
+    for (n = t->count - 1; n > 0; n--) {
+        tmp = t->heap[0];
+        t->heap[0] = t->heap[n];
+        t->heap[n] = tmp;
+        sift_down(t->heap, n, 0);
+    }
+}
+
+void print_topn(char *pattern, const char *strand, struct topn *t) {
+    int i;
+
+    printf("Best %d match(es) for pattern <%.100s>%s:", t->count, pattern,
+           strand);
+    for (i = 0; i < t->count; i++) {
+        printf(" %d(%d)", t->heap[i].offset, t->heap[i].distance);
+    }
+    printf("\n");
+}
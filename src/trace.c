@@ -0,0 +1,310 @@
+#include "trace.h"
+
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_ALIGNMENT 64
+
+static const char *event_names[NB_TRACE_NAMES] = {
+    "load", "distribute", "wait", "scan", "gpu", "collect", "pattern", "chunk"};
+static const char *event_categories[NB_TRACE_NAMES] = {
+    "io", "mpi", "mpi", "cpu", "gpu", "mpi", "cpu", "cpu"};
+
+struct trace_event {
+    double begin;  // seconds since trace_reset()
+    double end;
+    int name;
+    int arg;
+    int thread;
+    int padding;
+    long long first;  // of a chunk (count > 0)
+    long long count;
+};
+
+// The ring of a thread, alone on its cache line
+struct ring {
+    struct trace_event *events;  // TRACE_RING_SIZE
+    long nb_recorded;
+    char padding[TRACE_ALIGNMENT - sizeof(struct trace_event *) -
+                 sizeof(long)];
+};
+
+// What a rank sends to rank 0 before its events
+struct rank_summary {
+    int nb_events;
+    int nb_threads;
+    long nb_dropped;
+};
+
+static struct {
+    const char *file;
+    int enabled;
+    double start;
+    int nb_threads;
+    struct ring *rings;
+} tracer;
+
+static int alloc_rings(int nb_threads) {
+    void *rings;
+    int t;
+
+    if (posix_memalign(&rings, TRACE_ALIGNMENT,
+                       nb_threads * sizeof(struct ring))) {
+        return 1;
+    }
+    tracer.rings = (struct ring *)rings;
+    memset(tracer.rings, 0, nb_threads * sizeof(struct ring));
+    tracer.nb_threads = nb_threads;
+    for (t = 0; t < nb_threads; t++) {
+        tracer.rings[t].events = (struct trace_event *)malloc(
+            TRACE_RING_SIZE * sizeof(struct trace_event));
+        if (tracer.rings[t].events == NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void free_rings(void) {
+    int t;
+
+    for (t = 0; t < tracer.nb_threads; t++) {
+        free(tracer.rings[t].events);
+    }
+    free(tracer.rings);
+    tracer.rings = NULL;
+    tracer.nb_threads = 0;
+}
+
+int trace_reset(const char *file) {
+    int nb_threads = omp_get_max_threads();
+    int t;
+
+    tracer.file = file;
+    tracer.enabled = 0;
+    if (file == NULL) {
+        return 0;
+    }
+
+    // The rings live as long as the process (one trace per query in server
+    // mode)
+    if (tracer.nb_threads != nb_threads) {
+        free_rings();
+        if (alloc_rings(nb_threads)) {
+            fprintf(stderr,
+                    "Error: unable to allocate the trace of %d threads\n",
+                    nb_threads);
+            free_rings();
+        }
+    }
+    for (t = 0; t < tracer.nb_threads; t++) {
+        tracer.rings[t].nb_recorded = 0;
+    }
+
+    // Every rank starts its clock at the same time
+    MPI_Barrier(MPI_COMM_WORLD);
+    tracer.start = omp_get_wtime();
+    tracer.enabled = tracer.nb_threads > 0;
+    return !tracer.enabled;
+}
+
+static void record(enum trace_name name, double begin, double end, int arg,
+                   long long first, long long count) {
+    struct trace_event *event;
+    struct ring *ring;
+    int t;
+
+    if (!tracer.enabled) {
+        return;
+    }
+    t = omp_get_thread_num();
+    if (t >= tracer.nb_threads) {
+        return;
+    }
+    ring = &tracer.rings[t];
+    event = &ring->events[ring->nb_recorded % TRACE_RING_SIZE];
+    ring->nb_recorded++;
+
+    event->begin = begin - tracer.start;
+    event->end = end - tracer.start;
+    event->name = name;
+    event->arg = arg;
+    event->thread = t;
+    event->first = first;
+    event->count = count;
+}
+
+void trace_record(enum trace_name name, double begin, double end, int arg) {
+    record(name, begin, end, arg, -1, 0);
+}
+
+void trace_record_chunk(double begin, double end, int arg, long long first,
+                        long long count) {
+    record(TRACE_CHUNK, begin, end, arg, first, count);
+}
+
+/* The events of all my threads, oldest first in each ring. Returns NULL if
+ * there are none or they cannot be allocated. */
+static struct trace_event *collect_events(struct rank_summary *summary) {
+    struct trace_event *events;
+    int t, i;
+
+    summary->nb_events = 0;
+    summary->nb_threads = tracer.enabled ? tracer.nb_threads : 0;
+    summary->nb_dropped = 0;
+    for (t = 0; t < summary->nb_threads; t++) {
+        long nb = tracer.rings[t].nb_recorded;
+
+        summary->nb_events += nb < TRACE_RING_SIZE ? nb : TRACE_RING_SIZE;
+        summary->nb_dropped += nb < TRACE_RING_SIZE ? 0 : nb - TRACE_RING_SIZE;
+    }
+
+    events = (struct trace_event *)malloc(
+        (summary->nb_events + 1) * sizeof(struct trace_event));
+    if (events == NULL) {
+        fprintf(stderr, "Error: unable to allocate memory for the trace\n");
+        summary->nb_events = 0;
+        return NULL;
+    }
+
+    i = 0;
+    for (t = 0; t < summary->nb_threads; t++) {
+        struct ring *ring = &tracer.rings[t];
+        long first = ring->nb_recorded < TRACE_RING_SIZE
+                         ? 0
+                         : ring->nb_recorded - TRACE_RING_SIZE;
+        long e;
+
+        for (e = first; e < ring->nb_recorded; e++) {
+            events[i++] = ring->events[e % TRACE_RING_SIZE];
+        }
+    }
+    return events;
+}
+
+static void write_event(FILE *f, int rank, struct trace_event *event) {
+    fprintf(f,
+            ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+            event_names[event->name], event_categories[event->name], rank,
+            event->thread, event->begin * 1e6,
+            (event->end - event->begin) * 1e6);
+    if (event->count > 0) {
+        fprintf(f, ", \"args\": {");
+        if (event->arg >= 0) {
+            fprintf(f, "\"pattern\": %d, ", event->arg);
+        }
+        fprintf(f, "\"first\": %lld, \"count\": %lld}", event->first,
+                event->count);
+    } else if (event->arg >= 0) {
+        fprintf(f, ", \"args\": {\"pattern\": %d}", event->arg);
+    }
+    fprintf(f, "}");
+}
+
+static int write_file(struct rank_summary *summaries,
+                      struct trace_event *events, int world_size) {
+    FILE *f;
+    long nb_dropped = 0;
+    int r, t, i = 0;
+
+    f = fopen(tracer.file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open the trace file <%s>\n", tracer.file);
+        return 1;
+    }
+
+    // One process per rank, one track per thread
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (r = 0; r < world_size; r++) {
+        fprintf(f,
+                "%s{\"name\": \"process_name\", \"ph\": \"M\", "
+                "\"pid\": %d, \"args\": {\"name\": \"rank %d\"}}",
+                r > 0 ? ",\n" : "", r, r);
+        fprintf(f,
+                ",\n{\"name\": \"process_sort_index\", \"ph\": \"M\", "
+                "\"pid\": %d, \"args\": {\"sort_index\": %d}}",
+                r, r);
+        for (t = 0; t < summaries[r].nb_threads; t++) {
+            fprintf(f,
+                    ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": %d, \"tid\": %d, "
+                    "\"args\": {\"name\": \"thread %d\"}}",
+                    r, t, t);
+        }
+        for (t = 0; t < summaries[r].nb_events; t++) {
+            write_event(f, r, &events[i++]);
+        }
+        nb_dropped += summaries[r].nb_dropped;
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f)) {
+        fprintf(stderr, "Unable to write the trace file <%s>\n", tracer.file);
+        return 1;
+    }
+    if (nb_dropped > 0) {
+        fprintf(stderr,
+                "Trace: %ld event(s) overwritten (%d per thread at most)\n",
+                nb_dropped, TRACE_RING_SIZE);
+    }
+    return 0;
+}
+
+int trace_write(int rank, int world_size) {
+    struct rank_summary mine;
+    struct rank_summary *summaries = NULL;
+    struct trace_event *my_events, *events = NULL;
+    int *counts = NULL, *offsets = NULL;
+    int r, failed = 0;
+
+    my_events = collect_events(&mine);
+
+    if (rank == 0) {
+        summaries = (struct rank_summary *)malloc(world_size *
+                                                  sizeof(struct rank_summary));
+        counts = (int *)malloc(world_size * sizeof(int));
+        offsets = (int *)malloc(world_size * sizeof(int));
+        failed = summaries == NULL || counts == NULL || offsets == NULL;
+    }
+    MPI_Gather(&mine, sizeof(struct rank_summary), MPI_BYTE, summaries,
+               sizeof(struct rank_summary), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    if (rank == 0 && !failed) {
+        int nb_events = 0;
+
+        for (r = 0; r < world_size; r++) {
+            counts[r] = summaries[r].nb_events * sizeof(struct trace_event);
+            offsets[r] = nb_events * sizeof(struct trace_event);
+            nb_events += summaries[r].nb_events;
+        }
+        events = (struct trace_event *)malloc((nb_events + 1) *
+                                              sizeof(struct trace_event));
+        failed = events == NULL;
+        if (failed) {
+            // Nothing is received
+            memset(counts, 0, world_size * sizeof(int));
+        }
+    }
+    MPI_Gatherv(my_events, mine.nb_events * sizeof(struct trace_event),
+                MPI_BYTE, events, counts, offsets, MPI_BYTE, 0,
+                MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        if (failed) {
+            fprintf(stderr, "Error: unable to allocate memory for the trace\n");
+        } else {
+            failed = write_file(summaries, events, world_size);
+        }
+    }
+
+    free(my_events);
+    free(events);
+    free(summaries);
+    free(counts);
+    free(offsets);
+    return failed;
+}
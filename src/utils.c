@@ -5,11 +5,129 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-char *read_input_file(char *filename, int *size) {
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The buffers mapped on explicit huge pages, to unmap them in free_huge()
+#define MAX_HUGE_MAPPINGS 64
+
+static struct {
+    void *address;
+    size_t size;
+} huge_mappings[MAX_HUGE_MAPPINGS];
+
+static const char *huge_page_mode = "4 KiB pages";
+
+// Transparent huge pages are on, or on request (madvise)
+static int thp_available(void) {
+    char line[128] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    if (fgets(line, sizeof(line), f) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(f);
+    return strstr(line, "[never]") == NULL && line[0] != '\0';
+}
+
+// Allocates size bytes on 2 MiB pages when possible: explicit huge pages
+// (reserved in /proc/sys/vm/nr_hugepages), else transparent huge pages, else
+// regular pages. Small buffers always get regular pages. Freed with
+// free_huge().
+char *alloc_huge(size_t size) {
+    void *buf;
+    int i;
+
+    if (size < HUGE_PAGE_SIZE) {
+        return (char *)malloc(size > 0 ? size : 1);
+    }
+    // APM_HUGE_PAGES=0 keeps regular pages (to compare)
+    if (getenv("APM_HUGE_PAGES") != NULL &&
+        !strcmp(getenv("APM_HUGE_PAGES"), "0")) {
+        huge_page_mode = "4 KiB pages (APM_HUGE_PAGES=0)";
+        return (char *)malloc(size);
+    }
+
+    for (i = 0; i < MAX_HUGE_MAPPINGS && huge_mappings[i].address != NULL;
+         i++) {
+    }
+    if (i < MAX_HUGE_MAPPINGS) {
+        size_t mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                        HUGE_PAGE_SIZE;
+
+        buf = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED) {
+            huge_mappings[i].address = buf;
+            huge_mappings[i].size = mapped;
+            huge_page_mode = "explicit 2 MiB huge pages";
+            return (char *)buf;
+        }
+    }
+
+    // Aligned on a huge page, so that the kernel can back it with them
+    if (posix_memalign(&buf, HUGE_PAGE_SIZE, size)) {
+        return NULL;
+    }
+    if (thp_available() && madvise(buf, size, MADV_HUGEPAGE) == 0) {
+        huge_page_mode = "transparent 2 MiB huge pages";
+    } else {
+        huge_page_mode = "4 KiB pages";
+    }
+    return (char *)buf;
+}
+
+void free_huge(char *buf) {
+    int i;
+
+    for (i = 0; buf != NULL && i < MAX_HUGE_MAPPINGS; i++) {
+        if (huge_mappings[i].address == buf) {
+            munmap(buf, huge_mappings[i].size);
+            huge_mappings[i].address = NULL;
+            return;
+        }
+    }
+    free(buf);
+}
+
+// A buffer of alloc_huge(), written first by the OpenMP threads, each its own
+// contiguous share, like the static split of the windows between them: with
+// the first-touch policy, the pages of a share land on the NUMA node of the
+// thread that searches it, instead of all on the node of the master thread.
+char *alloc_database(size_t size) {
+    char *buf = alloc_huge(size);
+    long page;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (page = 0; page < (long)((size + PAGE_SIZE - 1) / PAGE_SIZE); page++) {
+        buf[page * PAGE_SIZE] = 0;
+    }
+
+    if (size >= HUGE_PAGE_SIZE) {
+        fprintf(stderr, "Database of %.1f MB on %s\n", size / 1e6,
+                huge_page_mode);
+    }
+    return buf;
+}
+
+// Reads a whole file into a buffer of alloc()
+static char *read_file(char *filename, int *size, char *(*alloc)(size_t)) {
     char *buf;
     off_t fsize;
     int fd = 0;
@@ -30,7 +148,7 @@ char *read_input_file(char *filename, int *size) {
     }
 
 #if APM_DEBUG
-    printf("File length: %lld\n", fsize);
+    printf("File length: %lld\n", (long long)fsize);
 #endif
 
     /* Go back to the beginning of the input file */
@@ -40,10 +158,10 @@ char *read_input_file(char *filename, int *size) {
     }
 
     /* Allocate data to copy the target text */
-    buf = (char *)malloc(fsize * sizeof(char));
+    buf = alloc(fsize * sizeof(char));
     if (buf == NULL) {
         fprintf(stderr, "Unable to allocate %lld byte(s) for main array\n",
-                fsize);
+                (long long)fsize);
         return NULL;
     }
 
@@ -52,7 +170,7 @@ char *read_input_file(char *filename, int *size) {
         fprintf(
             stderr,
             "Unable to copy %lld byte(s) from text file (%d byte(s) copied)\n",
-            fsize, n_bytes);
+            (long long)fsize, n_bytes);
         return NULL;
     }
 
@@ -67,6 +185,16 @@ char *read_input_file(char *filename, int *size) {
     return buf;
 }
 
+static char *alloc_heap(size_t size) { return (char *)malloc(size); }
+
+char *read_input_file(char *filename, int *size) {
+    return read_file(filename, size, alloc_heap);
+}
+
+char *read_database(char *filename, int *size) {
+    return read_file(filename, size, alloc_database);
+}
+
 // If I replace all the code of the function with {usleep(1); return 1;} we can
 // notice that the time of execution of the program with 1 or more patterns is
 // the same (if the number of patterns is < of threads). I suspect that compiler
@@ -97,3 +225,289 @@ int levenshtein(char *s1, char *s2, int len, int *column) {
     return (column[len]);
 #endif
 }
+
+// Same as levenshtein(), but gives up as soon as the distance is known to be
+// greater than max (and returns max + 1): the minimum of a column never
+// decreases from one column to the next, and the distance is in the last one.
+int levenshtein_bounded(char *s1, char *s2, int len, int *column, int max) {
+    unsigned int x, y, lastdiag, olddiag, column_min;
+
+    for (y = 1; y <= len; y++) {
+        column[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        column[0] = x;
+        column_min = x;
+        lastdiag = x - 1;
+        for (y = 1; y <= len; y++) {
+            olddiag = column[y];
+            column[y] = MIN3(column[y] + 1, column[y - 1] + 1,
+                             lastdiag + (s1[y - 1] == s2[x - 1] ? 0 : 1));
+            lastdiag = olddiag;
+            if (column[y] < column_min) {
+                column_min = column[y];
+            }
+        }
+        if (column_min > max) {
+            return max + 1;
+        }
+    }
+    return (column[len]);
+}
+
+// Distances of a pattern (s1) and of its reverse complement (s1_rc) to the
+// same window: both columns are updated in the same pass, so each character
+// of the window is loaded once. Like levenshtein_bounded(), a strand stops
+// as soon as it is farther than max (distance max + 1).
+// column must hold 2 * (len + 1) ints.
+void levenshtein_strands(char *s1, char *s1_rc, char *s2, int len, int *column,
+                         int max, int *distances) {
+    unsigned int x, y, lastdiag, olddiag, lastdiag_rc, olddiag_rc;
+    unsigned int column_min, column_min_rc;
+    int *column_rc = column + len + 1;
+    char c;
+
+    for (y = 1; y <= len; y++) {
+        column[y] = y;
+        column_rc[y] = y;
+    }
+    for (x = 1; x <= len; x++) {
+        c = s2[x - 1];
+        column[0] = x;
+        column_rc[0] = x;
+        column_min = x;
+        column_min_rc = x;
+        lastdiag = x - 1;
+        lastdiag_rc = x - 1;
+        for (y = 1; y <= len; y++) {
+            olddiag = column[y];
+            column[y] = MIN3(column[y] + 1, column[y - 1] + 1,
+                             lastdiag + (s1[y - 1] == c ? 0 : 1));
+            lastdiag = olddiag;
+            if (column[y] < column_min) {
+                column_min = column[y];
+            }
+
+            olddiag_rc = column_rc[y];
+            column_rc[y] = MIN3(column_rc[y] + 1, column_rc[y - 1] + 1,
+                                lastdiag_rc + (s1_rc[y - 1] == c ? 0 : 1));
+            lastdiag_rc = olddiag_rc;
+            if (column_rc[y] < column_min_rc) {
+                column_min_rc = column_rc[y];
+            }
+        }
+        if (column_min > max && column_min_rc > max) {
+            distances[0] = max + 1;
+            distances[1] = max + 1;
+            return;
+        }
+    }
+    distances[0] = column[len] <= max ? column[len] : max + 1;
+    distances[1] = column_rc[len] <= max ? column_rc[len] : max + 1;
+}
+
+// The kernels specialized by length class: distances never exceed the
+// length of the pattern + 1, so 8-bit cells are enough up to 254
+#define LEV_CELL unsigned char
+
+#define LEV_LENGTH 16
+#define LEV_NAME(f) f##_16
+#include "levenshtein_class.h"
+#undef LEV_LENGTH
+#undef LEV_NAME
+
+#define LEV_LENGTH 32
+#define LEV_NAME(f) f##_32
+#include "levenshtein_class.h"
+#undef LEV_LENGTH
+#undef LEV_NAME
+
+#define LEV_LENGTH 64
+#define LEV_NAME(f) f##_64
+#include "levenshtein_class.h"
+#undef LEV_LENGTH
+#undef LEV_NAME
+
+#define LEV_LENGTH 128
+#define LEV_NAME(f) f##_128
+#include "levenshtein_class.h"
+#undef LEV_LENGTH
+#undef LEV_NAME
+
+#undef LEV_CELL
+
+static enum kernel_set kernel_set = KERNELS_SIMD;
+
+int kernels_supported(enum kernel_set set) {
+    switch (set) {
+        case KERNELS_SCALAR:
+        case KERNELS_SIMD:
+            return 1;
+        case KERNELS_AVX2:
+#if defined(__x86_64__) || defined(__i386__)
+            return __builtin_cpu_supports("avx2");
+#else
+            return 0;
+#endif
+    }
+    return 0;
+}
+
+void kernels_use(enum kernel_set set) { kernel_set = set; }
+
+void levenshtein_select(int len, struct levenshtein_kernels *k) {
+    if (kernel_set == KERNELS_SCALAR) {
+        k->distance = levenshtein;
+        k->bounded = levenshtein_bounded;
+        k->strands = levenshtein_strands;
+    } else if (len <= 16) {
+        k->distance = levenshtein_16;
+        k->bounded = levenshtein_bounded_16;
+        k->strands = levenshtein_strands_16;
+    } else if (len <= 32) {
+        k->distance = levenshtein_32;
+        k->bounded = levenshtein_bounded_32;
+        k->strands = levenshtein_strands_32;
+    } else if (len <= 64) {
+        k->distance = levenshtein_64;
+        k->bounded = levenshtein_bounded_64;
+        k->strands = levenshtein_strands_64;
+    } else if (len <= 128) {
+        k->distance = levenshtein_128;
+        k->bounded = levenshtein_bounded_128;
+        k->strands = levenshtein_strands_128;
+    } else {
+        // Generic: int cells in the column of the caller
+        k->distance = levenshtein;
+        k->bounded = levenshtein_bounded;
+        k->strands = levenshtein_strands;
+    }
+}
+
+typedef unsigned char hamming_vec __attribute__((vector_size(HAMMING_LANES)));
+
+// The full windows of [j, end), HAMMING_LANES at a time: for each character
+// of the pattern, one compare of HAMMING_LANES consecutive bytes of buf, and
+// the mismatch lanes (-1) are subtracted from the counters. Returns the first
+// window left to the scalar loop. Inlined in one function per instruction set.
+static inline __attribute__((always_inline)) int hamming_lanes(
+    char *pattern, int len, char *buf, int n_bytes, int first, int j, int end,
+    int max, int *distances) {
+    int y, l;
+
+    // The byte counters hold up to 255, and a block of characters starts
+    // from max + 1 after a cap: a max of 254 or more takes the scalar path
+    for (; max < 254 && j + HAMMING_LANES <= end &&
+           j + HAMMING_LANES - 1 + len <= n_bytes;
+         j += HAMMING_LANES) {
+        hamming_vec counters = {0};
+        hamming_vec window, over;
+        int block = 254;  // the first one starts from 0
+
+        for (y = 0; y < len;) {
+            // Cap the counters before they can wrap around
+            int block_end = y + block < len ? y + block : len;
+            for (; y < block_end; y++) {
+                memcpy(&window, &buf[j + y], HAMMING_LANES);
+                counters -=
+                    (hamming_vec)(window != (unsigned char)pattern[y]);
+            }
+            over = (hamming_vec)(counters > (unsigned char)max);
+            counters = (counters & ~over) | ((unsigned char)(max + 1) & over);
+
+            // The next ones may start from max + 1: they stay <= 255
+            block = 254 - max;
+        }
+        for (l = 0; l < HAMMING_LANES; l++) {
+            distances[j - first + l] = counters[l];
+        }
+    }
+    return j;
+}
+
+static int hamming_lanes_simd(char *pattern, int len, char *buf, int n_bytes,
+                              int first, int j, int end, int max,
+                              int *distances) {
+    return hamming_lanes(pattern, len, buf, n_bytes, first, j, end, max,
+                         distances);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// One 32-byte compare per character instead of two of 16 (SSE2)
+__attribute__((target("avx2"))) static int hamming_lanes_avx2(
+    char *pattern, int len, char *buf, int n_bytes, int first, int j, int end,
+    int max, int *distances) {
+    return hamming_lanes(pattern, len, buf, n_bytes, first, j, end, max,
+                         distances);
+}
+#endif
+
+// Number of mismatches between the pattern and the windows [first, first +
+// count) (a window near the end of buf is shorter than the pattern), capped
+// at max + 1 like levenshtein_bounded().
+void hamming_windows(char *pattern, int len, char *buf, int n_bytes, int first,
+                     int count, int max, int *distances) {
+    int end = first + count;
+    int j = first;
+    int x;
+
+    // No window is farther than len
+    if (max > len) {
+        max = len;
+    }
+    switch (kernel_set) {
+        case KERNELS_SCALAR:
+            break;
+        case KERNELS_SIMD:
+            j = hamming_lanes_simd(pattern, len, buf, n_bytes, first, j, end,
+                                   max, distances);
+            break;
+        case KERNELS_AVX2:
+#if defined(__x86_64__) || defined(__i386__)
+            j = hamming_lanes_avx2(pattern, len, buf, n_bytes, first, j, end,
+                                   max, distances);
+#endif
+            break;
+    }
+
+    // The last windows (and long patterns with a large max)
+    for (; j < end; j++) {
+        int size = n_bytes - j < len ? n_bytes - j : len;
+        int d = 0;
+
+        for (x = 0; x < size && d <= max; x++) {
+            d += pattern[x] != buf[j + x];
+        }
+        distances[j - first] = d <= max ? d : max + 1;
+    }
+}
+
+// Complementary strand of a DNA pattern, read in the same direction (5' to
+// 3'). Symbols other than ACGT (N, ...) are kept as is.
+void reverse_complement(char *pattern, int len, char *rc) {
+    const char *bases = "ACGTacgt";
+    const char *complements = "TGCAtgca";
+    char *found;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        rc[i] = pattern[len - 1 - i];
+        found = strchr(bases, rc[i]);
+        if (rc[i] != '\0' && found != NULL) {
+            rc[i] = complements[found - bases];
+        }
+    }
+    rc[len] = '\0';
+}
+
+// histogram[d] is the number of windows at distance d, 0 <= d <= approx_factor
+void print_histogram(char *pattern, const char *strand, int *histogram,
+                     int approx_factor) {
+    int d;
+
+    printf("Matches per distance for pattern <%.100s>%s:", pattern, strand);
+    for (d = 0; d <= approx_factor; d++) {
+        printf(" %d:%d", d, histogram[d]);
+    }
+    printf("\n");
+}